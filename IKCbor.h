@@ -0,0 +1,168 @@
+/* IntelliKeys CBOR event writer
+ * Copyright 2018-2019 gdsports625@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Build CBOR (RFC 8949) events without heap memory. IKCborWriter has the
+ * same calls as IKJsonWriter in IKJson.h and writes the same event as a
+ * CBOR map, so a host can decode either one into the same object.
+ *
+ *   cbor.begin("press");               // {"evt":"press"
+ *   cbor.member("x", 3);               // ,"x":3
+ *   size_t len = cbor.end();           // }
+ *
+ * Maps and arrays use the indefinite length encoding so members can be
+ * added without knowing the count up front. Each event is one top level
+ * map and events follow each other with nothing in between, which is a
+ * CBOR sequence (RFC 8742).
+ *
+ * This file only uses the C library so it also builds on Linux.
+ */
+
+#ifndef _IKCBOR_H_
+#define _IKCBOR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Longest event. The timeline event is the longest.
+#define IKC_MAX_EVENT   (192)
+
+// CBOR major types
+#define IKC_UNSIGNED    (0x00)
+#define IKC_NEGATIVE    (0x20)
+#define IKC_TEXT        (0x60)
+#define IKC_ARRAY_START (0x9F)
+#define IKC_MAP_START   (0xBF)
+#define IKC_BREAK       (0xFF)
+
+class IKCborWriter {
+    public:
+        IKCborWriter()
+        {
+            clear();
+        }
+
+        void clear(void) {
+            len = 0;
+            overflow = false;
+        }
+
+        // Start a new event map with "evt":"name"
+        void begin(const char *evt) {
+            clear();
+            put(IKC_MAP_START);
+            member("evt", evt);
+        }
+
+        // The key of a member. Follow with a value or an array.
+        void member(const char *key) {
+            string(key);
+        }
+
+        void member(const char *key, int32_t value) {
+            member(key);
+            number(value);
+        }
+
+        void member(const char *key, const char *value) {
+            member(key);
+            string(value);
+        }
+
+        void number(int32_t value) {
+            if (value < 0) {
+                head(IKC_NEGATIVE, (uint32_t)(-1 - value));
+            }
+            else {
+                head(IKC_UNSIGNED, (uint32_t)value);
+            }
+        }
+
+        void string(const char *s) {
+            size_t n = strlen(s);
+            head(IKC_TEXT, n);
+            for (size_t i = 0; i < n; i++) put(s[i]);
+        }
+
+        void beginArray(void) {
+            put(IKC_ARRAY_START);
+        }
+
+        void endArray(void) {
+            put(IKC_BREAK);
+        }
+
+        // Close the map. Returns the event length or 0 if it did not fit.
+        size_t end(void) {
+            put(IKC_BREAK);
+            return (overflow) ? 0 : len;
+        }
+
+        const uint8_t *data(void) {
+            return buf;
+        }
+
+        size_t length(void) {
+            return len;
+        }
+
+    private:
+        uint8_t buf[IKC_MAX_EVENT];
+        size_t len;
+        bool overflow;
+
+        void put(uint8_t c) {
+            if (len < sizeof(buf)) {
+                buf[len++] = c;
+            }
+            else {
+                overflow = true;
+            }
+        }
+
+        // Major type and argument in the shortest form
+        void head(uint8_t major, uint32_t value) {
+            if (value < 24) {
+                put(major | value);
+            }
+            else if (value <= 0xFF) {
+                put(major | 24);
+                put(value);
+            }
+            else if (value <= 0xFFFF) {
+                put(major | 25);
+                put(value >> 8);
+                put(value);
+            }
+            else {
+                put(major | 26);
+                put(value >> 24);
+                put(value >> 16);
+                put(value >> 8);
+                put(value);
+            }
+        }
+};
+
+#endif /* _IKCBOR_H_ */
@@ -0,0 +1,392 @@
+/* IntelliKeys JSON event writer
+ * Copyright 2018-2019 gdsports625@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Build JSON event lines and parse JSON command lines without printf or
+ * heap memory. The writer knows just enough JSON for the ikevent events:
+ * one object per line with number, string, and array of number members.
+ * The line is built in a fixed buffer and then queued whole, for example
+ * in an IKLinkTxRing, so a full ring never sends half a line.
+ *
+ *   json.begin("press");               // {"evt":"press"
+ *   json.member("x", 3);               // ,"x":3
+ *   size_t len = json.end();           // }\r\n
+ *   txRing.write(json.data(), len);
+ *
+ * IKJsonReader parses one flat object per line, such as
+ * {"cmd":"setled","num":1,"val":1}, one byte at a time. Values are strings
+ * or integers.
+ *
+ * This file only uses the C library so it also builds on Linux.
+ */
+
+#ifndef _IKJSON_H_
+#define _IKJSON_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Longest line including the line end. The timeline event is the longest.
+#define IKJ_MAX_LINE    (256)
+
+// Command line limits. Longer keys or strings or more members make the
+// line invalid.
+#define IKJ_MAX_MEMBERS (8)
+#define IKJ_MAX_KEY     (8)     // including NUL
+#define IKJ_MAX_STRING  (16)    // including NUL
+
+// FNV-1a hash of a NUL terminated string. It is constexpr so a switch can
+// use ikj_hash("name") as case labels. The compiler rejects two names with
+// the same hash so the labels form a perfect hash of the names.
+constexpr uint32_t ikj_hash(const char *s, uint32_t h = 2166136261UL)
+{
+    return (*s == '\0') ? h : ikj_hash(s + 1, (h ^ (uint8_t)*s) * 16777619UL);
+}
+
+// Write value in decimal to buf. Returns the number of chars, at most 11.
+// buf is not NUL terminated.
+inline size_t ikj_format_int(char *buf, int32_t value)
+{
+    char digits[10];
+    size_t n = 0;
+    size_t len = 0;
+    uint32_t u = (value < 0) ? (uint32_t)0 - (uint32_t)value : (uint32_t)value;
+
+    do {
+        digits[n++] = '0' + (u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (value < 0) buf[len++] = '-';
+    while (n > 0) buf[len++] = digits[--n];
+    return len;
+}
+
+class IKJsonWriter {
+    public:
+        IKJsonWriter()
+        {
+            clear();
+        }
+
+        void clear(void) {
+            len = 0;
+            overflow = false;
+        }
+
+        // Start a new line with {"evt":"name"
+        void begin(const char *evt) {
+            clear();
+            put('{');
+            member("evt", evt);
+        }
+
+        // ,"key": Follow with a value or an array.
+        void member(const char *key) {
+            string(key);
+            put(':');
+        }
+
+        void member(const char *key, int32_t value) {
+            member(key);
+            number(value);
+        }
+
+        void member(const char *key, const char *value) {
+            member(key);
+            string(value);
+        }
+
+        void number(int32_t value) {
+            separator();
+            if ((len + 11) > sizeof(line)) {
+                overflow = true;
+                return;
+            }
+            len += ikj_format_int(line + len, value);
+        }
+
+        // Quote and escape a NUL terminated string
+        void string(const char *s) {
+            separator();
+            put('"');
+            while (*s) {
+                char c = *s++;
+                if ((c == '"') || (c == '\\')) {
+                    put('\\');
+                    put(c);
+                }
+                else if ((uint8_t)c < 0x20) {
+                    static const char hex[] = "0123456789abcdef";
+                    put('\\'); put('u'); put('0'); put('0');
+                    put(hex[(c >> 4) & 0x0F]);
+                    put(hex[c & 0x0F]);
+                }
+                else {
+                    put(c);
+                }
+            }
+            put('"');
+        }
+
+        void beginArray(void) {
+            separator();
+            put('[');
+        }
+
+        void endArray(void) {
+            put(']');
+        }
+
+        // Close the object and end the line. Returns the line length or 0
+        // if the line did not fit.
+        size_t end(void) {
+            put('}');
+            put('\r');
+            put('\n');
+            return (overflow) ? 0 : len;
+        }
+
+        const uint8_t *data(void) {
+            return (const uint8_t *)line;
+        }
+
+        size_t length(void) {
+            return len;
+        }
+
+    private:
+        char line[IKJ_MAX_LINE];
+        size_t len;
+        bool overflow;
+
+        void put(char c) {
+            if (len < sizeof(line)) {
+                line[len++] = c;
+            }
+            else {
+                overflow = true;
+            }
+        }
+
+        // A comma goes before every value and key except the first one in
+        // an object or array and the value after a key.
+        void separator(void) {
+            if (len == 0) return;
+            char last = line[len-1];
+            if ((last != '{') && (last != '[') && (last != ':')) put(',');
+        }
+};
+
+class IKJsonReader {
+    public:
+        IKJsonReader() :
+            lines(0),
+            errors(0)
+        {
+            reset();
+        }
+
+        // Returns true when c ends a line holding one valid object. Then
+        // use string() and number() to get the members until the next
+        // call. Blank lines are ignored.
+        bool put(char c) {
+            if (c == '\n') {
+                bool ok = (state == DONE);
+                if (ok) {
+                    lines++;
+                }
+                else if (state != START) {
+                    errors++;
+                }
+                if (!ok) count = 0;
+                state = START;
+                return ok;
+            }
+            if (state == ERROR) return false;
+            switch (state) {
+                case START:
+                    if (isSpace(c)) return false;
+                    if (c != '{') return fail();
+                    count = 0;
+                    state = KEY_START;
+                    break;
+                case KEY_START:
+                    if (isSpace(c)) return false;
+                    if ((c == '}') && (count == 0)) {
+                        state = DONE;
+                        break;
+                    }
+                    if ((c != '"') || (count >= IKJ_MAX_MEMBERS)) return fail();
+                    members[count].key[0] = '\0';
+                    textLen = 0;
+                    state = KEY;
+                    break;
+                case KEY:
+                    if (c == '"') {
+                        state = COLON;
+                        break;
+                    }
+                    if (!addText(members[count].key, IKJ_MAX_KEY, c)) return fail();
+                    break;
+                case COLON:
+                    if (isSpace(c)) return false;
+                    if (c != ':') return fail();
+                    state = VALUE_START;
+                    break;
+                case VALUE_START:
+                    if (isSpace(c)) return false;
+                    if (c == '"') {
+                        members[count].isString = true;
+                        members[count].text[0] = '\0';
+                        textLen = 0;
+                        state = STRING;
+                    }
+                    else if ((c == '-') || isDigit(c)) {
+                        members[count].isString = false;
+                        members[count].value = 0;
+                        negative = (c == '-');
+                        digits = 0;
+                        state = NUMBER;
+                        if (isDigit(c)) return addDigit(c);
+                    }
+                    else {
+                        return fail();
+                    }
+                    break;
+                case STRING:
+                    if (c == '"') {
+                        count++;
+                        state = NEXT;
+                        break;
+                    }
+                    // Command strings are plain names so escapes are not
+                    // supported
+                    if ((c == '\\') || ((uint8_t)c < 0x20)) return fail();
+                    if (!addText(members[count].text, IKJ_MAX_STRING, c)) return fail();
+                    break;
+                case NUMBER:
+                    if (isDigit(c)) return addDigit(c);
+                    if (digits == 0) return fail();
+                    if (negative) members[count].value = -members[count].value;
+                    count++;
+                    state = NEXT;
+                    return put(c);
+                case NEXT:
+                    if (isSpace(c)) return false;
+                    if (c == ',') {
+                        state = KEY_START;
+                    }
+                    else if (c == '}') {
+                        state = DONE;
+                    }
+                    else {
+                        return fail();
+                    }
+                    break;
+                case DONE:
+                    if (!isSpace(c)) return fail();
+                    break;
+                default:
+                    break;
+            }
+            return false;
+        }
+
+        // Value of a string member or NULL if there is no such member
+        const char *string(const char *key) {
+            const member_t *m = find(key);
+            return ((m != NULL) && m->isString) ? m->text : NULL;
+        }
+
+        // Value of a number member or otherwise if there is no such member
+        int32_t number(const char *key, int32_t otherwise) {
+            const member_t *m = find(key);
+            return ((m != NULL) && !m->isString) ? m->value : otherwise;
+        }
+
+        void reset(void) {
+            state = START;
+            count = 0;
+        }
+
+        // Statistics
+        uint32_t lines;         // valid lines
+        uint32_t errors;        // lines dropped because they were not valid
+
+    private:
+        enum {
+            START, KEY_START, KEY, COLON, VALUE_START, STRING, NUMBER, NEXT,
+            DONE, ERROR
+        } state;
+
+        typedef struct {
+            char key[IKJ_MAX_KEY];
+            bool isString;
+            char text[IKJ_MAX_STRING];
+            int32_t value;
+        } member_t;
+
+        member_t members[IKJ_MAX_MEMBERS];
+        uint8_t count;
+        uint8_t textLen;
+        uint8_t digits;
+        bool negative;
+
+        static bool isSpace(char c) {
+            return (c == ' ') || (c == '\t') || (c == '\r');
+        }
+
+        static bool isDigit(char c) {
+            return (c >= '0') && (c <= '9');
+        }
+
+        // The rest of the line is dropped
+        bool fail(void) {
+            state = ERROR;
+            return false;
+        }
+
+        bool addText(char *text, size_t size, char c) {
+            if ((size_t)(textLen + 1) >= size) return false;
+            text[textLen++] = c;
+            text[textLen] = '\0';
+            return true;
+        }
+
+        // At most 9 digits so the value cannot overflow
+        bool addDigit(char c) {
+            if (++digits > 9) return fail();
+            members[count].value = (members[count].value * 10) + (c - '0');
+            return false;
+        }
+
+        const member_t *find(const char *key) {
+            for (uint8_t i = 0; i < count; i++) {
+                if (strcmp(members[i].key, key) == 0) return &members[i];
+            }
+            return NULL;
+        }
+};
+
+#endif /* _IKJSON_H_ */
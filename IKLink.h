@@ -0,0 +1,950 @@
+/* IntelliKeys UART bridge link protocol version 2
+ * Copyright 2018-2019 gdsports625@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Frame format on the wire
+ *
+ *   COBS(flags, record, record, ..., crc_lo, crc_hi) 0x00
+ *
+ * Each frame is COBS encoded so 0x00 only appears as the frame delimiter. A
+ * receiver that loses sync waits for the next 0x00. A frame with flags the
+ * receiver does not understand is dropped. crc is CRC-16/CCITT-FALSE over
+ * flags, header and all records.
+ *
+ * If flags has IKL_FLAG_HEADER, a 5 byte header follows flags. It holds a
+ * frame sequence number and the sender micros() when the oldest event in
+ * the frame was received, LSB first.
+ *
+ * Each record is {len, type, params...} where len is the number of bytes
+ * starting with type. The types are the IK_EVENT and IK_CMD values. A frame
+ * holds as many records as fit in IKL_MAX_FRAME bytes.
+ *
+ * This file only uses the C library and IKProtocol.h so the sketches on
+ * both ends of the link and host programs on Linux share one codec.
+ */
+
+#ifndef _IKLINK_H_
+#define _IKLINK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "IKProtocol.h"
+
+// Maximum decoded frame size including flags and CRC
+#define IKL_MAX_FRAME       (160)
+// Maximum encoded frame size including the COBS overhead and delimiter
+#define IKL_MAX_ENCODED     (IKL_MAX_FRAME + (IKL_MAX_FRAME / 254) + 2)
+// Maximum record size including the len byte
+#define IKL_MAX_RECORD      (IKL_MAX_FRAME - 3)
+
+// Frame flags
+#define IKL_FLAG_HEADER     (0x01)
+#define IKL_HEADER_LEN      (5)
+
+typedef struct
+{
+    uint8_t  seq;       // frame sequence number, wraps at 256
+    uint32_t usec;      // sender micros() when the oldest event was received
+} ikl_header_t;
+
+// CRC-16/CCITT-FALSE, polynomial 0x1021, initial value 0xFFFF
+inline uint16_t ikl_crc16_update(uint16_t crc, uint8_t data)
+{
+    uint8_t x = (crc >> 8) ^ data;
+    x ^= x >> 4;
+    return (crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x;
+}
+
+inline uint16_t ikl_crc16(const uint8_t *buf, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    while (len--) crc = ikl_crc16_update(crc, *buf++);
+    return crc;
+}
+
+// COBS encode len bytes from in to out, without the 0x00 delimiter. out
+// must hold len + (len / 254) + 1 bytes. Returns the number of bytes in out.
+inline size_t ikl_cobs_encode(const uint8_t *in, size_t len, uint8_t *out)
+{
+    uint8_t *code = out;
+    uint8_t *p = out + 1;
+
+    *code = 1;
+    while (len--) {
+        if (*in == 0) {
+            code = p++;
+            *code = 1;
+        }
+        else {
+            *p++ = *in;
+            if (++(*code) == 0xFF && len) {
+                code = p++;
+                *code = 1;
+            }
+        }
+        in++;
+    }
+    return p - out;
+}
+
+// COBS decode len bytes in place. Returns the decoded length or 0 if the
+// input is not valid COBS.
+inline size_t ikl_cobs_decode(uint8_t *buf, size_t len)
+{
+    const uint8_t *in = buf;
+    const uint8_t *end = buf + len;
+    uint8_t *out = buf;
+
+    while (in < end) {
+        uint8_t code = *in++;
+        if (code == 0) return 0;
+        for (uint8_t i = 1; i < code; i++) {
+            if (in >= end) return 0;
+            *out++ = *in++;
+        }
+        if ((code != 0xFF) && (in < end)) *out++ = 0;
+    }
+    return out - buf;
+}
+
+/*
+ * UART rates for IK_CMD_BAUD. Both sides start at index 0. The client asks
+ * for a higher rate, then checks it by sending the test pattern in
+ * IK_CMD_BAUD_TEST. The bridge returns the pattern in IK_EVENT_BAUD_TEST.
+ * The pattern has 0x00 and 0xFF and alternating bits.
+ */
+#define IKL_BAUD_COUNT      (4)
+#define IKL_BAUD_TEST_LEN   (16)
+
+inline uint32_t ikl_baud(uint8_t index)
+{
+    static const uint32_t rates[IKL_BAUD_COUNT] = {
+        115200, 230400, 460800, 921600
+    };
+    return (index < IKL_BAUD_COUNT) ? rates[index] : 0;
+}
+
+inline const uint8_t *ikl_baud_test(void)
+{
+    static const uint8_t pattern[IKL_BAUD_TEST_LEN] = {
+        0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x33, 0xCC,
+        0x01, 0x80, 0xFE, 0x7F, 0x00, 0x00, 0xA5, 0x5A
+    };
+    return pattern;
+}
+
+/*
+ * Options the client turns on with IK_CMD_OPTIONS
+ */
+#define IKL_OPT_PACKED_MEMBRANE (0x01)
+#define IKL_OPT_FRAME_HEADER    (0x02)
+
+/*
+ * Packed membrane events. Each 16 bit word, LSB first, is
+ *
+ *   bit 15     1 = press, 0 = release
+ *   bit 14-10  x
+ *   bit 9-5    y
+ *   bit 4-0    run - 1
+ *
+ * and stands for run events at x, x+1, ... x+run-1 on row y. A fingertip
+ * usually presses several cells next to each other at the same time so one
+ * word often holds several events.
+ */
+#define IKL_PACKED_MAX_WORDS    (32)
+
+class IKLinkMembranePacker {
+    public:
+        IKLinkMembranePacker() :
+            count(0)
+        {
+        }
+
+        bool empty(void) {
+            return count == 0;
+        }
+
+        // Returns false if x or y do not fit in 5 bits or the packer is full.
+        // If full, take() the record and try again.
+        bool add(bool press, uint8_t x, uint8_t y) {
+            if ((x > 31) || (y > 31)) return false;
+            if (count > 0) {
+                uint16_t last = words[count-1];
+                uint8_t run = (last & 0x1F) + 1;
+                if ((run < 32) && ((last & 0x8000) == (press ? 0x8000 : 0)) &&
+                        (((last >> 5) & 0x1F) == y) &&
+                        (((last >> 10) & 0x1F) + run == x)) {
+                    words[count-1]++;
+                    return true;
+                }
+            }
+            if (count >= IKL_PACKED_MAX_WORDS) return false;
+            words[count++] = (press ? 0x8000 : 0) | (x << 10) | (y << 5);
+            return true;
+        }
+
+        // Copy the record {type, words...} to out which must hold
+        // 1 + (2 * IKL_PACKED_MAX_WORDS) bytes. Returns the record length.
+        // The packer is empty after this.
+        uint8_t take(uint8_t type, uint8_t *out) {
+            uint8_t len = 0;
+            out[len++] = type;
+            for (uint8_t i = 0; i < count; i++) {
+                out[len++] = (uint8_t)words[i];
+                out[len++] = (uint8_t)(words[i] >> 8);
+            }
+            count = 0;
+            return len;
+        }
+
+    private:
+        uint16_t words[IKL_PACKED_MAX_WORDS];
+        uint8_t count;
+};
+
+// Call function for each event in the words of a packed membrane record
+inline void ikl_unpack_membrane(const uint8_t *words, size_t len,
+        void (*function)(bool press, uint8_t x, uint8_t y))
+{
+    for (size_t i = 0; (i + 1) < len; i += 2) {
+        uint16_t word = words[i] | (words[i+1] << 8);
+        uint8_t x = (word >> 10) & 0x1F;
+        uint8_t y = (word >> 5) & 0x1F;
+        uint8_t run = (word & 0x1F) + 1;
+        for (uint8_t j = 0; j < run; j++) {
+            (*function)((word & 0x8000) != 0, x + j, y);
+        }
+    }
+}
+
+/*
+ * IK_EVENT_SNAPSHOT params are ready, membrane bitmap, switches, sensors,
+ * leds_lo, leds_hi, onoff, major, minor, serial number. Bit x%8 of byte
+ * y*IKL_SNAPSHOT_ROW+x/8 of the bitmap is 1 if (x,y) is pressed.
+ */
+#define IKL_SNAPSHOT_ROW        ((IK_RESOLUTION_X + 7) / 8)
+#define IKL_SNAPSHOT_BITMAP     (IK_RESOLUTION_Y * IKL_SNAPSHOT_ROW)
+#define IKL_SNAPSHOT_PARAMS     (1 + IKL_SNAPSHOT_BITMAP + 7 + IK_EEPROM_SN_SIZE)
+
+// IK_EVENT_REPLAY params are reports, usec, each 4 bytes LSB first, and
+// errors. ikevent sends it when a replay ends.
+#define IKL_REPLAY_PARAMS       (9)
+
+// Number of parameter bytes after type and seq of each command. -1 if the
+// command is not supported over the link. IK_CMD_CREDIT is not listed
+// because it has no seq. See IKLinkCredit.
+inline int ikl_command_params(uint8_t cmd)
+{
+    switch (cmd) {
+        case IK_CMD_GET_VERSION:
+        case IK_CMD_ONOFFSWITCH:
+        case IK_CMD_CORRECT:
+        case IK_CMD_RESET_DEVICE:
+        case IK_CMD_ALL_SENSORS:
+        case IK_CMD_GET_SN:
+        case IK_CMD_GET_SNAPSHOT:
+            return 0;
+        case IK_CMD_BAUD:
+        case IK_CMD_OPTIONS:
+            return 1;
+        case IK_CMD_LED:
+            return 2;
+        case IK_CMD_TONE:
+            return 3;
+        case IK_CMD_SET_LEDS:
+            return 4;
+        case IK_CMD_BAUD_TEST:
+            return IKL_BAUD_TEST_LEN;
+        default:
+            return -1;
+    }
+}
+
+// True if the command {type, seq, params...} has the length
+// ikl_command_params gives for its type
+inline bool ikl_command_ok(const uint8_t *command, size_t len)
+{
+    return (len >= 2) && ((int)(len - 2) == ikl_command_params(command[0]));
+}
+
+// Minimum number of parameter bytes after type of each event. -1 if the
+// event is not sent over the link. Receivers ignore extra bytes so fields
+// can be added at the end later.
+inline int ikl_event_params(uint8_t type)
+{
+    switch (type) {
+        case IK_EVENT_CORRECT_DONE:
+        case IK_EVENT_CONNECT:
+        case IK_EVENT_DISCONNECT:
+        case IK_EVENT_MEMBRANE_PACKED:
+            return 0;
+        case IK_EVENT_ONOFFSWITCH:
+        case IK_EVENT_TIMELINE:
+            return 1;
+        case IK_EVENT_ACK:
+        case IK_EVENT_MEMBRANE_PRESS:
+        case IK_EVENT_MEMBRANE_RELEASE:
+        case IK_EVENT_SWITCH:
+        case IK_EVENT_SENSOR_CHANGE:
+        case IK_EVENT_VERSION:
+        case IK_EVENT_CORRECT_MEMBRANE:
+        case IK_EVENT_CORRECT_SWITCH:
+            return 2;
+        case IK_EVENT_BAUD_TEST:
+            return IKL_BAUD_TEST_LEN;
+        case IK_EVENT_SERNUM:
+            return IK_EEPROM_SN_SIZE;
+        case IK_EVENT_SNAPSHOT:
+            return IKL_SNAPSHOT_PARAMS;
+        case IK_EVENT_REPLAY:
+            return IKL_REPLAY_PARAMS;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * An event record split into its fields. a and b are the first two params,
+ * for example x and y, switch number and state, or major and minor. They
+ * are 0 if the event has fewer params. params and len cover all params for
+ * the variable length events.
+ */
+typedef struct
+{
+    uint8_t type;
+    uint8_t a;
+    uint8_t b;
+    const uint8_t *params;
+    size_t len;
+} ikl_event_t;
+
+// Returns false if the record {type, params...} is too short or the type
+// is unknown
+inline bool ikl_parse_event(const uint8_t *record, size_t len,
+        ikl_event_t *event)
+{
+    if (len < 1) return false;
+    int params = ikl_event_params(record[0]);
+    if ((params < 0) || ((len - 1) < (size_t)params)) return false;
+    event->type = record[0];
+    event->a = (len > 1) ? record[1] : 0;
+    event->b = (len > 2) ? record[2] : 0;
+    event->params = record + 1;
+    event->len = len - 1;
+    return true;
+}
+
+/*
+ * Collect records then encode them as one frame.
+ */
+class IKLinkEncoder {
+    public:
+        IKLinkEncoder() :
+            withHeader(false)
+        {
+            clear();
+        }
+
+        void clear(void) {
+            frame[0] = (withHeader) ? IKL_FLAG_HEADER : 0;
+            if (withHeader) memset(frame + 1, 0, IKL_HEADER_LEN);
+            frameLen = start();
+        }
+
+        bool empty(void) {
+            return frameLen <= start();
+        }
+
+        // Send a header in the following frames. Drops pending records.
+        void useHeader(bool on) {
+            withHeader = on;
+            clear();
+        }
+
+        // Set the header of the pending frame
+        void setHeader(uint8_t seq, uint32_t usec) {
+            if (!withHeader) return;
+            frame[1] = seq;
+            for (uint8_t i = 0; i < 4; i++) frame[2 + i] = (uint8_t)(usec >> (8 * i));
+        }
+
+        // Most bytes encode() returns if extra more bytes are added
+        size_t encodedSize(size_t extra = 0) {
+            size_t len = frameLen + extra + 2;
+            return len + (len / 254) + 2;
+        }
+
+        // Add the record {len, type, params[0..len-2]}. len counts type and
+        // params. Returns false if the record does not fit. In that case
+        // encode() the pending records and try again.
+        bool add(uint8_t type, const uint8_t *params, uint8_t paramLen) {
+            if ((frameLen + 2 + paramLen + 2) > IKL_MAX_FRAME) return false;
+            frame[frameLen++] = paramLen + 1;
+            frame[frameLen++] = type;
+            if (paramLen) memcpy(frame + frameLen, params, paramLen);
+            frameLen += paramLen;
+            return true;
+        }
+
+        // Add a record that already starts with type
+        bool add(const uint8_t *record, uint8_t len) {
+            if (len == 0) return false;
+            return add(record[0], record + 1, len - 1);
+        }
+
+        // Encode the pending records with CRC, COBS and delimiter into out
+        // which must hold IKL_MAX_ENCODED bytes. Returns the number of bytes
+        // to send. The encoder is empty after this.
+        size_t encode(uint8_t *out) {
+            uint16_t crc = ikl_crc16(frame, frameLen);
+            frame[frameLen++] = (uint8_t)crc;
+            frame[frameLen++] = (uint8_t)(crc >> 8);
+            size_t outLen = ikl_cobs_encode(frame, frameLen, out);
+            out[outLen++] = 0;
+            clear();
+            return outLen;
+        }
+
+    private:
+        uint8_t frame[IKL_MAX_FRAME];
+        size_t frameLen;
+        bool withHeader;
+
+        size_t start(void) {
+            return (withHeader) ? 1 + IKL_HEADER_LEN : 1;
+        }
+};
+
+/*
+ * Decode a byte stream one byte at a time. For each record of each valid
+ * frame, call the record function with {type, params...} and the number of
+ * bytes starting with type.
+ */
+class IKLinkDecoder {
+    public:
+        IKLinkDecoder(void (*function)(const uint8_t *record, size_t len)) :
+            frames(0),
+            crcErrors(0),
+            formatErrors(0),
+            overruns(0),
+            record_callback(function),
+            frame_callback(NULL),
+            bufLen(0),
+            overrun(false)
+        {
+        }
+
+        // Returns true if the byte completed a valid frame
+        bool put(uint8_t c) {
+            if (c != 0) {
+                if (bufLen < sizeof(buf)) {
+                    buf[bufLen++] = c;
+                }
+                else {
+                    overrun = true;
+                }
+                return false;
+            }
+            // Delimiter. Drop the frame if it was too long.
+            if (overrun) {
+                overruns++;
+                overrun = false;
+                bufLen = 0;
+                return false;
+            }
+            if (bufLen == 0) return false;
+            bool ok = decode();
+            bufLen = 0;
+            return ok;
+        }
+
+        void put(const uint8_t *data, size_t len) {
+            while (len--) put(*data++);
+        }
+
+        // Call function after the records of each valid frame. header is
+        // NULL if the frame has no header.
+        void onFrame(void (*function)(const ikl_header_t *header)) {
+            frame_callback = function;
+        }
+
+        // Statistics
+        uint32_t frames;        // valid frames
+        uint32_t crcErrors;     // frames dropped because of CRC error
+        uint32_t formatErrors;  // frames dropped because of bad COBS,
+                                // flags, or record length
+        uint32_t overruns;      // frames dropped because they were too long
+
+    private:
+        void (*record_callback)(const uint8_t *record, size_t len);
+        void (*frame_callback)(const ikl_header_t *header);
+        uint8_t buf[IKL_MAX_ENCODED];
+        size_t bufLen;
+        bool overrun;
+
+        bool decode(void) {
+            size_t len = ikl_cobs_decode(buf, bufLen);
+            if (len < 3) {
+                formatErrors++;
+                return false;
+            }
+            uint16_t crc = buf[len-2] | (buf[len-1] << 8);
+            len -= 2;
+            if (ikl_crc16(buf, len) != crc) {
+                crcErrors++;
+                return false;
+            }
+            if (buf[0] & ~IKL_FLAG_HEADER) {
+                formatErrors++;
+                return false;
+            }
+            ikl_header_t header;
+            size_t first = 1;
+            if (buf[0] & IKL_FLAG_HEADER) {
+                if (len < 1 + IKL_HEADER_LEN) {
+                    formatErrors++;
+                    return false;
+                }
+                header.seq = buf[1];
+                header.usec = buf[2] | (buf[3] << 8) | ((uint32_t)buf[4] << 16) |
+                    ((uint32_t)buf[5] << 24);
+                first += IKL_HEADER_LEN;
+            }
+            // Check all record lengths before calling back so a bad frame
+            // is dropped as a whole.
+            size_t i = first;
+            while (i < len) {
+                if ((buf[i] == 0) || ((i + 1 + buf[i]) > len)) {
+                    formatErrors++;
+                    return false;
+                }
+                i += 1 + buf[i];
+            }
+            frames++;
+            for (i = first; i < len; i += 1 + buf[i]) {
+                if (record_callback) (*record_callback)(buf + i + 1, buf[i]);
+            }
+            if (frame_callback) {
+                (*frame_callback)((buf[0] & IKL_FLAG_HEADER) ? &header : NULL);
+            }
+            return true;
+        }
+};
+
+// At most this many received bytes are decoded per loop() so a flood of
+// input cannot delay USB polling. The rest waits in the UART RX buffer.
+#ifndef IKL_RX_BUDGET
+#define IKL_RX_BUDGET       (64)
+#endif
+
+/*
+ * Transmit ring for encoded frames. write() never blocks. drain() moves as
+ * many bytes as the port can take without blocking, based on
+ * availableForWrite(). On SAMD the Uart TX buffer is emptied by the data
+ * register empty interrupt so the bytes go out while loop() keeps polling
+ * USB.
+ */
+#ifndef IKL_TX_RING_SIZE
+// Must be a power of 2
+#define IKL_TX_RING_SIZE    (1024)
+#endif
+
+class IKLinkTxRing {
+    public:
+        IKLinkTxRing() :
+            overflows(0),
+            highWater(0),
+            head(0),
+            tail(0)
+        {
+        }
+
+        size_t used(void) {
+            return head - tail;
+        }
+
+        size_t space(void) {
+            return IKL_TX_RING_SIZE - used();
+        }
+
+        // Queue len bytes. A frame is queued whole or not at all so a full
+        // ring never sends a partial frame. Returns false if it does not fit.
+        bool write(const uint8_t *data, size_t len) {
+            if (len > space()) {
+                overflows++;
+                return false;
+            }
+            size_t start = head & (IKL_TX_RING_SIZE - 1);
+            size_t n = IKL_TX_RING_SIZE - start;
+            if (n > len) n = len;
+            memcpy(ring + start, data, n);
+            memcpy(ring, data + n, len - n);
+            head += len;
+            if (used() > highWater) highWater = used();
+            return true;
+        }
+
+        // Send queued bytes to port, for example Serial1, without blocking.
+        // Returns the number of bytes sent.
+        template <class T> size_t drain(T &port) {
+            size_t sent = 0;
+            while (used() > 0) {
+                int room = port.availableForWrite();
+                if (room <= 0) break;
+                size_t start = tail & (IKL_TX_RING_SIZE - 1);
+                size_t n = IKL_TX_RING_SIZE - start;
+                if (n > used()) n = used();
+                if (n > (size_t)room) n = room;
+                n = port.write(ring + start, n);
+                if (n == 0) break;
+                tail += n;
+                sent += n;
+            }
+            return sent;
+        }
+
+        // Statistics
+        uint32_t overflows;     // frames dropped because the ring was full
+        size_t highWater;       // most bytes ever queued
+
+    private:
+        uint8_t ring[IKL_TX_RING_SIZE];
+        size_t head;
+        size_t tail;
+};
+
+/*
+ * Bounded queue of records waiting for link credit. Each record is pushed
+ * with a coalesce key length. 0 means the record must not be lost, for
+ * example membrane and switch edges. Otherwise the first keyLen bytes of
+ * the record are its key. A new record replaces a queued record with the
+ * same key, for example the latest value of a sensor. When the queue is full
+ * the oldest records with a key are dropped first.
+ */
+#ifndef IKL_EVENT_QUEUE_SIZE
+#define IKL_EVENT_QUEUE_SIZE    (512)
+#endif
+// Free bytes needed in the queue before the IK is polled, enough for the
+// events of one poll
+#ifndef IKL_QUEUE_HEADROOM
+#define IKL_QUEUE_HEADROOM      (128)
+#endif
+
+class IKLinkEventQueue {
+    public:
+        IKLinkEventQueue() :
+            dropped(0),
+            coalesced(0),
+            overflows(0),
+            used(0)
+        {
+        }
+
+        size_t space(void) {
+            return IKL_EVENT_QUEUE_SIZE - used;
+        }
+
+        bool empty(void) {
+            return used == 0;
+        }
+
+        // Queue the record {type, params...}. usec is the micros() when the
+        // event was received. A replaced record keeps its old time. Returns
+        // false if the record was lost.
+        bool push(const uint8_t *record, uint8_t len, uint8_t keyLen,
+                uint32_t usec = 0) {
+            if ((len == 0) || (keyLen > len)) return false;
+            if (keyLen) {
+                for (size_t i = 0; i < used; i += ENTRY_HDR + buf[i]) {
+                    if ((buf[i+1] == keyLen) && (buf[i] == len) &&
+                            (memcmp(buf + i + ENTRY_HDR, record, keyLen) == 0)) {
+                        memcpy(buf + i + ENTRY_HDR, record, len);
+                        coalesced++;
+                        return true;
+                    }
+                }
+            }
+            // Make room by dropping the oldest records that have a key
+            size_t i = 0;
+            while (((size_t)len + ENTRY_HDR > space()) && (i < used)) {
+                if (buf[i+1]) {
+                    remove(i);
+                    dropped++;
+                }
+                else {
+                    i += ENTRY_HDR + buf[i];
+                }
+            }
+            if ((size_t)len + ENTRY_HDR > space()) {
+                overflows++;
+                return false;
+            }
+            buf[used++] = len;
+            buf[used++] = keyLen;
+            memcpy(buf + used, &usec, sizeof(usec));
+            used += sizeof(usec);
+            memcpy(buf + used, record, len);
+            used += len;
+            return true;
+        }
+
+        // Queue the event record {type, params...} with the key length of
+        // its type. Only the latest value of each sensor and the latest
+        // successful ACK are kept. A rejected ACK is never replaced
+        // because the client counts an ACK as covering all earlier
+        // commands and would never see the rejection. Everything else is
+        // never dropped.
+        bool pushEvent(const uint8_t *record, uint8_t len, uint32_t usec = 0) {
+            uint8_t keyLen = 0;
+            if (len == 0) return false;
+            if ((record[0] == IK_EVENT_SENSOR_CHANGE) && (len >= 2)) {
+                keyLen = 2;
+            }
+            else if ((record[0] == IK_EVENT_ACK) && (len >= 3)) {
+                if (record[2] == 0) {
+                    keyLen = 1;
+                }
+                else {
+                    seal(record, 1);
+                }
+            }
+            return push(record, len, keyLen, usec);
+        }
+
+        // Stop the queued records with this key from being replaced or
+        // dropped. A later record with the key is queued after them
+        // instead of taking the place of one of them.
+        void seal(const uint8_t *key, uint8_t keyLen) {
+            for (size_t i = 0; i < used; i += ENTRY_HDR + buf[i]) {
+                if ((buf[i+1] == keyLen) &&
+                        (memcmp(buf + i + ENTRY_HDR, key, keyLen) == 0)) {
+                    buf[i+1] = 0;
+                }
+            }
+        }
+
+        // Move queued records in order to encoder until it is full or the
+        // encoded frame would be longer than limit bytes. If first is true,
+        // the first record is moved even if it is longer than limit. If
+        // usec is not NULL, it is set to the time of the first record moved.
+        void pop(IKLinkEncoder &encoder, size_t limit = IKL_MAX_ENCODED,
+                bool first = false, uint32_t *usec = NULL) {
+            if (usec && used) memcpy(usec, buf + 2, sizeof(*usec));
+            while ((used > 0) &&
+                    ((first && encoder.empty()) ||
+                     (encoder.encodedSize(1 + buf[0]) <= limit)) &&
+                    encoder.add(buf + ENTRY_HDR, buf[0])) {
+                remove(0);
+            }
+        }
+
+        // Statistics
+        uint32_t dropped;       // records with a key dropped to make room
+        uint32_t coalesced;     // records replaced by a newer one
+        uint32_t overflows;     // records lost because the queue was full
+
+    private:
+        // Each entry is {len, keyLen, usec[4], record[len]}
+        static const size_t ENTRY_HDR = 6;
+        uint8_t buf[IKL_EVENT_QUEUE_SIZE];
+        size_t used;
+
+        void remove(size_t i) {
+            size_t n = ENTRY_HDR + buf[i];
+            memmove(buf + i, buf + i + n, used - i - n);
+            used -= n;
+        }
+};
+
+/*
+ * Sender side of the credit based flow control. The receiver counts the
+ * bytes it has taken out of its UART RX buffer and sends the count and the
+ * size of the buffer in a credit record. The sender keeps the bytes it has
+ * sent but the receiver has not yet counted below the buffer size. Until the
+ * first credit record arrives there is no limit so peers without flow
+ * control still work.
+ *
+ * The window must hold at least IKL_MIN_WINDOW bytes so the longest frame,
+ * for example a snapshot, fits in it.
+ *
+ * If bytes are lost on the wire, the counts no longer match. When the
+ * receiver keeps sending the same count for IKL_CREDIT_TIMEOUT ms while the
+ * sender is waiting, the sender assumes the rest was lost and starts over.
+ */
+#define IKL_MIN_WINDOW      (IKL_MAX_ENCODED)
+// The receiver sends a credit record at least this often so a lost one
+// does not stop the link
+#ifndef IKL_CREDIT_PERIOD
+#define IKL_CREDIT_PERIOD   (100)   // ms
+#endif
+#ifndef IKL_CREDIT_TIMEOUT
+#define IKL_CREDIT_TIMEOUT  (500)   // ms
+#endif
+
+class IKLinkCredit {
+    public:
+        IKLinkCredit() :
+            resyncs(0),
+            enabled(false),
+            sent(0),
+            received(0),
+            window(0),
+            progress(0)
+        {
+        }
+
+        // Credit record from the receiver. now is millis().
+        void grant(uint16_t rxCount, uint16_t rxWindow, uint32_t now) {
+            if (!enabled) {
+                sent = rxCount;
+                progress = now;
+            }
+            else if (rxCount != received) {
+                progress = now;
+            }
+            else if ((sent != received) && ((now - progress) > IKL_CREDIT_TIMEOUT)) {
+                sent = rxCount;
+                progress = now;
+                resyncs++;
+            }
+            enabled = true;
+            received = rxCount;
+            window = rxWindow;
+        }
+
+        // Number of encoded bytes that may be sent now
+        size_t available(void) {
+            if (!enabled) return IKL_MAX_ENCODED;
+            uint16_t inFlight = sent - received;
+            return (inFlight >= window) ? 0 : window - inFlight;
+        }
+
+        // True if the receiver has counted everything sent. Then one record
+        // longer than the window may be sent so it cannot block the link.
+        bool idle(void) {
+            return !enabled || (sent == received);
+        }
+
+        void send(size_t len) {
+            sent += len;
+        }
+
+        bool isEnabled(void) {
+            return enabled;
+        }
+
+        uint32_t resyncs;       // times the counts were reset after a loss
+
+    private:
+        bool enabled;
+        uint16_t sent;
+        uint16_t received;
+        uint16_t window;
+        uint32_t progress;      // millis() when received last changed
+};
+
+/*
+ * Link latency and loss from the frame headers. The sender and receiver
+ * clocks are not synchronized, so each delay includes an unknown offset.
+ * The results are the delays above the fastest frame since the last report,
+ * which is the queueing and handling time added on top of the best case.
+ */
+#ifndef IKL_LATENCY_SAMPLES
+#define IKL_LATENCY_SAMPLES (128)
+#endif
+
+typedef struct
+{
+    uint32_t frames;    // frames with a header
+    uint32_t lost;      // frames missing from the sequence
+    uint32_t p50;       // usec above the fastest frame
+    uint32_t p90;
+    uint32_t p99;
+    uint32_t max;
+} ikl_latency_t;
+
+class IKLinkLatency {
+    public:
+        IKLinkLatency() :
+            haveSeq(false)
+        {
+            reset();
+        }
+
+        // Call for each frame with a header. now is the receiver micros()
+        // when the frame has been handled.
+        void frame(const ikl_header_t *header, uint32_t now) {
+            if (haveSeq) {
+                uint8_t gap = header->seq - (uint8_t)(lastSeq + 1);
+                // A big gap means the sender started over
+                if (gap < 128) lost += gap;
+            }
+            haveSeq = true;
+            lastSeq = header->seq;
+            // Delays relative to the first one of the report so the clock
+            // offset cannot wrap between samples. Keep the latest samples.
+            uint32_t delay = now - header->usec;
+            if (frames == 0) base = delay;
+            samples[frames % IKL_LATENCY_SAMPLES] = (int32_t)(delay - base);
+            frames++;
+        }
+
+        // Fill in the results since the last report then start over.
+        // Returns false if there were no frames.
+        bool report(ikl_latency_t *result) {
+            size_t n = (frames < IKL_LATENCY_SAMPLES) ? frames : IKL_LATENCY_SAMPLES;
+            if (n == 0) return false;
+            // Insertion sort is fine for a few hundred samples
+            for (size_t i = 1; i < n; i++) {
+                int32_t x = samples[i];
+                size_t j = i;
+                for (; (j > 0) && (samples[j-1] > x); j--) samples[j] = samples[j-1];
+                samples[j] = x;
+            }
+            int32_t fastest = samples[0];
+            result->frames = frames;
+            result->lost = lost;
+            result->p50 = samples[((n - 1) * 50) / 100] - fastest;
+            result->p90 = samples[((n - 1) * 90) / 100] - fastest;
+            result->p99 = samples[((n - 1) * 99) / 100] - fastest;
+            result->max = samples[n - 1] - fastest;
+            reset();
+            return true;
+        }
+
+    private:
+        int32_t samples[IKL_LATENCY_SAMPLES];
+        uint32_t base;
+        uint32_t frames;
+        uint32_t lost;
+        uint8_t lastSeq;
+        bool haveSeq;
+
+        void reset(void) {
+            frames = 0;
+            lost = 0;
+        }
+};
+
+#endif /* _IKLINK_H_ */
@@ -1,5 +1,34 @@
-#ifndef _INTELLIKEYSDEFS_H_
-#define _INTELLIKEYSDEFS_H_
+/* IntelliKeys command and event codes
+ * Copyright 2018-2019 gdsports625@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Codes shared by the IntelliKeys USB driver, the UART bridge ikrawevent,
+ * and its clients. Most of the values are from the OpenIKeys project. This
+ * file has no Arduino dependencies so host programs can include it too.
+ */
+
+#ifndef _IKPROTOCOL_H_
+#define _IKPROTOCOL_H_
 
 enum IK_LEDS {
     IK_LED_SHIFT=1,
@@ -15,7 +44,7 @@ enum IK_LEDS {
 #define IK_RESOLUTION_Y 24
 
 //  number of switches
-#define IK_NUM_SWITCHES  2
+#define IK_NUM_SWITCHES  6
 
 //  number of sensors
 #define IK_NUM_SENSORS   3
@@ -46,6 +75,12 @@ enum IK_LEDS {
 #define IK_CMD_ALL_SENSORS          CMD_BASE+18
 
 #define IK_CMD_GET_SN               CMD_BASE+40
+#define IK_CMD_CREDIT               CMD_BASE+41
+#define IK_CMD_BAUD                 CMD_BASE+42
+#define IK_CMD_BAUD_TEST            CMD_BASE+43
+#define IK_CMD_OPTIONS              CMD_BASE+44
+#define IK_CMD_GET_SNAPSHOT         CMD_BASE+45
+#define IK_CMD_SET_LEDS             CMD_BASE+46
 
 //
 //  result codes/data sent to the software
@@ -80,10 +115,18 @@ enum IK_LEDS {
 #define IK_EVENT_CONNECT            AIK_EVENT_BASE+1
 #define IK_EVENT_DISCONNECT         AIK_EVENT_BASE+2
 #define IK_EVENT_SERNUM             AIK_EVENT_BASE+3
+#define IK_EVENT_TIMELINE           AIK_EVENT_BASE+4
+#define IK_EVENT_BAUD_TEST          AIK_EVENT_BASE+5
+#define IK_EVENT_MEMBRANE_PACKED    AIK_EVENT_BASE+6
+#define IK_EVENT_SNAPSHOT           AIK_EVENT_BASE+7
+#define IK_EVENT_REPLAY             AIK_EVENT_BASE+8
 
 //
 //  number of light sensors for reading overlay bar codes
 //
 #define IK_MAX_SENSORS              3
 
-#endif /* _INTELLIKEYSDEFS_H_ */
+//  bytes in the serial number stored in the IK EEPROM
+#define IK_EEPROM_SN_SIZE           (29)
+
+#endif /* _IKPROTOCOL_H_ */
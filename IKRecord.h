@@ -0,0 +1,431 @@
+/* IntelliKeys raw report recorder and replayer
+ * Copyright 2018-2019 gdsports625@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Record the raw IK reports passed to the onRawEvent callback and play
+ * them back through IntelliKeys::replay(). A session recorded from a real
+ * user can be replayed as often as needed, in real time, faster, or as
+ * fast as the driver decodes it.
+ *
+ * Log format
+ *
+ *   header, record, record, ...
+ *
+ * The header is "IKR1", IKR_VERSION, and IKR_REPORT_LEN. A log in RAM has
+ * no header, only records. Each record is
+ *
+ *   lead, report bytes
+ *
+ * lead is (usec << 4) | n as an unsigned LEB128 varint: 7 bits per byte,
+ * least significant first, bit 7 set on all but the last byte. usec is
+ * the time since the previous record in microseconds, 0 for the first. n
+ * is the number of report bytes that follow, 0..IKR_REPORT_LEN. Trailing 0
+ * bytes of the report are not stored. A membrane press a few ms after the
+ * previous report takes 6 bytes instead of 8 plus a time stamp.
+ *
+ * Records are only ever added to the end so a log written to a file is
+ * valid up to the last complete record even if the power fails.
+ *
+ * This file only uses the C library so it also builds on Linux. Sources
+ * and sinks are any object with int read() and size_t write(buf, len),
+ * for example FatFile on a QSPI flash file system, IKRecorder itself, or
+ * IKRecordFile on Linux.
+ */
+
+#ifndef _IKRECORD_H_
+#define _IKRECORD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define IKR_VERSION         (1)
+#define IKR_REPORT_LEN      (8)
+#define IKR_HEADER_LEN      (6)
+// Longest lead, 32 bits of usec and 4 bits of n
+#define IKR_MAX_LEAD        (6)
+#define IKR_MAX_RECORD      (IKR_MAX_LEAD + IKR_REPORT_LEN)
+
+// Replay speed that does not wait between reports
+#define IKR_SPEED_MAX       (0)
+
+inline void ikr_header(uint8_t *out)
+{
+    memcpy(out, "IKR1", 4);
+    out[4] = IKR_VERSION;
+    out[5] = IKR_REPORT_LEN;
+}
+
+inline bool ikr_check_header(const uint8_t *in)
+{
+    return (memcmp(in, "IKR1", 4) == 0) && (in[4] == IKR_VERSION) &&
+        (in[5] == IKR_REPORT_LEN);
+}
+
+// Read and check the header at the start of a log file
+template <class T> bool ikr_read_header(T &in)
+{
+    uint8_t header[IKR_HEADER_LEN];
+    for (size_t i = 0; i < IKR_HEADER_LEN; i++) {
+        int c = in.read();
+        if (c < 0) return false;
+        header[i] = c;
+    }
+    return ikr_check_header(header);
+}
+
+// Encode one record into out, which must hold IKR_MAX_RECORD bytes.
+// Returns the number of bytes in out.
+inline size_t ikr_encode(uint8_t *out, uint32_t usec, const uint8_t *report,
+        size_t len)
+{
+    if (len > IKR_REPORT_LEN) len = IKR_REPORT_LEN;
+    while ((len > 0) && (report[len-1] == 0)) len--;
+    uint64_t lead = ((uint64_t)usec << 4) | len;
+    size_t i = 0;
+    while (lead >= 0x80) {
+        out[i++] = (lead & 0x7F) | 0x80;
+        lead >>= 7;
+    }
+    out[i++] = lead;
+    memcpy(out + i, report, len);
+    return i + len;
+}
+
+/*
+ * Decode records one byte at a time. After put() returns 1, usec and
+ * report hold the record until the next put(). report is always
+ * IKR_REPORT_LEN bytes with the dropped trailing 0 bytes put back.
+ */
+class IKRecordDecoder {
+    public:
+        IKRecordDecoder()
+        {
+            clear();
+        }
+
+        void clear(void) {
+            lead = 0;
+            shift = 0;
+            have = 0;
+            len = 0;
+            inLead = true;
+        }
+
+        // Returns 1 if the byte completed a record, 0 if more bytes are
+        // needed, or -1 if the record is not valid
+        int put(uint8_t c) {
+            if (!inLead) {
+                report[have++] = c;
+                return (have == len) ? done() : 0;
+            }
+            if (shift >= (7 * IKR_MAX_LEAD)) {
+                clear();
+                return -1;
+            }
+            lead |= (uint64_t)(c & 0x7F) << shift;
+            shift += 7;
+            if (c & 0x80) return 0;
+            len = lead & 0x0F;
+            if ((len > IKR_REPORT_LEN) || (lead >> 36)) {
+                clear();
+                return -1;
+            }
+            usec = lead >> 4;
+            memset(report, 0, sizeof(report));
+            inLead = false;
+            have = 0;
+            return (len == 0) ? done() : 0;
+        }
+
+        // True if put() is part way through a record
+        bool partial(void) {
+            return !inLead || (shift > 0);
+        }
+
+        uint32_t usec;
+        uint8_t report[IKR_REPORT_LEN];
+
+    private:
+        uint64_t lead;
+        uint8_t shift;
+        uint8_t have;
+        uint8_t len;
+        bool inLead;
+
+        int done(void) {
+            lead = 0;
+            shift = 0;
+            inLead = true;
+            return 1;
+        }
+};
+
+/*
+ * Record reports into a RAM ring. When the ring is full the oldest records
+ * are dropped so the ring always holds the most recent part of the
+ * session. drain() appends the records to a file so a long session can be
+ * kept on the flash, rewind() and read() play the ring back without
+ * removing anything from it.
+ */
+#ifndef IKR_RING_SIZE
+// Must be a power of 2
+#define IKR_RING_SIZE       (4096)
+#endif
+
+class IKRecorder {
+    public:
+        IKRecorder() :
+            reports(0),
+            dropped(0),
+            writeErrors(0)
+        {
+            clear();
+        }
+
+        void clear(void) {
+            head = 0;
+            tail = 0;
+            cursor = 0;
+            started = false;
+        }
+
+        size_t used(void) {
+            return head - tail;
+        }
+
+        // Add a report received at usec, from micros()
+        void record(uint32_t usec, const uint8_t *report, size_t len) {
+            uint8_t rec[IKR_MAX_RECORD];
+            size_t n = ikr_encode(rec, (started) ? usec - lastUsec : 0,
+                    report, len);
+            started = true;
+            lastUsec = usec;
+            while ((IKR_RING_SIZE - used()) < n) drop();
+            size_t start = head & (IKR_RING_SIZE - 1);
+            size_t first = IKR_RING_SIZE - start;
+            if (first > n) first = n;
+            memcpy(ring + start, rec, first);
+            memcpy(ring, rec + first, n - first);
+            head += n;
+            reports++;
+        }
+
+        // Append the records to out, for example an open FatFile, and
+        // remove them from the ring. Returns the number of bytes written.
+        // If out takes less than it was given the log is cut short so the
+        // ring is emptied to keep later records whole.
+        template <class T> size_t drain(T &out) {
+            size_t written = 0;
+            while (used() > 0) {
+                size_t start = tail & (IKR_RING_SIZE - 1);
+                size_t n = IKR_RING_SIZE - start;
+                if (n > used()) n = used();
+                size_t w = out.write(ring + start, n);
+                written += w;
+                if (w != n) {
+                    writeErrors++;
+                    tail = head;
+                    break;
+                }
+                tail += n;
+            }
+            cursor = tail;
+            return written;
+        }
+
+        // Play back from the oldest record in the ring
+        void rewind(void) {
+            cursor = tail;
+        }
+
+        // Next byte of the ring after rewind(), -1 at the end
+        int read(void) {
+            // Records under the cursor were dropped by record()
+            if ((size_t)(head - cursor) > used()) cursor = tail;
+            if (cursor == head) return -1;
+            return ring[cursor++ & (IKR_RING_SIZE - 1)];
+        }
+
+        // Statistics
+        uint32_t reports;       // reports recorded
+        uint32_t dropped;       // oldest records dropped because the ring
+                                // was full
+        uint32_t writeErrors;   // drain() calls cut short by out
+
+    private:
+        uint8_t ring[IKR_RING_SIZE];
+        size_t head;
+        size_t tail;
+        size_t cursor;
+        uint32_t lastUsec;
+        bool started;
+
+        uint8_t at(size_t i) {
+            return ring[i & (IKR_RING_SIZE - 1)];
+        }
+
+        // Remove the oldest record
+        void drop(void) {
+            // n is in the first byte of the lead, least significant first
+            size_t i = tail;
+            uint8_t n = at(i) & 0x0F;
+            while (at(i) & 0x80) i++;
+            tail = i + 1 + n;
+            dropped++;
+        }
+};
+
+/*
+ * Play a log back at 1x, N times faster, or IKR_SPEED_MAX. Call loop()
+ * with micros() once per pass of loop(). Each due report is passed to
+ * function, usually a function that calls IntelliKeys::replay(). At most
+ * IKR_REPLAY_BURST reports are played per call unless loop() is given a
+ * smaller limit, so USB is still polled while a long log plays at maximum
+ * speed.
+ *
+ * The source is read only as far as the next report so a log file does
+ * not need to fit in RAM. read() must return -1 at the end of the log.
+ * For a log file, call ikr_read_header() before begin().
+ */
+#ifndef IKR_REPLAY_BURST
+#define IKR_REPLAY_BURST    (32)
+#endif
+
+class IKReplayer {
+    public:
+        IKReplayer(void (*function)(const uint8_t *report, size_t len)) :
+            reports(0),
+            errors(0),
+            report_callback(function),
+            running(false)
+        {
+        }
+
+        // Start playing at now, from micros(). speed is 1 for real time,
+        // N for N times faster, or IKR_SPEED_MAX.
+        void begin(uint32_t now, uint16_t speed) {
+            replaySpeed = speed;
+            lastNow = now;
+            clock = 0;
+            logTime = 0;
+            first = true;
+            pending = false;
+            running = true;
+            reports = 0;
+            errors = 0;
+            decoder.clear();
+        }
+
+        void stop(void) {
+            running = false;
+        }
+
+        bool isRunning(void) {
+            return running;
+        }
+
+        // Play the reports that are due, at most limit of them. Returns
+        // false when the log has ended or stop() was called.
+        template <class T> bool loop(T &source, uint32_t now,
+                size_t limit = IKR_REPLAY_BURST) {
+            if (!running) return false;
+            // clock is the log time reached, in microseconds. Multiplying
+            // instead of dividing by the speed never loses a fraction.
+            clock += (uint64_t)(uint32_t)(now - lastNow) * replaySpeed;
+            lastNow = now;
+            for (size_t i = 0; i < limit; i++) {
+                if (!pending && !next(source)) {
+                    running = false;
+                    return false;
+                }
+                if ((replaySpeed != IKR_SPEED_MAX) && (clock < logTime)) break;
+                if (report_callback) (*report_callback)(decoder.report, IKR_REPORT_LEN);
+                reports++;
+                pending = false;
+            }
+            return true;
+        }
+
+        // Statistics
+        uint32_t reports;       // reports played
+        uint32_t errors;        // 1 if the log ended with a bad or partial
+                                // record
+
+    private:
+        void (*report_callback)(const uint8_t *report, size_t len);
+        IKRecordDecoder decoder;
+        uint64_t clock;
+        uint64_t logTime;
+        uint32_t lastNow;
+        uint16_t replaySpeed;
+        bool first;
+        bool pending;
+        bool running;
+
+        // Read the next record. The first record plays right away whatever
+        // its usec, which may count from a record dropped by IKRecorder.
+        template <class T> bool next(T &source) {
+            int c, rc = 0;
+            while ((rc == 0) && ((c = source.read()) >= 0)) {
+                rc = decoder.put(c);
+            }
+            if (rc != 1) {
+                if ((rc < 0) || decoder.partial()) errors++;
+                return false;
+            }
+            if (first) {
+                first = false;
+            }
+            else {
+                logTime += decoder.usec;
+            }
+            pending = true;
+            return true;
+        }
+};
+
+#if !defined(ARDUINO)
+#include <stdio.h>
+
+// Log file source and sink for programs on Linux
+class IKRecordFile {
+    public:
+        IKRecordFile(FILE *f) : file(f)
+        {
+        }
+
+        int read(void) {
+            return fgetc(file);
+        }
+
+        size_t write(const uint8_t *data, size_t len) {
+            return fwrite(data, 1, len, file);
+        }
+
+    private:
+        FILE *file;
+};
+#endif
+
+#endif /* _IKRECORD_H_ */
@@ -21,11 +21,23 @@
    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
    SOFTWARE.
 */
+// The USB host driver does not build with the TinyUSB USB device stack.
+// Sketches using TinyUSB, such as ikrawevent_ard, only use IKLink.h.
+#ifndef USE_TINYUSB
+
 #include "IntelliKeys.h"
 
 const uint8_t IntelliKeys::epDataInIndex = 1;
 const uint8_t IntelliKeys::epDataOutIndex = 2;
 
+IntelliKeys *IntelliKeys::devices[IK_MAX_DEVICES];
+uint8_t IntelliKeys::numDevices = 0;
+uint8_t IntelliKeys::fwLoading = 0;
+uint32_t IntelliKeys::fwLoadStartAll = 0;
+uint32_t IntelliKeys::fwLoadEndAll = 0;
+uint8_t IntelliKeys::nextDevice = 0;
+IntelliKeys *IntelliKeys::currentDevice = NULL;
+
 IntelliKeys::IntelliKeys(USBHost *p) :
     pUsb(p),
     bAddress(0),
@@ -34,7 +46,11 @@ IntelliKeys::IntelliKeys(USBHost *p) :
     bPollEnable(false),
     qNextPollTime(0),
     ready(false),
-    IK_state(0)
+    devIndex(IK_NO_INDEX),
+    IK_state(0),
+    fwLoadUsec(0),
+    timeline_count(0),
+    timeline_fwload(false)
 {
     for(uint8_t i = 0; i < IK_MAX_ENDPOINTS; i++) {
         epInfo[i].epAddr = 0;
@@ -45,6 +61,15 @@ IntelliKeys::IntelliKeys(USBHost *p) :
         epInfo[i].bmNakPower = (i == epDataInIndex) ? USB_NAK_NOWAIT : USB_NAK_NONAK;
 
     }
+    clear_shadow();
+    // TaskAll() only runs the devices in devices[] so do not let the USB
+    // host attach an IK to an object past the limit.
+    if (numDevices >= IK_MAX_DEVICES) {
+        USBTRACE("IntelliKeys: too many objects\r\n");
+        return;
+    }
+    devIndex = numDevices;
+    devices[numDevices++] = this;
     if(pUsb)
         pUsb->RegisterDeviceClass(this);
 }
@@ -103,10 +128,17 @@ uint32_t IntelliKeys::Init(uint32_t parent, uint32_t port, uint32_t lowspeed) {
     if (udd->idVendor != IK_VID) goto FailUnknownDevice;
     if (udd->idProduct == IK_PID_FWLOAD) {
         USBTRACE("found IK, need FW load\r\n");
-        if (IK_state == 0) IK_state = 2;
+        if (IK_state == 0) {
+            timeline_count = 0;
+            setState(2, IK_MS_ATTACH_FWLOAD);
+        }
     }
     else if (udd->idProduct == IK_PID_RUNNING) {
         USBTRACE("found IK, FW running\r\n");
+        // Keep the timeline if this is the re-enumeration after firmware load
+        if (!timeline_fwload) timeline_count = 0;
+        timeline_fwload = false;
+        recordMilestone(IK_MS_ATTACH_RUNNING);
     }
     else
         goto FailUnknownDevice;
@@ -166,7 +198,7 @@ uint32_t IntelliKeys::Init(uint32_t parent, uint32_t port, uint32_t lowspeed) {
 
             if(bNumEP > 1) {
                 bPollEnable = true;
-                IK_state = 1;
+                setState(1, IK_MS_CONFIGURED);
                 break;
             }
         }
@@ -255,6 +287,9 @@ void IntelliKeys::EndpointXtract(uint32_t conf, uint32_t iface, uint32_t alt __a
 }
 
 uint32_t IntelliKeys::Release() {
+    bool attached = (bAddress != 0);
+
+    currentDevice = this;
     ready = false;
     pUsb->GetAddressPool().FreeAddress(bAddress);
 
@@ -263,14 +298,20 @@ uint32_t IntelliKeys::Release() {
     bPollEnable = false;
     bAddress = 0;
     qNextPollTime = 0;
+    if (IK_state == 3) fwLoading--;
     IK_state = 0;
-    if (disconnect_callback) (*disconnect_callback)();
+    clear_shadow();
+    // Init calls Release when it rejects a device. Only report a disconnect
+    // if this object was attached to an IK.
+    if (attached) {
+        recordMilestone(IK_MS_DETACH);
+        if (disconnect_callback) (*disconnect_callback)();
+    }
     return 0;
 }
 
 void IntelliKeys::ezusb_8051Reset(uint8_t resetBit)
 {
-    static uint8_t reg_value;
     reg_value = resetBit;
     uint32_t rv = pUsb->ctrlReq(bAddress, 0, 0x40, ANCHOR_LOAD_INTERNAL,
             (uint8_t)CPUCS_REG, (uint8_t)(CPUCS_REG>>8), 0, 1, 1, &reg_value, NULL);
@@ -279,9 +320,6 @@ void IntelliKeys::ezusb_8051Reset(uint8_t resetBit)
     }
 }
 
-static PINTEL_HEX_RECORD pHex;
-static uint8_t pHexBuf[MAX_INTEL_HEX_RECORD_LENGTH];
-
 int IntelliKeys::ezusb_DownloadIntelHex(bool internal)
 {
     while (pHex->Type == 0) {
@@ -304,33 +342,77 @@ int IntelliKeys::ezusb_DownloadIntelHex(bool internal)
     return 1;
 }
 
+/*
+ * Download the loader then the firmware. This does not block. Each call
+ * sends at most one hex record so Task() returns quickly and TaskAll() can
+ * interleave the downloads of several IKs. The records of one IK are sent
+ * at least 1 ms apart.
+ *
+ * fwPhase
+ *  0 = loader external records
+ *  1 = loader internal records
+ *  2 = firmware external records
+ *  3 = firmware internal records
+ */
 void IntelliKeys::IK_firmware_load()
 {
     uint32_t rv;
 
-    IK_state = 1;
-    USBTRACE("set interface(0,0)\r\n");
-    rv = pUsb->ctrlReq(bAddress, 0, 1, 11, 0, 0, 0, 0, 0, NULL, NULL);
-    if(rv && rv != USB_ERRORFLOW) {
-        Release();
+    if (IK_state == 2) {
+        setState(3, IK_MS_FWLOAD_START);
+        fwLoadUsec = 0;
+        fwLoadStart = micros();
+        if (fwLoading++ == 0) fwLoadStartAll = fwLoadStart;
+        USBTRACE("set interface(0,0)\r\n");
+        rv = pUsb->ctrlReq(bAddress, 0, 1, 11, 0, 0, 0, 0, 0, NULL, NULL);
+        if(rv && rv != USB_ERRORFLOW) {
+            Release();
+            return;
+        }
+
+        ezusb_8051Reset(1);
+        // Download external records first
+        pHex = (PINTEL_HEX_RECORD)loader;
+        fwPhase = 0;
+        fwRecordTime = micros();
         return;
     }
 
-    ezusb_8051Reset(1);
-    pHex = (PINTEL_HEX_RECORD)loader;
-    // Download external records first
-    while (ezusb_DownloadIntelHex(false) == 0) delay(1);
-    pHex = (PINTEL_HEX_RECORD)loader;
-    while (ezusb_DownloadIntelHex(true) == 0) delay(1);
+    if ((micros() - fwRecordTime) < 1000) return;
+    fwRecordTime = micros();
+    if (ezusb_DownloadIntelHex(fwPhase & 1) == 0) return;
+    // Release() on transfer error
+    if (IK_state != 3) return;
 
-    ezusb_8051Reset(0);
-    pHex = (PINTEL_HEX_RECORD)firmware;
-    while (ezusb_DownloadIntelHex(false) == 0) delay(1);
+    switch (++fwPhase) {
+        case 1:
+            pHex = (PINTEL_HEX_RECORD)loader;
+            break;
+        case 2:
+            ezusb_8051Reset(0);
+            pHex = (PINTEL_HEX_RECORD)firmware;
+            break;
+        case 3:
+            ezusb_8051Reset(1);
+            pHex = (PINTEL_HEX_RECORD)firmware;
+            break;
+        default:
+            ezusb_8051Reset(0);
+            if (IK_state != 3) return;
+            fwLoading--;
+            fwLoadEndAll = micros();
+            fwLoadUsec = fwLoadEndAll - fwLoadStart;
+            // The IK disconnects then enumerates with the firmware running
+            setState(5, IK_MS_FWLOAD_DONE);
+            timeline_fwload = true;
+            break;
+    }
+}
 
-    ezusb_8051Reset(1);
-    pHex = (PINTEL_HEX_RECORD)firmware;
-    while (ezusb_DownloadIntelHex(true) == 0) delay(1);
-    ezusb_8051Reset(0);
+uint32_t IntelliKeys::firmwareLoadTimeAll()
+{
+    if (fwLoading || (fwLoadEndAll == 0)) return 0;
+    return fwLoadEndAll - fwLoadStartAll;
 }
 
 void IntelliKeys::sensorUpdate(int sensor, int value)
@@ -342,6 +424,7 @@ void IntelliKeys::sensorUpdate(int sensor, int value)
                 50*eeprom_data.sensorWhite[sensor]) / 100;
     }
     int sensorOn = (value > midpoint);
+    if (!hasMilestone(IK_MS_SENSORS)) recordMilestone(IK_MS_SENSORS);
     if (sensorStatus[sensor] != sensorOn) {
         if (sensor_callback) (*sensor_callback)(sensor, sensorOn);
         sensorStatus[sensor] = sensorOn;
@@ -357,18 +440,27 @@ void IntelliKeys::handleEvents(const uint8_t *rxpacket, size_t len)
             //USBTRACE("IK_EVENT_ACK\r\n");
             break;
         case IK_EVENT_MEMBRANE_PRESS:
+            setMembrane(rxpacket[1], rxpacket[2], true);
             if(membrane_press_callback) (*membrane_press_callback)(rxpacket[1], rxpacket[2]);
             break;
         case IK_EVENT_MEMBRANE_RELEASE:
+            setMembrane(rxpacket[1], rxpacket[2], false);
             if (membrane_release_callback) (*membrane_release_callback)(rxpacket[1], rxpacket[2]);
             break;
         case IK_EVENT_SWITCH:
+            if (rxpacket[1] < 8) {
+                if (rxpacket[2]) switchState |= (1 << rxpacket[1]);
+                else switchState &= ~(1 << rxpacket[1]);
+            }
             if (switch_callback) (*switch_callback)(rxpacket[1], rxpacket[2]);
             break;
         case IK_EVENT_SENSOR_CHANGE:
             sensorUpdate(rxpacket[1], rxpacket[2]);
             break;
         case IK_EVENT_VERSION:
+            if (!hasMilestone(IK_MS_VERSION)) recordMilestone(IK_MS_VERSION);
+            versionMajor = rxpacket[1];
+            versionMinor = rxpacket[2];
             if (!version_done && version_callback) (*version_callback)(rxpacket[1], rxpacket[2]);
             version_done = true;
             break;
@@ -376,8 +468,9 @@ void IntelliKeys::handleEvents(const uint8_t *rxpacket, size_t len)
             USBTRACE("IK_EVENT_EEPROM_READ\r\n");
             break;
         case IK_EVENT_ONOFFSWITCH:
+            onoffState = rxpacket[1];
             if (on_off_callback) {
-                if (rxpacket[1]) {
+                if (rxpacket[1] && bPollEnable) {
                     get_correct();
                     get_all_sensors();
                 }
@@ -394,6 +487,7 @@ void IntelliKeys::handleEvents(const uint8_t *rxpacket, size_t len)
             USBTRACE("IK_EVENT_SWITCH_REPEAT\r\n");
             break;
         case IK_EVENT_CORRECT_MEMBRANE:
+            setMembrane(rxpacket[1], rxpacket[2], true);
             if (correct_membrane_callback) (*correct_membrane_callback)(rxpacket[1], rxpacket[2]);
             break;
         case IK_EVENT_CORRECT_SWITCH:
@@ -434,6 +528,12 @@ void IntelliKeys::handleEvents(const uint8_t *rxpacket, size_t len)
     }
 }
 
+void IntelliKeys::replay(const uint8_t *report, size_t len)
+{
+    currentDevice = this;
+    handleEvents(report, len);
+}
+
 uint32_t IntelliKeys::IK_poll()
 {
     uint8_t rxpacket[64];
@@ -444,15 +544,18 @@ uint32_t IntelliKeys::IK_poll()
         Release();
         return rv;
     }
+    // Commands also poll so the callbacks may run outside Task()
+    currentDevice = this;
     handleEvents(rxpacket, pktSize);
     return rv;
 }
 
 void IntelliKeys::Task()
 {
-    if (IK_state == 2) IK_firmware_load();
+    currentDevice = this;
+    if ((IK_state == 2) || (IK_state == 3)) IK_firmware_load();
     if (IK_state == 1) {
-        IK_state = 4;
+        setState(4, IK_MS_START);
         start();
     }
     if(!bPollEnable) return;
@@ -462,6 +565,16 @@ void IntelliKeys::Task()
     if (!eeprom_all_valid) get_eeprom();
 }
 
+void IntelliKeys::TaskAll()
+{
+    if (numDevices == 0) return;
+    if (nextDevice >= numDevices) nextDevice = 0;
+    uint8_t first = nextDevice++;
+    for (uint8_t i = 0; i < numDevices; i++) {
+        devices[(first + i) % numDevices]->Task();
+    }
+}
+
 inline int IntelliKeys::PostCommand(uint8_t *command)
 {
     uint32_t rv;
@@ -494,6 +607,10 @@ inline int IntelliKeys::PostCommand(uint8_t *command)
 int IntelliKeys::setLED(uint8_t number, uint8_t value)
 {
     uint8_t command[IK_REPORT_LEN] = {IK_CMD_LED,number,value,0,0,0,0,0};
+    if (number < 16) {
+        if (value) ledState |= (1 << number);
+        else ledState &= ~(1 << number);
+    }
     return PostCommand(command);
 }
 
@@ -561,6 +678,9 @@ void IntelliKeys::get_eeprom(void)
         get_all_sensors();
 
         if (on_SN_callback) (*on_SN_callback)(eeprom_data.serialnumber);
+
+        recordMilestone(IK_MS_EEPROM_DONE);
+        if (timeline_callback) (*timeline_callback)(timeline_entries, timeline_count);
     }
 }
 
@@ -575,13 +695,16 @@ void IntelliKeys::start()
     uint8_t command[IK_REPORT_LEN] = {0};
 
     USBTRACE("start\r\n");
+    clear_shadow();
     command[0] = IK_CMD_INIT;
     command[1] = 0;  //  interrupt event mode
     PostCommand(command);
+    recordMilestone(IK_MS_CMD_INIT);
 
     command[0] = IK_CMD_SCAN;
     command[1] = 1; //  enable
     PostCommand(command);
+    recordMilestone(IK_MS_CMD_SCAN);
 
     //delay(250);
 
@@ -594,6 +717,67 @@ void IntelliKeys::start()
     if (connect_callback) (*connect_callback)();
 }
 
+void IntelliKeys::clear_shadow(void)
+{
+    memset(membraneState, 0, sizeof(membraneState));
+    switchState = 0;
+    ledState = 0;
+    onoffState = 255;
+    versionMajor = 0;
+    versionMinor = 0;
+}
+
+void IntelliKeys::setMembrane(uint8_t x, uint8_t y, bool pressed)
+{
+    if ((x >= IK_RESOLUTION_X) || (y >= IK_RESOLUTION_Y)) return;
+    if (pressed) membraneState[y][x / 8] |= (1 << (x % 8));
+    else membraneState[y][x / 8] &= ~(1 << (x % 8));
+}
+
+void IntelliKeys::getSnapshot(ik_snapshot_t *snapshot)
+{
+    memcpy(snapshot->membrane, membraneState, sizeof(snapshot->membrane));
+    snapshot->switches = switchState;
+    snapshot->sensors = 0;
+    for (uint8_t i = 0; i < IK_NUM_SENSORS; i++) {
+        if (sensorStatus[i] == 1) snapshot->sensors |= (1 << i);
+    }
+    snapshot->leds = ledState;
+    snapshot->onoff = onoffState;
+    snapshot->versionMajor = versionMajor;
+    snapshot->versionMinor = versionMinor;
+    if (eeprom_all_valid) {
+        memcpy(snapshot->serialnumber, eeprom_data.serialnumber,
+                sizeof(snapshot->serialnumber));
+    }
+    else {
+        memset(snapshot->serialnumber, 0, sizeof(snapshot->serialnumber));
+    }
+}
+
+void IntelliKeys::setState(uint8_t state, uint8_t milestone)
+{
+    IK_state = state;
+    recordMilestone(milestone);
+}
+
+void IntelliKeys::recordMilestone(uint8_t milestone)
+{
+    if (timeline_count >= IK_TIMELINE_SIZE) return;
+    ik_milestone_t *m = &timeline_entries[timeline_count++];
+    m->milestone = milestone;
+    m->state = IK_state;
+    m->usec = micros();
+}
+
+bool IntelliKeys::hasMilestone(uint8_t milestone)
+{
+    for (uint8_t i = 0; i < timeline_count; i++) {
+        if (timeline_entries[i].milestone == milestone) return true;
+    }
+    return false;
+}
+
 void IntelliKeys::PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR* ep_ptr) {
     Notify(PSTR("Endpoint descriptor:"), 0x80);
     Notify(PSTR("\r\nLength:\t\t"), 0x80);
@@ -610,3 +794,5 @@ void IntelliKeys::PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR* ep_ptr)
     D_PrintHex<uint8_t > (ep_ptr->bInterval, 0x80);
     Notify(PSTR("\r\n"), 0x80);
 }
+
+#endif /* USE_TINYUSB */
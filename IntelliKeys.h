@@ -21,11 +21,59 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#ifndef _INTELLIKEYS_H_
+#define _INTELLIKEYS_H_
+
 #include <Usb.h>
 #include "intellikeysdefs.h"
 
-#define IK_EEPROM_SN_SIZE   (29)
 #define IK_MAX_ENDPOINTS    (3)
+#define IK_TIMELINE_SIZE    (16)
+#define IK_MAX_DEVICES      (4)
+// getIndex() of an object constructed after IK_MAX_DEVICES others
+#define IK_NO_INDEX         (255)
+
+/*
+ * Startup milestones recorded in the connection timeline. One entry is
+ * recorded for each IK_state transition and for the key startup commands.
+ */
+enum IK_MILESTONES {
+    IK_MS_ATTACH_FWLOAD=1,  // Init found IK without firmware
+    IK_MS_FWLOAD_START,     // Firmware download started
+    IK_MS_FWLOAD_DONE,      // Firmware download finished
+    IK_MS_DETACH,           // Release
+    IK_MS_ATTACH_RUNNING,   // Init found IK with firmware running
+    IK_MS_CONFIGURED,       // Interrupt endpoints found, ready to start
+    IK_MS_START,            // start() called
+    IK_MS_CMD_INIT,         // IK_CMD_INIT sent
+    IK_MS_CMD_SCAN,         // IK_CMD_SCAN sent
+    IK_MS_SENSORS,          // First sensor event received
+    IK_MS_VERSION,          // Firmware version event received
+    IK_MS_EEPROM_DONE       // Serial number and sensor calibration read
+};
+
+/*
+ * Current state of an IntelliKeys as seen by the driver. See getSnapshot().
+ */
+typedef struct
+{
+    // Bit (x % 8) of membrane[y][x / 8] is 1 if cell x,y is pressed
+    uint8_t  membrane[IK_RESOLUTION_Y][(IK_RESOLUTION_X + 7) / 8];
+    uint8_t  switches;  // Bit n is 1 if switch n is pressed
+    uint8_t  sensors;   // Bit n is 1 if overlay sensor n is on
+    uint16_t leds;      // Bit n is 1 if setLED(n, 1) was the last call for n
+    uint8_t  onoff;     // Top on/off switch, 255 if unknown
+    uint8_t  versionMajor;  // Firmware version, 0.0 if unknown
+    uint8_t  versionMinor;
+    uint8_t  serialnumber[IK_EEPROM_SN_SIZE];   // All 0 if unknown
+} ik_snapshot_t;
+
+typedef struct
+{
+    uint8_t  milestone; // See IK_MILESTONES
+    uint8_t  state;     // IK_state after the milestone
+    uint32_t usec;      // micros() when the milestone was recorded
+} ik_milestone_t;
 
 class IntelliKeys: public USBDeviceConfig, public UsbConfigXtracter {
     public:
@@ -47,6 +95,35 @@ class IntelliKeys: public USBDeviceConfig, public UsbConfigXtracter {
     public:
         IntelliKeys(USBHost *pusb);
 
+        // Device index, 0 for the first IntelliKeys object constructed,
+        // 1 for the next, etc. Only IK_MAX_DEVICES objects are registered
+        // with the USB host. Any more are never attached to an IK and
+        // return IK_NO_INDEX.
+        uint8_t getIndex(void) {
+            return devIndex;
+        }
+        // The device whose callback is running. Use this in callbacks shared
+        // by more than one IntelliKeys object.
+        static IntelliKeys *eventDevice(void) {
+            return currentDevice;
+        }
+        // Run Task() for all IntelliKeys objects. The device polled first is
+        // rotated on each call so all devices get the same service.
+        static void TaskAll(void);
+        // Firmware download time in microseconds for this device. 0 if the
+        // firmware was not downloaded on this connection.
+        uint32_t firmwareLoadTime(void) {
+            return fwLoadUsec;
+        }
+        // Microseconds from the start of the first to the end of the last
+        // of a group of overlapping firmware downloads. 0 while any download
+        // is running.
+        static uint32_t firmwareLoadTimeAll(void);
+        // Number of firmware downloads running
+        static uint8_t firmwareLoading(void) {
+            return fwLoading;
+        }
+
         int setLED(uint8_t number, uint8_t value);
         int sound(int freq, int duration, int volume);
         int get_version(void);
@@ -55,6 +132,23 @@ class IntelliKeys: public USBDeviceConfig, public UsbConfigXtracter {
         int reset(void);
         int get_correct(void);
 
+        // Copy the current state to snapshot. This needs no USB transfer so
+        // it is fast enough to call from a callback.
+        void getSnapshot(ik_snapshot_t *snapshot);
+
+        // Handle a raw report as if this IK had just sent it, for example
+        // one played back by IKReplayer from IKRecord.h. All callbacks run
+        // and the snapshot changes the same as for a live report. Nothing
+        // is sent to the IK unless it is connected.
+        void replay(const uint8_t *report, size_t len);
+
+        // Startup timeline of the current connection. Returns the number of
+        // entries.
+        uint8_t getTimeline(const ik_milestone_t **timeline) {
+            *timeline = timeline_entries;
+            return timeline_count;
+        }
+
         // Event callback functions
         void onRawEvent(void (*function)(const uint8_t *rxEvent, size_t len)) {
             raw_event_callback = function;
@@ -95,6 +189,10 @@ class IntelliKeys: public USBDeviceConfig, public UsbConfigXtracter {
         void onCorrectDone(void (*function)(void)) {
             correct_done_callback = function;
         }
+        // Called once per connection when startup is complete
+        void onTimeline(void (*function)(const ik_milestone_t *timeline, uint8_t count)) {
+            timeline_callback = function;
+        }
         /* USBDeviceConfig virtual functions */
         virtual uint32_t Init(uint32_t /* parent */, uint32_t /* port */, uint32_t /* lowspeed */);
         virtual uint32_t ConfigureDevice(uint32_t /* parent */, uint32_t /* port */, uint32_t /* lowspeed */) {
@@ -126,7 +224,26 @@ class IntelliKeys: public USBDeviceConfig, public UsbConfigXtracter {
         void EndpointXtract(uint32_t conf __attribute__((unused)), uint32_t iface __attribute__((unused)), uint32_t alt __attribute__((unused)), uint32_t proto __attribute__((unused)), const USB_ENDPOINT_DESCRIPTOR *ep __attribute__((unused)));
 
     private:
+        static IntelliKeys *devices[IK_MAX_DEVICES];
+        static uint8_t numDevices;
+        static uint8_t nextDevice;
+        static IntelliKeys *currentDevice;
+        static uint8_t fwLoading;
+        static uint32_t fwLoadStartAll;
+        static uint32_t fwLoadEndAll;
+        uint8_t devIndex;
+        // 0 = idle, 1 = firmware running, start() pending, 2 = firmware
+        // download pending, 3 = firmware download running, 4 = started,
+        // 5 = firmware downloaded, waiting for re-enumeration
         volatile uint8_t  IK_state;
+        // Firmware download state
+        uint8_t fwPhase;
+        uint32_t fwRecordTime;
+        uint32_t fwLoadStart;
+        uint32_t fwLoadUsec;
+        PINTEL_HEX_RECORD pHex;
+        uint8_t pHexBuf[MAX_INTEL_HEX_RECORD_LENGTH];
+        uint8_t reg_value;
         int  ezusb_DownloadIntelHex(bool internal);
         void ezusb_8051Reset(uint8_t resetBit);
         void IK_firmware_load();
@@ -143,6 +260,7 @@ class IntelliKeys: public USBDeviceConfig, public UsbConfigXtracter {
         void (*correct_membrane_callback)(int x, int y);
         void (*correct_switch_callback)(int switch_number, int switch_state);
         void (*correct_done_callback)(void);
+        void (*timeline_callback)(const ik_milestone_t *timeline, uint8_t count);
         uint32_t IK_poll();
         int PostCommand(uint8_t *command);
         void handleEvents(const uint8_t *rxpacket, size_t len);
@@ -160,6 +278,23 @@ class IntelliKeys: public USBDeviceConfig, public UsbConfigXtracter {
         bool eeprom_valid[sizeof(eeprom_t)];
         bool eeprom_all_valid;
         uint8_t sensorStatus[IK_NUM_SENSORS] = {255, 255, 255};
+        // State shadowed for getSnapshot()
+        uint8_t membraneState[IK_RESOLUTION_Y][(IK_RESOLUTION_X + 7) / 8];
+        uint8_t switchState;
+        uint16_t ledState;
+        uint8_t onoffState;
+        uint8_t versionMajor;
+        uint8_t versionMinor;
+        void clear_shadow(void);
+        void setMembrane(uint8_t x, uint8_t y, bool pressed);
         //elapsedMillis eeprom_period;
         bool version_done;
+        void setState(uint8_t state, uint8_t milestone);
+        void recordMilestone(uint8_t milestone);
+        bool hasMilestone(uint8_t milestone);
+        ik_milestone_t timeline_entries[IK_TIMELINE_SIZE];
+        uint8_t timeline_count;
+        bool timeline_fwload;   // Continue timeline after re-enumeration
 };
+
+#endif /* _INTELLIKEYS_H_ */
@@ -0,0 +1,241 @@
+/*
+   MIT License
+
+   Copyright (c) 2018-2019 gdsports625@gmail.com
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+*/
+// The USB host driver does not build with the TinyUSB USB device stack.
+// Sketches using TinyUSB, such as ikrawevent_ard, only use IKLink.h.
+#ifndef USE_TINYUSB
+
+#include "IntelliKeysMerger.h"
+
+IntelliKeysMerger *IntelliKeysMerger::merger = NULL;
+
+IntelliKeysMerger::IntelliKeysMerger() :
+    numSlots(0),
+    nextSlot(0)
+{
+    memset(slots, 0, sizeof(slots));
+    merger = this;
+}
+
+bool IntelliKeysMerger::add(IntelliKeys *ikey)
+{
+    if ((ikey == NULL) || (ikey->getIndex() == IK_NO_INDEX) ||
+            (numSlots >= IK_MAX_DEVICES)) return false;
+    slot_t *slot = &slots[numSlots++];
+    memset(slot, 0, sizeof(*slot));
+    slot->ikey = ikey;
+
+    ikey->onMembranePress(membranePress);
+    ikey->onMembraneRelease(membraneRelease);
+    ikey->onSwitch(switchEvent);
+    ikey->onSensor(sensor);
+    ikey->onVersion(version);
+    ikey->onConnect(connect);
+    ikey->onDisconnect(disconnect);
+    ikey->onOnOffSwitch(onOff);
+    ikey->onSerialNum(serialNum);
+    ikey->onCorrectMembrane(correctMembrane);
+    ikey->onCorrectSwitch(correctSwitch);
+    ikey->onCorrectDone(correctDone);
+    return true;
+}
+
+void IntelliKeysMerger::Task()
+{
+    if (numSlots == 0) return;
+    if (nextSlot >= numSlots) nextSlot = 0;
+    uint8_t first = nextSlot++;
+    for (uint8_t i = 0; i < numSlots; i++) {
+        slot_t *slot = &slots[(first + i) % numSlots];
+        // Leave the events in the IK until the reader catches up
+        if ((IKM_QUEUE_SIZE - queued(slot)) < IKM_QUEUE_HEADROOM) {
+            slot->stats.stalled++;
+            continue;
+        }
+        slot->ikey->Task();
+    }
+}
+
+size_t IntelliKeysMerger::available()
+{
+    size_t count = 0;
+    for (uint8_t i = 0; i < numSlots; i++) {
+        count += queued(&slots[i]);
+    }
+    return count;
+}
+
+bool IntelliKeysMerger::read(ik_merged_event_t *event)
+{
+    slot_t *oldest = NULL;
+    uint32_t now = micros();
+
+    // The queue heads are the oldest event of each device. Compare ages
+    // instead of timestamps so micros() wrap around does not matter.
+    for (uint8_t i = 0; i < numSlots; i++) {
+        slot_t *slot = &slots[i];
+        if (queued(slot) == 0) continue;
+        if ((oldest == NULL) ||
+                ((now - slot->queue[slot->tail & (IKM_QUEUE_SIZE-1)].usec) >
+                 (now - oldest->queue[oldest->tail & (IKM_QUEUE_SIZE-1)].usec))) {
+            oldest = slot;
+        }
+    }
+    if (oldest == NULL) return false;
+
+    const entry_t *entry = &oldest->queue[oldest->tail & (IKM_QUEUE_SIZE-1)];
+    event->usec = entry->usec;
+    event->dev = oldest->ikey->getIndex();
+    event->type = entry->type;
+    event->a = entry->a;
+    event->b = entry->b;
+    event->sn = oldest->sn;
+    oldest->tail++;
+    return true;
+}
+
+const char *IntelliKeysMerger::serialNumber(uint8_t dev)
+{
+    slot_t *slot = findSlot(dev);
+    return (slot) ? slot->sn : "";
+}
+
+const ik_merger_stats_t *IntelliKeysMerger::stats(uint8_t dev)
+{
+    slot_t *slot = findSlot(dev);
+    return (slot) ? &slot->stats : NULL;
+}
+
+IntelliKeys *IntelliKeysMerger::device(uint8_t dev)
+{
+    slot_t *slot = findSlot(dev);
+    return (slot) ? slot->ikey : NULL;
+}
+
+IntelliKeysMerger::slot_t *IntelliKeysMerger::findSlot(uint8_t dev)
+{
+    for (uint8_t i = 0; i < numSlots; i++) {
+        if (slots[i].ikey->getIndex() == dev) return &slots[i];
+    }
+    return NULL;
+}
+
+// Slot of the device whose callback is running, NULL if none
+IntelliKeysMerger::slot_t *IntelliKeysMerger::eventSlot()
+{
+    IntelliKeys *ikey = IntelliKeys::eventDevice();
+    if (ikey == NULL) return NULL;
+    return findSlot(ikey->getIndex());
+}
+
+// Queue an event from the device whose callback is running
+void IntelliKeysMerger::push(uint8_t type, int a, int b)
+{
+    slot_t *slot = eventSlot();
+    if (slot == NULL) return;
+
+    uint8_t count = queued(slot);
+    if (count >= IKM_QUEUE_SIZE) {
+        slot->stats.dropped++;
+        return;
+    }
+    entry_t *entry = &slot->queue[slot->head & (IKM_QUEUE_SIZE-1)];
+    entry->usec = micros();
+    entry->type = type;
+    entry->a = a;
+    entry->b = b;
+    slot->head++;
+    if (++count > slot->stats.highWater) slot->stats.highWater = count;
+}
+
+void IntelliKeysMerger::membranePress(int x, int y)
+{
+    merger->push(IK_EVENT_MEMBRANE_PRESS, x, y);
+}
+
+void IntelliKeysMerger::membraneRelease(int x, int y)
+{
+    merger->push(IK_EVENT_MEMBRANE_RELEASE, x, y);
+}
+
+void IntelliKeysMerger::switchEvent(int switch_number, int switch_state)
+{
+    merger->push(IK_EVENT_SWITCH, switch_number, switch_state);
+}
+
+void IntelliKeysMerger::sensor(int sensor_number, int sensor_value)
+{
+    merger->push(IK_EVENT_SENSOR_CHANGE, sensor_number, sensor_value);
+}
+
+void IntelliKeysMerger::version(int major, int minor)
+{
+    merger->push(IK_EVENT_VERSION, major, minor);
+}
+
+void IntelliKeysMerger::connect(void)
+{
+    // Another IK may be plugged into the same port so forget the old serial
+    // number. Keep it until now so the disconnect event is still tagged.
+    slot_t *slot = merger->eventSlot();
+    if (slot) memset(slot->sn, 0, sizeof(slot->sn));
+    merger->push(IK_EVENT_CONNECT, 0, 0);
+}
+
+void IntelliKeysMerger::disconnect(void)
+{
+    merger->push(IK_EVENT_DISCONNECT, 0, 0);
+}
+
+void IntelliKeysMerger::onOff(int switch_status)
+{
+    merger->push(IK_EVENT_ONOFFSWITCH, switch_status, 0);
+}
+
+void IntelliKeysMerger::serialNum(uint8_t serial[IK_EEPROM_SN_SIZE])
+{
+    slot_t *slot = merger->eventSlot();
+    if (slot) {
+        // The serial parameter is not NUL terminated!
+        memcpy(slot->sn, serial, IK_EEPROM_SN_SIZE);
+        slot->sn[IK_EEPROM_SN_SIZE] = '\0';
+    }
+    merger->push(IK_EVENT_SERNUM, 0, 0);
+}
+
+void IntelliKeysMerger::correctMembrane(int x, int y)
+{
+    merger->push(IK_EVENT_CORRECT_MEMBRANE, x, y);
+}
+
+void IntelliKeysMerger::correctSwitch(int switch_number, int switch_state)
+{
+    merger->push(IK_EVENT_CORRECT_SWITCH, switch_number, switch_state);
+}
+
+void IntelliKeysMerger::correctDone(void)
+{
+    merger->push(IK_EVENT_CORRECT_DONE, 0, 0);
+}
+
+#endif /* USE_TINYUSB */
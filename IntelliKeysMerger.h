@@ -0,0 +1,128 @@
+/* Merge the events of several IntelliKeys into one stream
+ * Copyright 2018-2019 gdsports625@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _INTELLIKEYSMERGER_H_
+#define _INTELLIKEYSMERGER_H_
+
+#include "IntelliKeys.h"
+
+// Events queued per device. Must be a power of 2.
+#define IKM_QUEUE_SIZE      (16)
+// Do not poll a device unless its queue has at least this many free entries.
+// One Task() can produce several events, for example the sensor events
+// after get_all_sensors().
+#define IKM_QUEUE_HEADROOM  (4)
+
+/*
+ * One decoded event. type is an IK_EVENT value and a, b are the parameters
+ * in the same order as the ikrawevent binary events. For example,
+ * IK_EVENT_MEMBRANE_PRESS has a = x, b = y.
+ */
+typedef struct
+{
+    uint32_t usec;      // micros() when the event was received
+    uint8_t  dev;       // IntelliKeys::getIndex()
+    uint8_t  type;      // IK_EVENT_*
+    uint8_t  a;
+    uint8_t  b;
+    const char *sn;     // Serial number, "" until read from the IK
+} ik_merged_event_t;
+
+typedef struct
+{
+    uint32_t dropped;   // Events lost because the queue was full
+    uint32_t stalled;   // Task() calls skipped because the queue was full
+    uint8_t  highWater; // Most events ever queued
+} ik_merger_stats_t;
+
+/*
+ * Owns the IntelliKeys event callbacks of up to IK_MAX_DEVICES devices and
+ * merges their events into one stream ordered by time. Each device has its
+ * own bounded queue so one busy device cannot push out the events of the
+ * others. Only one IntelliKeysMerger may exist because the IntelliKeys
+ * callbacks are plain functions.
+ */
+class IntelliKeysMerger {
+    public:
+        IntelliKeysMerger();
+
+        // Take over the event callbacks of ikey. Returns false if there is
+        // no room for another device or ikey has no index.
+        bool add(IntelliKeys *ikey);
+        // Call from loop() instead of IntelliKeys::TaskAll()
+        void Task();
+        // Number of events waiting in all queues
+        size_t available();
+        // Remove the oldest event of all devices. Returns false if there are
+        // no events.
+        bool read(ik_merged_event_t *event);
+        // NUL terminated serial number of a device. "" if not yet read.
+        const char *serialNumber(uint8_t dev);
+        const ik_merger_stats_t *stats(uint8_t dev);
+        IntelliKeys *device(uint8_t dev);
+
+    private:
+        typedef struct
+        {
+            uint32_t usec;
+            uint8_t  type;
+            uint8_t  a;
+            uint8_t  b;
+        } entry_t;
+        typedef struct
+        {
+            IntelliKeys *ikey;
+            entry_t queue[IKM_QUEUE_SIZE];
+            uint8_t head;
+            uint8_t tail;
+            char sn[IK_EEPROM_SN_SIZE+1];
+            ik_merger_stats_t stats;
+        } slot_t;
+        slot_t slots[IK_MAX_DEVICES];
+        uint8_t numSlots;
+        uint8_t nextSlot;
+        static IntelliKeysMerger *merger;
+
+        slot_t *findSlot(uint8_t dev);
+        slot_t *eventSlot();
+        uint8_t queued(const slot_t *slot) {
+            return (uint8_t)(slot->head - slot->tail);
+        }
+        void push(uint8_t type, int a, int b);
+
+        // IntelliKeys callbacks
+        static void membranePress(int x, int y);
+        static void membraneRelease(int x, int y);
+        static void switchEvent(int switch_number, int switch_state);
+        static void sensor(int sensor_number, int sensor_value);
+        static void version(int major, int minor);
+        static void connect(void);
+        static void disconnect(void);
+        static void onOff(int switch_status);
+        static void serialNum(uint8_t serial[IK_EEPROM_SN_SIZE]);
+        static void correctMembrane(int x, int y);
+        static void correctSwitch(int switch_number, int switch_state);
+        static void correctDone(void);
+};
+
+#endif /* _INTELLIKEYSMERGER_H_ */
@@ -0,0 +1,141 @@
+// Event output codecs
+//
+// Each event is built with the same calls whatever the codec: IK_out_begin,
+// then IK_out_member, IK_out_key, IK_out_number and IK_out_array_begin/end
+// for the members, then IK_out_end to get the encoded bytes. ikCodec
+// selects the codec at run time.
+//
+//  IK_CODEC_JSON   one JSON object per line, see IKJson.h
+//  IK_CODEC_BINARY IKLink.h frames with the ikrawevent records plus dev
+//  IK_CODEC_CBOR   CBOR maps with the same members as JSON, see IKCbor.h
+//
+// The binary codec has no keys or arrays. It sends each number as one
+// byte, in order, and puts dev last. Events with their own binary layout,
+// for example the timeline, append to rawRecord directly.
+//
+// extras/test/ikcodec_test.cpp in the library includes this file.
+
+#ifndef __IKCODEC_H__
+#define __IKCODEC_H__
+
+#include <IKLink.h>
+#include <IKJson.h>
+#include <IKCbor.h>
+
+enum {
+    IK_CODEC_JSON,
+    IK_CODEC_BINARY,
+    IK_CODEC_CBOR,
+};
+uint8_t ikCodec = IK_CODEC_JSON;
+
+IKJsonWriter json;
+IKCborWriter cbor;
+IKLinkEncoder rawOut;
+uint8_t rawType;
+uint8_t rawRecord[IKL_MAX_RECORD];
+uint8_t rawLen;
+uint8_t rawFrame[IKL_MAX_ENCODED];
+
+// Start an event with the evt and dev members. The binary codec uses the
+// IK_EVENT type instead of the name.
+void IK_out_begin(uint8_t type, const char *evt, int dev)
+{
+    switch (ikCodec) {
+        case IK_CODEC_BINARY:
+            rawType = type;
+            rawRecord[0] = dev;
+            rawLen = 1;
+            break;
+        case IK_CODEC_CBOR:
+            cbor.begin(evt);
+            cbor.member("dev", dev);
+            break;
+        default:
+            json.begin(evt);
+            json.member("dev", dev);
+            break;
+    }
+}
+
+void IK_out_key(const char *key)
+{
+    if (ikCodec == IK_CODEC_CBOR) cbor.member(key);
+    if (ikCodec == IK_CODEC_JSON) json.member(key);
+}
+
+void IK_out_number(int32_t value)
+{
+    switch (ikCodec) {
+        case IK_CODEC_BINARY:
+            if (rawLen < sizeof(rawRecord)) rawRecord[rawLen++] = value;
+            break;
+        case IK_CODEC_CBOR:
+            cbor.number(value);
+            break;
+        default:
+            json.number(value);
+            break;
+    }
+}
+
+void IK_out_array_begin(void)
+{
+    if (ikCodec == IK_CODEC_CBOR) cbor.beginArray();
+    if (ikCodec == IK_CODEC_JSON) json.beginArray();
+}
+
+void IK_out_array_end(void)
+{
+    if (ikCodec == IK_CODEC_CBOR) cbor.endArray();
+    if (ikCodec == IK_CODEC_JSON) json.endArray();
+}
+
+void IK_out_member(const char *key, int32_t value)
+{
+    IK_out_key(key);
+    IK_out_number(value);
+}
+
+// The only string is the serial number. The binary codec sends it as
+// IK_EEPROM_SN_SIZE bytes padded with 0.
+void IK_out_member(const char *key, const char *value)
+{
+    switch (ikCodec) {
+        case IK_CODEC_BINARY:
+            if (((size_t)rawLen + IK_EEPROM_SN_SIZE) > sizeof(rawRecord)) break;
+            strncpy((char *)rawRecord + rawLen, value, IK_EEPROM_SN_SIZE);
+            rawLen += IK_EEPROM_SN_SIZE;
+            break;
+        case IK_CODEC_CBOR:
+            cbor.member(key, value);
+            break;
+        default:
+            json.member(key, value);
+            break;
+    }
+}
+
+// Finish the event. Returns its length and points data at it, or returns
+// 0 if it did not fit.
+size_t IK_out_end(const uint8_t **data)
+{
+    switch (ikCodec) {
+        case IK_CODEC_BINARY:
+            // {type, params..., dev}. Receivers ignore the extra dev byte.
+            if (rawLen >= sizeof(rawRecord)) return 0;
+            rawRecord[rawLen++] = rawRecord[0];
+            rawOut.clear();
+            *data = rawFrame;
+            return (rawOut.add(rawType, rawRecord + 1, rawLen - 1)) ?
+                rawOut.encode(rawFrame) : 0;
+        case IK_CODEC_CBOR:
+            *data = cbor.data();
+            return cbor.end();
+        default:
+            *data = json.data();
+            return json.end();
+    }
+}
+
+#endif /* __IKCODEC_H__ */
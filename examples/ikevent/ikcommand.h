@@ -0,0 +1,56 @@
+// JSON command names
+//
+// commandId() turns the "cmd" member of a command line into one of the
+// JSON_CMD values with a switch on ikj_hash() from IKJson.h. The case
+// labels are computed at compile time and the compiler rejects duplicates,
+// so one strcmp is enough to reject other names.
+//
+// extras/test/ikjson_test.cpp in the library includes this file.
+
+#ifndef __IKCOMMAND_H__
+#define __IKCOMMAND_H__
+
+#include <IKJson.h>
+
+enum {
+    JSON_CMD_UNKNOWN,
+    JSON_CMD_SETSND,
+    JSON_CMD_SETLED,
+    JSON_CMD_GETSN,
+    JSON_CMD_RESET,
+    JSON_CMD_GETVER,
+    JSON_CMD_GETSNSRS,
+    JSON_CMD_GETONOFF,
+    JSON_CMD_GETCORR,
+    JSON_CMD_SETBATCH,
+    JSON_CMD_SETCODEC,
+    JSON_CMD_RECORD,
+    JSON_CMD_REPLAY,
+};
+
+int commandId(const char *cmd)
+{
+    const char *name;
+    int id;
+
+    if (cmd == NULL) return JSON_CMD_UNKNOWN;
+    switch (ikj_hash(cmd)) {
+        case ikj_hash("setsnd"):   name = "setsnd";   id = JSON_CMD_SETSND;   break;
+        case ikj_hash("setled"):   name = "setled";   id = JSON_CMD_SETLED;   break;
+        case ikj_hash("getsn"):    name = "getsn";    id = JSON_CMD_GETSN;    break;
+        case ikj_hash("reset"):    name = "reset";    id = JSON_CMD_RESET;    break;
+        case ikj_hash("getver"):   name = "getver";   id = JSON_CMD_GETVER;   break;
+        case ikj_hash("getsnsrs"): name = "getsnsrs"; id = JSON_CMD_GETSNSRS; break;
+        case ikj_hash("getonoff"): name = "getonoff"; id = JSON_CMD_GETONOFF; break;
+        case ikj_hash("getcorr"):  name = "getcorr";  id = JSON_CMD_GETCORR;  break;
+        case ikj_hash("setbatch"): name = "setbatch"; id = JSON_CMD_SETBATCH; break;
+        case ikj_hash("setcodec"): name = "setcodec"; id = JSON_CMD_SETCODEC; break;
+        case ikj_hash("record"):   name = "record";   id = JSON_CMD_RECORD;   break;
+        case ikj_hash("replay"):   name = "replay";   id = JSON_CMD_REPLAY;   break;
+        default:
+            return JSON_CMD_UNKNOWN;
+    }
+    return (strcmp(cmd, name) == 0) ? id : JSON_CMD_UNKNOWN;
+}
+
+#endif /* __IKCOMMAND_H__ */
@@ -1,10 +1,20 @@
 /*
  * Demonstrate the use of the USB Host Library for SAMD IntelliKeys (IK) USB
- * host driver. Prints IK events as JSON on serial port.
+ * host driver. Prints IK events as JSON on serial port. The setcodec command
+ * switches the events to binary frames or CBOR.
+ *
+ * More than one IK may be connected through a USB hub. Each event includes
+ * the device index "dev" of the IK that sent it.
  */
 
 #include <IntelliKeys.h>
-#include <ArduinoJson.h>
+#include <usbhub.h>
+#include <IKLink.h>
+#include <IKJson.h>
+#include <IKCbor.h>
+#include "ikcodec.h"
+#include "ikcommand.h"
+#include "iksession.h"
 
 // On Arduino Zero debug on and send JSON to debug port
 #if defined(ARDUINO_SAMD_ZERO)
@@ -17,182 +27,327 @@
 #endif
 
 USBHost myusb;
+USBHub hub1(&myusb);
 IntelliKeys ikey1(&myusb);
+IntelliKeys ikey2(&myusb);
 
-char mySN[IK_EEPROM_SN_SIZE+1]; //+1 NUL
+// Indexed by IntelliKeys::getIndex()
+IntelliKeys *ikeys[] = {&ikey1, &ikey2};
+#define IK_NUM_DEVICES  (sizeof(ikeys)/sizeof(ikeys[0]))
 
-void IK_press(int x, int y)
+char mySN[IK_NUM_DEVICES][IK_EEPROM_SN_SIZE+1]; //+1 NUL
+
+// Events are built by the codec then queued in ikTx. loop() sends them
+// without blocking so a slow UART never holds up the USB polling.
+IKLinkTxRing ikTx;
+
+// Only poll the IKs when this much room is left in ikTx. Events stay in
+// the IKs until the UART catches up.
+#define IK_TX_HEADROOM  (2 * IKJ_MAX_LINE)
+
+// Events are held in ikTx and sent together as one block when batchMax
+// are waiting or the oldest has waited batchUsec. A finger press on the
+// membrane makes several events at once so this turns many small UART
+// writes into one. Set with the setbatch command. A window of 0 sends each
+// event right away.
+#define IK_BATCH_MAX_MS     (50)  // latency cap
+#define IK_BATCH_MAX_LINES  (16)
+uint32_t batchUsec = 2000;
+uint8_t batchMax = 8;
+uint8_t batchCount;       // events waiting in ikTx
+uint32_t batchStart;      // micros() when the first of them was queued
+bool flushing;            // sending ikTx until it is empty
+
+// Index of the IK whose event is being handled
+inline int IK_dev(void)
+{
+  return IntelliKeys::eventDevice()->getIndex();
+}
+
+void IK_out_send(void)
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"press\",\"x\":%d,\"y\":%d}", x, y);
-  if (buflen > 0) {
-    JSON.println(buf);
+  const uint8_t *data;
+  size_t len = IK_out_end(&data);
+
+  if (len == 0) {
+    DBSerial.println("Event too long");
+    return;
+  }
+  if (replayQuiet && ikReplay.isRunning()) return;
+  if (!ikTx.write(data, len)) {
+    DBSerial.println("TX ring full");
+    return;
   }
+  // Events queued during a flush go out with it
+  if (flushing) return;
+  if (batchCount++ == 0) batchStart = micros();
 }
 
-void IK_release(int x, int y)
+// Send the waiting events when the batch is full, too old, or using too
+// much of ikTx.
+void IK_tx_loop()
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"release\",\"x\":%d,\"y\":%d}", x, y);
-  if (buflen > 0) {
-    JSON.println(buf);
+  if ((batchCount > 0) && ((batchCount >= batchMax) ||
+        ((micros() - batchStart) >= batchUsec) ||
+        (ikTx.space() < IK_TX_HEADROOM))) {
+    batchCount = 0;
+    flushing = true;
+  }
+  if (flushing) {
+    ikTx.drain(JSON);
+    if (ikTx.used() == 0) flushing = false;
   }
 }
 
+// Events with two number members, for example x and y
+void IK_out_event(uint8_t type, const char *evt, const char *key1, int val1,
+    const char *key2, int val2)
+{
+  IK_out_begin(type, evt, IK_dev());
+  IK_out_member(key1, val1);
+  IK_out_member(key2, val2);
+  IK_out_send();
+}
+
+void IK_press(int x, int y)
+{
+  IK_out_event(IK_EVENT_MEMBRANE_PRESS, "press", "x", x, "y", y);
+}
+
+void IK_release(int x, int y)
+{
+  IK_out_event(IK_EVENT_MEMBRANE_RELEASE, "release", "x", x, "y", y);
+}
+
 void IK_switch(int switch_number, int switch_state)
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"switch\",\"num\":%d,\"st\":%d}",
-      switch_number, switch_state);
-  if (buflen > 0) {
-    JSON.println(buf);
-  }
+  IK_out_event(IK_EVENT_SWITCH, "switch", "num", switch_number,
+      "st", switch_state);
 }
 
 void IK_sensor(int sensor_number, int sensor_value)
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"sensor\",\"num\":%d,\"val\":%d}",
-      sensor_number, sensor_value);
-  if (buflen > 0) {
-    JSON.println(buf);
-  }
+  IK_out_event(IK_EVENT_SENSOR_CHANGE, "sensor", "num", sensor_number,
+      "val", sensor_value);
 }
 
 void IK_version(int major, int minor)
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"fwver\",\"major\":%d,\"minor\":%d}", major, minor);
-  if (buflen > 0) {
-    JSON.println(buf);
-  }
+  IK_out_event(IK_EVENT_VERSION, "fwver", "major", major, "minor", minor);
 }
 
 void IK_connect(void)
 {
-  JSON.println("{\"evt\":\"connect\"}");
+  IK_out_begin(IK_EVENT_CONNECT, "connect", IK_dev());
+  IK_out_send();
 }
 
 void IK_disconnect(void)
 {
-  JSON.println("{\"evt\":\"disconnect\"}");
+  memset(mySN[IK_dev()], 0, sizeof(mySN[0]));
+  IK_out_begin(IK_EVENT_DISCONNECT, "disconnect", IK_dev());
+  IK_out_send();
 }
 
 void IK_onoff(int onoff)
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"onoff\",\"val\":%d}", onoff);
-  if (buflen > 0) {
-    JSON.println(buf);
-  }
+  IK_out_begin(IK_EVENT_ONOFFSWITCH, "onoff", IK_dev());
+  IK_out_member("val", onoff);
+  IK_out_send();
+}
+
+void IK_put_SN(int dev)
+{
+  IK_out_begin(IK_EVENT_SERNUM, "sernum", dev);
+  IK_out_member("sn", mySN[dev]);
+  IK_out_send();
 }
 
 void IK_get_SN(uint8_t SN[IK_EEPROM_SN_SIZE])
 {
   // The SN parameter is not NUL terminated!
-  memcpy(mySN, SN, IK_EEPROM_SN_SIZE);
-  mySN[IK_EEPROM_SN_SIZE] = '\0';
-  JSON.print("{\"evt\":\"sernum\",\"sn\":\"");
-  JSON.print(mySN);
-  JSON.println("\"}");
+  memcpy(mySN[IK_dev()], SN, IK_EEPROM_SN_SIZE);
+  mySN[IK_dev()][IK_EEPROM_SN_SIZE] = '\0';
+  IK_put_SN(IK_dev());
 }
 
 void IK_correct_membrane(int x, int y)
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"corrmemb\",\"x\":%d,\"y\":%d}", x, y);
-  if (buflen > 0) {
-    JSON.println(buf);
-  }
+  IK_out_event(IK_EVENT_CORRECT_MEMBRANE, "corrmemb", "x", x, "y", y);
 }
 
 void IK_correct_switch(int switch_num, int switch_state)
 {
-  char buf[80];
-  int buflen;
-  buflen = snprintf(buf, sizeof(buf),
-      "{\"evt\":\"corrsw\",\"num\":%d,\"st\":%d}",
-      switch_num, switch_state);
-  if (buflen > 0) {
-    JSON.println(buf);
-  }
+  IK_out_event(IK_EVENT_CORRECT_SWITCH, "corrsw", "num", switch_num,
+      "st", switch_state);
 }
 
 void IK_correct_done()
 {
-  JSON.println("{\"evt\":\"corrdone\"}");
+  IK_out_begin(IK_EVENT_CORRECT_DONE, "corrdone", IK_dev());
+  IK_out_send();
 }
 
-void readCommand()
+// Startup timeline as [milestone,state,ms] triples. ms is the time since
+// the first milestone. fwms is the firmware download time of this IK and
+// fwallms is the time to download all IKs that were downloaded together.
+// The binary codec sends the ikrawevent record {count, entries...} where
+// each entry is {milestone, state, ms_lo, ms_hi}.
+void IK_timeline(const ik_milestone_t *timeline, uint8_t count)
+{
+  IK_out_begin(IK_EVENT_TIMELINE, "timeline", IK_dev());
+  if (ikCodec == IK_CODEC_BINARY) {
+    rawRecord[rawLen++] = count;
+    for (uint8_t i = 0; (i < count) && ((rawLen + 5) <= sizeof(rawRecord)); i++) {
+      uint32_t ms = (timeline[i].usec - timeline[0].usec) / 1000;
+      rawRecord[rawLen++] = timeline[i].milestone;
+      rawRecord[rawLen++] = timeline[i].state;
+      rawRecord[rawLen++] = ms;
+      rawRecord[rawLen++] = ms >> 8;
+    }
+    IK_out_send();
+    return;
+  }
+  IK_out_member("fwms", IntelliKeys::eventDevice()->firmwareLoadTime() / 1000);
+  IK_out_member("fwallms", IntelliKeys::firmwareLoadTimeAll() / 1000);
+  IK_out_key("ms");
+  IK_out_array_begin();
+  for (uint8_t i = 0; i < count; i++) {
+    IK_out_array_begin();
+    IK_out_number(timeline[i].milestone);
+    IK_out_number(timeline[i].state);
+    IK_out_number((timeline[i].usec - timeline[0].usec) / 1000);
+    IK_out_array_end();
+  }
+  IK_out_array_end();
+  IK_out_send();
+}
+
+// Reports played, time taken, and 1 if the recording ended with a bad
+// record. The binary codec sends the numbers 4 bytes LSB first.
+void IK_replay_done(void)
 {
-  char command[80];
-
-  int bytesAvail;
-  if ((bytesAvail = JSON.available()) > 0) {
-    size_t bytesIn;
-    JSON.setTimeout(10);
-    if ((bytesIn = JSON.readBytesUntil('\n', command, sizeof(command)-1)) > 0) {
-      command[bytesIn] = '\0';
-      // Parse JSON
-      const size_t capacity = JSON_OBJECT_SIZE(4) + 30;
-      DynamicJsonDocument doc(capacity);
-      DeserializationError error = deserializeJson(doc, command);
-
-      // Test if parsing succeeds.
-      if (error) {
-        DBSerial.print(F("deserializeJson() failed: "));
-        DBSerial.println(error.c_str());
-        return;
-      }
-
-      // Decode the command
-      const char* cmd = doc["cmd"];
-      if (strcmp(cmd, "setsnd") == 0) {
-        int freq = doc["freq"];
-        int dura = doc["dura"];
-        int vol = doc["vol"];
-        ikey1.sound(freq, dura, vol);
-      }
-      else if (strcmp(cmd, "setled") == 0) {
-        int num = doc["num"];
-        int val = doc["val"];
-        ikey1.setLED(num, val);
-      }
-      else if (strcmp(cmd, "getsn") == 0) {
-        JSON.print("{\"evt\":\"sernum\",\"sn\":\"");
-        JSON.print(mySN);
-        JSON.println("\"}");
-      }
-      else if (strcmp(cmd, "reset") == 0) {
-        ikey1.reset();
-      }
-      else if (strcmp(cmd, "getver") == 0) {
-        ikey1.get_version();
-      }
-      else if (strcmp(cmd, "getsnsrs") == 0) {
-        ikey1.get_all_sensors();
-      }
-      else if (strcmp(cmd, "getonoff") == 0) {
-        ikey1.get_onoff();
-      }
-      else if (strcmp(cmd, "getcorr") == 0) {
-        ikey1.get_correct();
-      }
+  uint32_t usec = micros() - replayStart;
+  IK_out_begin(IK_EVENT_REPLAY, "replay", replayDev->getIndex());
+  if (ikCodec == IK_CODEC_BINARY) {
+    uint32_t fields[] = {ikReplay.reports, usec};
+    for (size_t i = 0; i < 2; i++) {
+      for (size_t j = 0; j < 4; j++) rawRecord[rawLen++] = fields[i] >> (8 * j);
     }
+    rawRecord[rawLen++] = ikReplay.errors;
+    IK_out_send();
+    return;
+  }
+  IK_out_member("reports", ikReplay.reports);
+  IK_out_member("us", usec);
+  IK_out_member("errors", ikReplay.errors);
+  IK_out_send();
+}
+
+// A normal replay plays one report per pass and only when there is room
+// for its events, the same as polling a real IK. A quiet replay drops its
+// events and plays as fast as the driver decodes, so the replay event at
+// the end is a benchmark.
+void IK_replay_loop()
+{
+  if (!ikReplay.isRunning()) return;
+  if (!replayQuiet && (ikTx.space() < IK_TX_HEADROOM)) return;
+  if (ikReplay.loop(ikRecord, micros(), (replayQuiet) ? IKR_REPLAY_BURST : 1)) {
+    return;
+  }
+  IK_replay_done();
+}
+
+IKJsonReader jsonIn;
+
+// The batch settings apply to all IKs
+void setBatch(int32_t ms, int32_t lines)
+{
+  batchUsec = constrain(ms, 0, IK_BATCH_MAX_MS) * 1000;
+  batchMax = constrain(lines, 1, IK_BATCH_MAX_LINES);
+  DBSerial.printf("Batch %lu us %d events\n", batchUsec, batchMax);
+}
+
+// Events already queued go out in the old codec
+void setCodec(const char *codec)
+{
+  if (codec == NULL) return;
+  if (strcmp(codec, "json") == 0) {
+    ikCodec = IK_CODEC_JSON;
+  }
+  else if (strcmp(codec, "binary") == 0) {
+    ikCodec = IK_CODEC_BINARY;
+  }
+  else if (strcmp(codec, "cbor") == 0) {
+    ikCodec = IK_CODEC_CBOR;
+  }
+  else {
+    DBSerial.print("Unknown codec ");
+    DBSerial.println(codec);
+  }
+}
+
+// Run the command line jsonIn just parsed
+void execCommand()
+{
+  // Decode the command. "dev" is optional and defaults to 0.
+  const char *cmd = jsonIn.string("cmd");
+  if (cmd == NULL) return;
+  int dev = jsonIn.number("dev", 0);
+  if ((dev < 0) || (dev >= (int)IK_NUM_DEVICES)) return;
+  IntelliKeys *ikey = ikeys[dev];
+  switch (commandId(cmd)) {
+    case JSON_CMD_SETSND:
+      ikey->sound(jsonIn.number("freq", 0), jsonIn.number("dura", 0),
+          jsonIn.number("vol", 0));
+      break;
+    case JSON_CMD_SETLED:
+      ikey->setLED(jsonIn.number("num", 0), jsonIn.number("val", 0));
+      break;
+    case JSON_CMD_GETSN:
+      IK_put_SN(dev);
+      break;
+    case JSON_CMD_RESET:
+      ikey->reset();
+      break;
+    case JSON_CMD_GETVER:
+      ikey->get_version();
+      break;
+    case JSON_CMD_GETSNSRS:
+      ikey->get_all_sensors();
+      break;
+    case JSON_CMD_GETONOFF:
+      ikey->get_onoff();
+      break;
+    case JSON_CMD_GETCORR:
+      ikey->get_correct();
+      break;
+    case JSON_CMD_SETBATCH:
+      setBatch(jsonIn.number("ms", 2), jsonIn.number("lines", 8));
+      break;
+    case JSON_CMD_SETCODEC:
+      setCodec(jsonIn.string("codec"));
+      break;
+    case JSON_CMD_RECORD:
+      setRecord(ikey, jsonIn.number("on", 1));
+      break;
+    case JSON_CMD_REPLAY:
+      startReplay(ikey, jsonIn.number("speed", 1), jsonIn.number("quiet", 0));
+      break;
+    default:
+      DBSerial.print("Unknown command ");
+      DBSerial.println(cmd);
+      break;
+  }
+}
+
+// Commands are parsed one byte at a time. Only the bytes already received
+// are read so this never waits for the rest of a line.
+void readCommand()
+{
+  int c;
+  while ((c = JSON.read()) >= 0) {
+    if (jsonIn.put(c)) execCommand();
   }
 }
 
@@ -205,25 +360,31 @@ void setup() {
   JSON.begin(115200);
   myusb.Init();
 
-  ikey1.onConnect(IK_connect);
-  ikey1.onDisconnect(IK_disconnect);
-  ikey1.onMembranePress(IK_press);
-  ikey1.onMembraneRelease(IK_release);
-  ikey1.onSwitch(IK_switch);
-  ikey1.onSensor(IK_sensor);
-  ikey1.onVersion(IK_version);
-  ikey1.onOnOffSwitch(IK_onoff);
-  ikey1.onSerialNum(IK_get_SN);
-  ikey1.onSerialNum(IK_get_SN);
-  ikey1.onCorrectMembrane(IK_correct_membrane);
-  ikey1.onCorrectSwitch(IK_correct_switch);
-  ikey1.onCorrectDone(IK_correct_done);
+  for (size_t i = 0; i < IK_NUM_DEVICES; i++) {
+    IntelliKeys *ikey = ikeys[i];
+    ikey->onRawEvent(IK_raw);
+    ikey->onConnect(IK_connect);
+    ikey->onDisconnect(IK_disconnect);
+    ikey->onMembranePress(IK_press);
+    ikey->onMembraneRelease(IK_release);
+    ikey->onSwitch(IK_switch);
+    ikey->onSensor(IK_sensor);
+    ikey->onVersion(IK_version);
+    ikey->onOnOffSwitch(IK_onoff);
+    ikey->onSerialNum(IK_get_SN);
+    ikey->onCorrectMembrane(IK_correct_membrane);
+    ikey->onCorrectSwitch(IK_correct_switch);
+    ikey->onCorrectDone(IK_correct_done);
+    ikey->onTimeline(IK_timeline);
+  }
 
   memset(mySN, 0, sizeof(mySN));
 }
 
 void loop() {
   myusb.Task();
-  ikey1.Task();
+  if (ikTx.space() >= IK_TX_HEADROOM) IntelliKeys::TaskAll();
+  IK_replay_loop();
+  IK_tx_loop();
   readCommand();
 }
@@ -0,0 +1,62 @@
+// Record and replay sessions
+//
+// setRecord() records the raw reports of one IK into ikRecord. startReplay()
+// plays them back into an IK, which does not have to be connected, so the
+// same session can be run again and again. Recording stops when a replay
+// starts so the replayed reports are not recorded again, even when the
+// replay goes into the IK that was recorded.
+//
+// IK_raw() is the onRawEvent() callback of every IK. The sketch calls
+// ikReplay.loop(ikRecord, micros()) to play the due reports. Each one goes
+// through IntelliKeys::replay() so the callbacks see replayDev as
+// IntelliKeys::eventDevice().
+//
+// extras/test/ikreplay_test.cpp in the library includes this file.
+
+#ifndef __IKSESSION_H__
+#define __IKSESSION_H__
+
+#include <IntelliKeys.h>
+#include <IKRecord.h>
+
+IKRecorder ikRecord;
+IntelliKeys *recordDev;     // IK being recorded, NULL if none
+IntelliKeys *replayDev;     // IK the replay goes into
+bool replayQuiet;           // drop the events of the replay
+uint32_t replayStart;       // micros() when the replay started
+
+void IK_replay_report(const uint8_t *report, size_t len)
+{
+    replayDev->replay(report, len);
+}
+
+IKReplayer ikReplay(IK_replay_report);
+
+void IK_raw(const uint8_t *rxEvent, size_t len)
+{
+    if ((recordDev != NULL) && (IntelliKeys::eventDevice() == recordDev)) {
+        ikRecord.record(micros(), rxEvent, len);
+    }
+}
+
+// Start recording ikey from the beginning or stop recording
+void setRecord(IntelliKeys *ikey, bool on)
+{
+    ikReplay.stop();
+    if (on) ikRecord.clear();
+    recordDev = (on) ? ikey : NULL;
+}
+
+// A quiet replay plays at IKR_SPEED_MAX. Otherwise speed is 1 for real
+// time up to 1000 times faster, or 0 for IKR_SPEED_MAX.
+void startReplay(IntelliKeys *ikey, int32_t speed, bool quiet)
+{
+    recordDev = NULL;
+    replayDev = ikey;
+    replayQuiet = quiet;
+    ikRecord.rewind();
+    replayStart = micros();
+    ikReplay.begin(replayStart, (quiet) ? IKR_SPEED_MAX : constrain(speed, 0, 1000));
+}
+
+#endif /* __IKSESSION_H__ */
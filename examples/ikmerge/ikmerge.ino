@@ -0,0 +1,140 @@
+/*
+ * Demonstrate IntelliKeysMerger. Several IntelliKeys (IK) are plugged into a
+ * USB hub. Their events are merged into one stream in time order and printed
+ * as JSON on the serial port. Each event is tagged with the device index and
+ * serial number of the IK that sent it.
+ */
+
+#include <IntelliKeys.h>
+#include <IntelliKeysMerger.h>
+#include <usbhub.h>
+
+// On Arduino Zero debug on and send JSON to debug port
+#if defined(ARDUINO_SAMD_ZERO)
+#define DBSerial  if(1)Serial
+#define JSON      Serial
+#else
+// All other boards including Trinket M0, debug off and send JSON to Serial1
+#define DBSerial  if(0)Serial
+#define JSON      Serial1
+#endif
+
+USBHost myusb;
+USBHub hub1(&myusb);
+IntelliKeys ikey1(&myusb);
+IntelliKeys ikey2(&myusb);
+IntelliKeys ikey3(&myusb);
+IntelliKeysMerger ikeys;
+
+// Print the queue statistics of all devices every 10 seconds
+#define STATS_PERIOD_MS (10000)
+
+void IK_event(const ik_merged_event_t *ev)
+{
+  char buf[80];
+  int buflen;
+
+  switch (ev->type) {
+    case IK_EVENT_MEMBRANE_PRESS:
+      buflen = snprintf(buf, sizeof(buf), "\"press\",\"x\":%d,\"y\":%d",
+          ev->a, ev->b);
+      break;
+    case IK_EVENT_MEMBRANE_RELEASE:
+      buflen = snprintf(buf, sizeof(buf), "\"release\",\"x\":%d,\"y\":%d",
+          ev->a, ev->b);
+      break;
+    case IK_EVENT_SWITCH:
+      buflen = snprintf(buf, sizeof(buf), "\"switch\",\"num\":%d,\"st\":%d",
+          ev->a, ev->b);
+      break;
+    case IK_EVENT_SENSOR_CHANGE:
+      buflen = snprintf(buf, sizeof(buf), "\"sensor\",\"num\":%d,\"val\":%d",
+          ev->a, ev->b);
+      break;
+    case IK_EVENT_VERSION:
+      buflen = snprintf(buf, sizeof(buf), "\"fwver\",\"major\":%d,\"minor\":%d",
+          ev->a, ev->b);
+      break;
+    case IK_EVENT_ONOFFSWITCH:
+      buflen = snprintf(buf, sizeof(buf), "\"onoff\",\"val\":%d", ev->a);
+      break;
+    case IK_EVENT_CORRECT_MEMBRANE:
+      buflen = snprintf(buf, sizeof(buf), "\"corrmemb\",\"x\":%d,\"y\":%d",
+          ev->a, ev->b);
+      break;
+    case IK_EVENT_CORRECT_SWITCH:
+      buflen = snprintf(buf, sizeof(buf), "\"corrsw\",\"num\":%d,\"st\":%d",
+          ev->a, ev->b);
+      break;
+    case IK_EVENT_CORRECT_DONE:
+      buflen = snprintf(buf, sizeof(buf), "\"corrdone\"");
+      break;
+    case IK_EVENT_CONNECT:
+      buflen = snprintf(buf, sizeof(buf), "\"connect\"");
+      break;
+    case IK_EVENT_DISCONNECT:
+      buflen = snprintf(buf, sizeof(buf), "\"disconnect\"");
+      break;
+    case IK_EVENT_SERNUM:
+      buflen = snprintf(buf, sizeof(buf), "\"sernum\"");
+      break;
+    default:
+      return;
+  }
+  if (buflen > 0) {
+    JSON.print("{\"evt\":");
+    JSON.print(buf);
+    JSON.print(",\"dev\":");
+    JSON.print(ev->dev);
+    JSON.print(",\"sn\":\"");
+    JSON.print(ev->sn);
+    JSON.print("\",\"us\":");
+    JSON.print(ev->usec);
+    JSON.println("}");
+  }
+}
+
+void IK_stats()
+{
+  static uint32_t lastStats;
+  char buf[80];
+  int buflen;
+
+  if ((millis() - lastStats) < STATS_PERIOD_MS) return;
+  lastStats = millis();
+  for (uint8_t dev = 0; dev < IK_MAX_DEVICES; dev++) {
+    const ik_merger_stats_t *stats = ikeys.stats(dev);
+    if (stats == NULL) continue;
+    buflen = snprintf(buf, sizeof(buf),
+        "{\"evt\":\"stats\",\"dev\":%d,\"drop\":%lu,\"stall\":%lu,\"hiwat\":%d}",
+        dev, (unsigned long)stats->dropped, (unsigned long)stats->stalled,
+        stats->highWater);
+    if (buflen > 0) {
+      JSON.println(buf);
+    }
+  }
+}
+
+void setup() {
+  DBSerial.begin(115200);
+  DBSerial.println("IntelliKeys Merger Test");
+  JSON.begin(115200);
+  myusb.Init();
+
+  ikeys.add(&ikey1);
+  ikeys.add(&ikey2);
+  ikeys.add(&ikey3);
+}
+
+void loop() {
+  ik_merged_event_t ev;
+
+  myusb.Task();
+  ikeys.Task();
+  // Limit the number of events per loop so USB keeps getting serviced.
+  // Events left behind stay in the merger queues.
+  for (int i = 0; (i < 4) && ikeys.read(&ev); i++) {
+    IK_event(&ev);
+  }
+  IK_stats();
+}
@@ -1,9 +1,13 @@
 /*
  * Demonstrate the use of the USB Host Library for SAMD IntelliKeys (IK) USB
  * host driver. Send raw IK events out a Serial port
+ *
+ * Events and commands use the version 2 link protocol. See IKLink.h and
+ * README.md.
  */
 
 #include <IntelliKeys.h>
+#include <IKLink.h>
 
 // On Arduino Zero debug on and send JSON to debug port
 #if defined(ARDUINO_SAMD_ZERO)
@@ -20,6 +24,46 @@ IntelliKeys ikey1(&myusb);
 
 char mySN[IK_EEPROM_SN_SIZE+1]; //+1 NUL
 
+// Events wait here until the client has room for them. Sensor values and
+// successful ACKs are merged or dropped first when the client is slow.
+// Rejected ACKs are never merged because the client acts on each one.
+// Membrane and switch edges are never dropped. Instead the IK is not polled
+// until there is room again. The IK keeps its events until it is polled.
+IKLinkEventQueue ikEventQueue;
+IKLinkCredit ikCredit;
+uint32_t ikStalls;
+uint32_t ikLost;
+// Events are collected here then sent as one frame per loop()
+IKLinkEncoder ikLinkOut;
+// Encoded frames wait here until the UART can take them. Sending never
+// blocks so a burst of events cannot stall USB polling.
+IKLinkTxRing ikTxRing;
+// UART rate negotiation. The client sends IK_CMD_BAUD with the index of the
+// new rate. The new rate is used after the ACK has been sent. If no valid
+// frame arrives at the new rate for IK_BAUD_WATCHDOG ms, go back to the
+// start rate so both sides can find each other again. A client that uses a
+// higher rate must send at least one frame in that time, such as a credit
+// record.
+#define IK_BAUD_WATCHDOG  (1000)  // ms
+uint8_t ikBaudIndex;
+int ikBaudPending = -1;
+uint32_t ikLastFrame;   // millis() of the last valid frame
+// IKL_OPT bits set by the client with IK_CMD_OPTIONS
+uint8_t ikOptions;
+// Membrane events are collected here when IKL_OPT_PACKED_MEMBRANE is on
+IKLinkMembranePacker ikPacker;
+uint32_t ikPackUsec;    // micros() of the first packed event
+// Sequence number for the frame header, see IKL_OPT_FRAME_HEADER
+uint8_t ikFrameSeq;
+// Membrane events and the record bytes used to send them, including the
+// record len byte. Printed on the debug port every IK_STATS_PERIOD ms.
+#define IK_STATS_PERIOD   (10000) // ms
+uint32_t ikMembraneEvents;
+uint32_t ikMembraneBytes;
+uint32_t ikStatsTime;
+void execCommand(const uint8_t *command, size_t len);
+IKLinkDecoder ikLinkIn(execCommand);
+
 #ifdef ADAFRUIT_TRINKET_M0
 // setup Dotstar LED on Trinket M0
 #include <Adafruit_DotStar.h>
@@ -28,8 +72,82 @@ char mySN[IK_EEPROM_SN_SIZE+1]; //+1 NUL
 Adafruit_DotStar strip = Adafruit_DotStar(1, DATAPIN, CLOCKPIN, DOTSTAR_BRG);
 #endif
 
+// Queue the packed membrane events
+void IK_pack_flush()
+{
+  uint8_t buf[1 + (2 * IKL_PACKED_MAX_WORDS)];
+
+  if (ikPacker.empty()) return;
+  uint8_t len = ikPacker.take(IK_EVENT_MEMBRANE_PACKED, buf);
+  ikMembraneBytes += 1 + len;
+  ikEventQueue.push(buf, len, 0, ikPackUsec);
+}
+
+// Queue one event record. record[0] is the event type.
+void IK_send(const uint8_t *record, uint8_t len)
+{
+  if ((record[0] == IK_EVENT_MEMBRANE_PRESS) ||
+      (record[0] == IK_EVENT_MEMBRANE_RELEASE)) {
+    bool press = (record[0] == IK_EVENT_MEMBRANE_PRESS);
+    ikMembraneEvents++;
+    if (ikOptions & IKL_OPT_PACKED_MEMBRANE) {
+      if (ikPacker.empty()) ikPackUsec = micros();
+      if (ikPacker.add(press, record[1], record[2])) return;
+      IK_pack_flush();
+      ikPackUsec = micros();
+      if (ikPacker.add(press, record[1], record[2])) return;
+    }
+    ikMembraneBytes += 1 + len;
+  }
+  else {
+    // Keep the events in order
+    IK_pack_flush();
+  }
+
+  ikEventQueue.pushEvent(record, len, micros());
+}
+
+// Move queued events as one frame to the TX ring if the client has room
+void IK_flush()
+{
+  uint8_t frame[IKL_MAX_ENCODED];
+
+  IK_pack_flush();
+  if (ikEventQueue.empty()) return;
+  if (ikTxRing.space() < IKL_MAX_ENCODED) return;
+  uint32_t usec;
+  ikEventQueue.pop(ikLinkOut, ikCredit.available(), ikCredit.idle(), &usec);
+  if (ikLinkOut.empty()) return;
+  ikLinkOut.setHeader(ikFrameSeq++, usec);
+  size_t len = ikLinkOut.encode(frame);
+  ikTxRing.write(frame, len);
+  ikCredit.send(len);
+}
+
+// Send as much of the TX ring as the UART can take without blocking
+void IK_drain()
+{
+  ikTxRing.drain(IKSerial);
+  uint32_t lost = ikEventQueue.dropped + ikEventQueue.overflows;
+  if (lost != ikLost) {
+    ikLost = lost;
+    DBSerial.print("Events dropped="); DBSerial.print(ikEventQueue.dropped);
+    DBSerial.print(" overflows="); DBSerial.print(ikEventQueue.overflows);
+    DBSerial.print(" stalls="); DBSerial.println(ikStalls);
+  }
+  if ((millis() - ikStatsTime) > IK_STATS_PERIOD) {
+    ikStatsTime = millis();
+    if (ikMembraneEvents) {
+      DBSerial.print("Membrane events="); DBSerial.print(ikMembraneEvents);
+      DBSerial.print(" bytes="); DBSerial.print(ikMembraneBytes);
+      DBSerial.print(" bytes/event=");
+      DBSerial.println((float)ikMembraneBytes / ikMembraneEvents);
+    }
+  }
+}
+
 // Raw undecoded events from the IK. Just send them as-is.
-// The byte following the length is the event type.
+// The first byte is the event type.
 void IK_raw_event(const uint8_t *rxevent, size_t len)
 {
   if ((*rxevent == IK_EVENT_MEMBRANE_PRESS) || (*rxevent == IK_EVENT_MEMBRANE_RELEASE)) {
@@ -42,21 +160,15 @@ void IK_raw_event(const uint8_t *rxevent, size_t len)
     case IK_EVENT_CORRECT_MEMBRANE:
     case IK_EVENT_CORRECT_SWITCH:
     case IK_EVENT_VERSION:
-      IKSerial.write(0xFF);
-      IKSerial.write(3);
-      IKSerial.write(rxevent, 3);
+      IK_send(rxevent, 3);
       break;
 
     case IK_EVENT_ONOFFSWITCH:
-      IKSerial.write(0xFF);
-      IKSerial.write(2);
-      IKSerial.write(rxevent, 2);
+      IK_send(rxevent, 2);
       break;
 
     case IK_EVENT_CORRECT_DONE:
-      IKSerial.write(0xFF);
-      IKSerial.write(1);
-      IKSerial.write(rxevent, 1);
+      IK_send(rxevent, 1);
       break;
 
     case IK_EVENT_SENSOR_CHANGE:    // See IK_sensor
@@ -71,22 +183,22 @@ void IK_raw_event(const uint8_t *rxevent, size_t len)
 
 void IK_sensor(int sensor_number, int sensor_value)
 {
-  uint8_t evt[5] = {0xFF, 3, IK_EVENT_SENSOR_CHANGE,
+  uint8_t evt[3] = {IK_EVENT_SENSOR_CHANGE,
     (uint8_t)sensor_number, (uint8_t)sensor_value};
-  IKSerial.write(evt, sizeof(evt));
+  IK_send(evt, sizeof(evt));
 }
 
 // The following events are generated by the driver, not the IK.
 void IK_connect(void)
 {
-  uint8_t buf[3] = {0xFF, 1, IK_EVENT_CONNECT};
-  IKSerial.write(buf, sizeof(buf));
+  uint8_t buf[1] = {IK_EVENT_CONNECT};
+  IK_send(buf, sizeof(buf));
 }
 
 void IK_disconnect(void)
 {
-  uint8_t buf[3] = {0xFF, 1, IK_EVENT_DISCONNECT};
-  IKSerial.write(buf, sizeof(buf));
+  uint8_t buf[1] = {IK_EVENT_DISCONNECT};
+  IK_send(buf, sizeof(buf));
   memset(mySN, 0, sizeof(mySN));
 }
 
@@ -96,66 +208,184 @@ void IK_get_SN(uint8_t SN[IK_EEPROM_SN_SIZE])
   mySN[IK_EEPROM_SN_SIZE] = '\0';
 }
 
+// Startup timeline, one record per connection. Each entry is the milestone,
+// IK_state, and milliseconds since the first milestone (16 bits, LSB first).
+void IK_timeline(const ik_milestone_t *timeline, uint8_t count)
+{
+  uint8_t buf[2 + (IK_TIMELINE_SIZE * 4)];
+  uint8_t *p = buf;
+
+  *p++ = IK_EVENT_TIMELINE;
+  *p++ = count;
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t ms = (timeline[i].usec - timeline[0].usec) / 1000;
+    if (ms > 0xFFFF) ms = 0xFFFF;
+    *p++ = timeline[i].milestone;
+    *p++ = timeline[i].state;
+    *p++ = (uint8_t)ms;
+    *p++ = (uint8_t)(ms >> 8);
+  }
+  IK_send(buf, p - buf);
+}
+
+// Everything a client needs to resync in one record. See README.md.
+void IK_put_snapshot()
+{
+  ik_snapshot_t snap;
+  uint8_t buf[1 + IKL_SNAPSHOT_PARAMS];
+  uint8_t *p = buf;
+
+  ikey1.getSnapshot(&snap);
+  *p++ = IK_EVENT_SNAPSHOT;
+  *p++ = ikey1.isReady();
+  memcpy(p, snap.membrane, sizeof(snap.membrane));
+  p += sizeof(snap.membrane);
+  *p++ = snap.switches;
+  *p++ = snap.sensors;
+  *p++ = (uint8_t)snap.leds;
+  *p++ = (uint8_t)(snap.leds >> 8);
+  *p++ = snap.onoff;
+  *p++ = snap.versionMajor;
+  *p++ = snap.versionMinor;
+  memcpy(p, snap.serialnumber, IK_EEPROM_SN_SIZE);
+  p += IK_EEPROM_SN_SIZE;
+  IK_send(buf, p - buf);
+}
+
 void IK_put_SN()
 {
-  uint8_t buf[3] = {0xFF, IK_EEPROM_SN_SIZE+1, IK_EVENT_SERNUM};
-  IKSerial.write(buf, sizeof(buf));
-  IKSerial.write(mySN, IK_EEPROM_SN_SIZE);
+  uint8_t buf[1 + IK_EEPROM_SN_SIZE] = {IK_EVENT_SERNUM};
+  memcpy(buf + 1, mySN, IK_EEPROM_SN_SIZE);
+  IK_send(buf, sizeof(buf));
 }
 
+// Commands dropped because of an unknown type or wrong length
+uint32_t ikCmdErrors;
+
+// Commands are decoded one byte at a time. Only the bytes already received
+// are read, at most IKL_RX_BUDGET, so this never waits for the rest of a
+// frame. ikLinkIn calls execCommand for each command in each valid frame
+// and resyncs on the next frame delimiter after an error.
 void readCommand()
 {
-  static uint8_t command[16];
-  static size_t cmdLen;
-  static uint8_t *p;
-  static uint8_t cmdState;
-
-  if (!ikey1.isReady()) return;
-
-  while (IKSerial.available() > 0) {
-    size_t bytesIn;
-    switch (cmdState) {
-      case 0: // Scan for 0xFF
-        if (IKSerial.read() == 0xFF) {
-          cmdState = 1;
-        }
-        break;
-      case 1: // Get cmdLen value
-        cmdLen = IKSerial.read();
-        if (cmdLen > sizeof(command)) cmdLen = sizeof(command);
-        p = command;
-        cmdState = 2;
-        break;
-      case 2: // Get cmdLen bytes
-        bytesIn = IKSerial.readBytes(p, cmdLen - (p - command));
-        if (bytesIn > 0) {
-          p += bytesIn;
-          if (cmdLen == (p - command)) {
-            cmdState = 0;
-            // Have a complete command
-            execCommand(command, cmdLen);
-          }
-        }
-        break;
-      default:
-        DBSerial.print("Invalid cmdState ");
-        DBSerial.println(cmdState);
-        break;
-    }
+  int avail = IKSerial.available();
+  if (avail > IKL_RX_BUDGET) avail = IKL_RX_BUDGET;
+  while (avail-- > 0) {
+    if (ikLinkIn.put(IKSerial.read())) ikLastFrame = millis();
   }
 }
 
+void IK_set_baud(uint8_t index)
+{
+  IKSerial.end();
+  IKSerial.begin(ikl_baud(index));
+  ikBaudIndex = index;
+  ikLastFrame = millis();
+  DBSerial.print("UART baud="); DBSerial.println(ikl_baud(index));
+}
+
+void IK_baud_loop()
+{
+  if (ikBaudPending >= 0) {
+    // Wait until the ACK is out of the UART
+    if (!ikEventQueue.empty() || (ikTxRing.used() > 0)) return;
+    IKSerial.flush();
+    IK_set_baud(ikBaudPending);
+    ikBaudPending = -1;
+  }
+  else if ((ikBaudIndex != 0) && ((millis() - ikLastFrame) > IK_BAUD_WATCHDOG)) {
+    IK_set_baud(0);
+  }
+}
+
+// Return the test pattern as received so the client can check both directions
+void IK_baud_test(const uint8_t *pattern)
+{
+  uint8_t buf[1 + IKL_BAUD_TEST_LEN] = {IK_EVENT_BAUD_TEST};
+  memcpy(buf + 1, pattern, IKL_BAUD_TEST_LEN);
+  IK_send(buf, sizeof(buf));
+}
+
+// Tell the client a command is done so it can send more. status is 0 if the
+// command was run, 1 if it was dropped.
+void IK_ack(uint8_t seq, uint8_t status)
+{
+  uint8_t buf[3] = {IK_EVENT_ACK, seq, status};
+  IK_send(buf, sizeof(buf));
+}
+
+// command is {type, seq, params...}
 void execCommand(const uint8_t *command, size_t len)
 {
+  // {IK_CMD_CREDIT, count_lo, count_hi, window_lo, window_hi} has no seq
+  // and no ACK. Older clients send a one byte window.
+  if (command[0] == IK_CMD_CREDIT) {
+    if ((len == 4) || (len == 5)) {
+      ikCredit.grant(command[1] | (command[2] << 8),
+          command[3] | ((len == 5) ? (command[4] << 8) : 0), millis());
+    }
+    return;
+  }
+  if (!ikl_command_ok(command, len)) {
+    ikCmdErrors++;
+    DBSerial.print("Bad command="); DBSerial.print(command[0]);
+    DBSerial.print(" len="); DBSerial.println(len);
+    if (len >= 2) IK_ack(command[1], 1);
+    return;
+  }
+  const uint8_t *params = command + 2;
+  // Link commands work without an IK
+  switch (command[0]) {
+    case IK_CMD_BAUD:
+      if (ikl_baud(params[0])) {
+        ikBaudPending = params[0];
+        IK_ack(command[1], 0);
+      }
+      else {
+        IK_ack(command[1], 1);
+      }
+      return;
+    case IK_CMD_BAUD_TEST:
+      IK_baud_test(params);
+      IK_ack(command[1], 0);
+      return;
+    case IK_CMD_GET_SNAPSHOT:
+      IK_put_snapshot();
+      IK_ack(command[1], 0);
+      return;
+    case IK_CMD_OPTIONS:
+      // Turn on the supported options. Fail if any others were asked for.
+      IK_pack_flush();
+      ikOptions = params[0] & (IKL_OPT_PACKED_MEMBRANE | IKL_OPT_FRAME_HEADER);
+      IK_flush();
+      ikLinkOut.useHeader(ikOptions & IKL_OPT_FRAME_HEADER);
+      IK_ack(command[1], (ikOptions == params[0]) ? 0 : 1);
+      return;
+    default:
+      break;
+  }
+  if (!ikey1.isReady()) {
+    IK_ack(command[1], 1);
+    return;
+  }
   switch (command[0]) {
     case IK_CMD_GET_VERSION:
       ikey1.get_version();
       break;
     case IK_CMD_LED:
-      ikey1.setLED(command[1], command[2]);
+      ikey1.setLED(params[0], params[1]);
       break;
+    case IK_CMD_SET_LEDS: {
+      // {mask_lo, mask_hi, state_lo, state_hi}, LED n is bit n
+      uint16_t mask = params[0] | (params[1] << 8);
+      uint16_t state = params[2] | (params[3] << 8);
+      for (uint8_t i = 0; i < 16; i++) {
+        if (mask & (1 << i)) ikey1.setLED(i, (state >> i) & 1);
+      }
+      break;
+    }
     case IK_CMD_TONE:
-      ikey1.sound(command[1], command[3], command[2]);
+      ikey1.sound(params[0], params[2], params[1]);
       break;
     case IK_CMD_ONOFFSWITCH:
       ikey1.get_onoff();
@@ -172,21 +402,10 @@ void execCommand(const uint8_t *command, size_t len)
     case IK_CMD_GET_SN:
       IK_put_SN();
       break;
-    case IK_CMD_EEPROM_READBYTE:
-    case IK_CMD_SCAN:
-    case IK_CMD_GET_EVENT:
-    case IK_CMD_INIT:
-    case IK_CMD_EEPROM_READ:
-    case IK_CMD_EEPROM_WRITE:
-    case IK_CMD_START_AUTO:
-    case IK_CMD_STOP_AUTO:
-    case IK_CMD_ALL_LEDS:
-    case IK_CMD_START_OUTPUT:
-    case IK_CMD_STOP_OUTPUT:
-      break;
     default:
       break;
   }
+  IK_ack(command[1], 0);
 }
 
 void setup() {
@@ -201,10 +420,9 @@ void setup() {
 #endif
   DBSerial.begin(115200);
   DBSerial.println("IntelliKeys USB Test");
-  // If there are concerns about IKSerial transmission being too slow, boost
-  // the UART speed. 4*115200 or 8*115200 works on the SAMD21. Make sure to
-  // match the UART speed on the other side.
-  IKSerial.begin(115200);
+  // Always start at 115200. The client may ask for up to 8*115200 with
+  // IK_CMD_BAUD.
+  IKSerial.begin(ikl_baud(0));
   myusb.Init();
 
   ikey1.onConnect(IK_connect);
@@ -212,11 +430,21 @@ void setup() {
   ikey1.onSensor(IK_sensor);
   ikey1.onSerialNum(IK_get_SN);
   ikey1.onRawEvent(IK_raw_event);
+  ikey1.onTimeline(IK_timeline);
   memset(mySN, 0, sizeof(mySN));
 }
 
 void loop() {
   myusb.Task();
-  ikey1.Task();
+  // Do not poll the IK while waiting to change the UART rate
+  if ((ikEventQueue.space() >= IKL_QUEUE_HEADROOM) && (ikBaudPending < 0)) {
+    ikey1.Task();
+  }
+  else {
+    ikStalls++;
+  }
   readCommand();
+  IK_flush();
+  IK_drain();
+  IK_baud_loop();
 }
@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+# Compile an IntelliKeys overlay layout into a keymap file for ikrawevent_ard.
+# Copy the output to the ikrawevent_ard USB flash drive as KEYMAP.IKM. The
+# new keymap is used as soon as the file has been written.
+#
+# See keymap.h for the binary format.
+#
+# Layout file, one region per line. # starts a comment.
+#
+#   region X Y WIDTH HEIGHT ACTION
+#       X, Y, WIDTH, HEIGHT are membrane switches, 0..23.
+#   cell ROW COL ACTION
+#       A virtual button of ikrawevent_ard, 2 columns by 3 rows. ROW is
+#       0..7 and COL is 0..11.
+#
+# ACTION is one of
+#
+#   key NAME            HID key, for example key a, key f1, key page_up
+#   key MOD+...+NAME    key with modifiers held, for example key ctrl+c
+#   mouse MOVE          nw n ne w e sw s se click double_click right_click
+#                       press
+#   macro NAME          run a macro
+#
+# NAME is a TinyUSB HID_KEY_ name without HID_KEY_ in any case or a number.
+# MOD is ctrl, shift, alt, gui, or right_ctrl, right_shift, right_alt,
+# right_gui.
+#
+# Macros are defined on their own line, before or after the regions that
+# use them.
+#
+#   macro NAME STEP...
+#
+# STEP is one of
+#
+#   "text"              type the text, \n is Enter and \t is Tab
+#   tap MOD+...+NAME    press and release a key with exactly these
+#                       modifiers, for example tap ctrl+s
+#   press NAME          press and hold a key
+#   release NAME        release a key
+#   delay MS            wait MS milliseconds, rounded to 10 ms
+#
+# Example
+#
+#   macro hello "Hello, my name is Sam." tap return
+#   cell 0 4 macro hello
+#
+# Usage: ikmapc.py layout.txt -o KEYMAP.IKM
+
+import argparse
+import shlex
+import struct
+import sys
+
+KEYMAP_VERSION = 2
+KEYMAP_MAX_REGIONS = 128
+KEYMAP_MAX_MACROS = 32
+KEYMAP_MACRO_SIZE = 512
+KEYMAP_KEY = 1
+KEYMAP_MOUSE = 2
+KEYMAP_MACRO = 3
+RESOLUTION = 24
+
+MACRO_END = 0
+MACRO_PRESS = 1
+MACRO_RELEASE = 2
+MACRO_TAP = 3
+MACRO_DELAY = 4
+
+HID_KEYS = {
+    'return': 0x28, 'enter': 0x28, 'escape': 0x29, 'backspace': 0x2a,
+    'tab': 0x2b, 'space': 0x2c, 'minus': 0x2d, 'equal': 0x2e,
+    'bracket_left': 0x2f, 'bracket_right': 0x30, 'backslash': 0x31,
+    'euro_1': 0x32, 'semicolon': 0x33, 'apostrophe': 0x34, 'grave': 0x35,
+    'comma': 0x36, 'period': 0x37, 'slash': 0x38, 'caps_lock': 0x39,
+    'print_screen': 0x46, 'scroll_lock': 0x47, 'pause': 0x48,
+    'insert': 0x49, 'home': 0x4a, 'page_up': 0x4b, 'delete': 0x4c,
+    'end': 0x4d, 'page_down': 0x4e, 'arrow_right': 0x4f,
+    'arrow_left': 0x50, 'arrow_down': 0x51, 'arrow_up': 0x52,
+    'num_lock': 0x53, 'keypad_divide': 0x54, 'keypad_multiply': 0x55,
+    'keypad_subtract': 0x56, 'keypad_add': 0x57, 'keypad_enter': 0x58,
+    'keypad_decimal': 0x63, 'euro_2': 0x64, 'application': 0x65,
+    'control_left': 0xe0, 'shift_left': 0xe1, 'alt_left': 0xe2,
+    'gui_left': 0xe3, 'control_right': 0xe4, 'shift_right': 0xe5,
+    'alt_right': 0xe6, 'gui_right': 0xe7,
+}
+for i in range(26):
+    HID_KEYS[chr(ord('a') + i)] = 0x04 + i
+for i in range(1, 10):
+    HID_KEYS[str(i)] = 0x1e + i - 1
+    HID_KEYS['keypad_' + str(i)] = 0x59 + i - 1
+HID_KEYS['0'] = 0x27
+HID_KEYS['keypad_0'] = 0x62
+for i in range(1, 13):
+    HID_KEYS['f' + str(i)] = 0x3a + i - 1
+
+MODIFIERS = {
+    'ctrl': 0x01, 'shift': 0x02, 'alt': 0x04, 'gui': 0x08,
+    'right_ctrl': 0x10, 'right_shift': 0x20, 'right_alt': 0x40,
+    'right_gui': 0x80,
+}
+
+# Same order as enum mouse_actions in ikrawevent_ard.ino
+MOUSE_ACTIONS = {
+    'nw': 1, 'n': 2, 'ne': 3, 'w': 4, 'click': 5, 'e': 6,
+    'sw': 7, 's': 8, 'se': 9, 'double_click': 10, 'right_click': 11,
+    'press': 12,
+}
+
+
+class LayoutError(Exception):
+    pass
+
+
+def crc16(buf):
+    # CRC-16/CCITT-FALSE, same as ikl_crc16() in IKLink.h
+    crc = 0xFFFF
+    for b in buf:
+        x = ((crc >> 8) ^ b) & 0xFF
+        x ^= x >> 4
+        crc = ((crc << 8) ^ (x << 12) ^ (x << 5) ^ x) & 0xFFFF
+    return crc
+
+
+def number(text):
+    try:
+        return int(text, 0)
+    except ValueError:
+        raise LayoutError("bad number '%s'" % text)
+
+
+def parse_key(name):
+    # Returns key code, modifiers
+    parts = name.lower().split('+')
+    modifiers = 0
+    for mod in parts[:-1]:
+        if mod not in MODIFIERS:
+            raise LayoutError("unknown modifier '%s'" % mod)
+        modifiers |= MODIFIERS[mod]
+    key = parts[-1]
+    if key.startswith('hid_key_'):
+        key = key[len('hid_key_'):]
+    code = HID_KEYS[key] if key in HID_KEYS else number(key)
+    if not 0 < code < 256:
+        raise LayoutError("key code %d out of range" % code)
+    return code, modifiers
+
+
+def parse_action(words, macros):
+    if len(words) != 2:
+        raise LayoutError("action must be 'key NAME', 'mouse MOVE', or "
+                          "'macro NAME'")
+    kind, name = words[0].lower(), words[1]
+    if kind == 'key':
+        return (KEYMAP_KEY,) + parse_key(name)
+    if kind == 'mouse':
+        if name.lower() not in MOUSE_ACTIONS:
+            raise LayoutError("unknown mouse action '%s'" % name)
+        return KEYMAP_MOUSE, MOUSE_ACTIONS[name.lower()], 0
+    if kind == 'macro':
+        if name not in macros:
+            raise LayoutError("unknown macro '%s'" % name)
+        return KEYMAP_MACRO, macros[name], 0
+    raise LayoutError("unknown action '%s'" % kind)
+
+
+def compile_macro(steps):
+    code = bytearray()
+    i = 0
+    while i < len(steps):
+        step = steps[i]
+        if step.kind == 'text':
+            for c in step.text:
+                if c not in '\t\n' and not ' ' <= c <= '~':
+                    raise LayoutError("cannot type %r" % c)
+                code.append(ord(c))
+            i += 1
+            continue
+        if i + 1 >= len(steps) or steps[i + 1].kind == 'text':
+            raise LayoutError("%s needs a value" % step.text)
+        op, arg = step.text.lower(), steps[i + 1].text
+        if op == 'tap':
+            key, modifiers = parse_key(arg)
+            code += bytes([MACRO_TAP, key, modifiers])
+        elif op in ('press', 'release'):
+            key, modifiers = parse_key(arg)
+            if modifiers:
+                raise LayoutError("%s takes one key" % op)
+            code += bytes([MACRO_PRESS if op == 'press' else MACRO_RELEASE,
+                           key])
+        elif op == 'delay':
+            ticks = (number(arg) + 5) // 10
+            while ticks > 0:
+                code += bytes([MACRO_DELAY, min(ticks, 255)])
+                ticks -= 255
+        else:
+            raise LayoutError("unknown macro step '%s'" % step.text)
+        i += 2
+    code.append(MACRO_END)
+    return code
+
+
+class Token:
+    def __init__(self, kind, text):
+        self.kind = kind
+        self.text = text
+
+
+def tokenize(line):
+    # Quoted strings are text. Everything else is a word.
+    lexer = shlex.shlex(line, posix=False)
+    lexer.whitespace_split = True
+    lexer.commenters = '#'
+    tokens = []
+    for word in lexer:
+        if len(word) >= 2 and word[0] == word[-1] and word[0] in '"\'':
+            text = word[1:-1].encode('utf-8').decode('unicode_escape')
+            tokens.append(Token('text', text))
+        else:
+            tokens.append(Token('word', word))
+    return tokens
+
+
+def parse_line(words, macros):
+    if words[0] == 'region':
+        if len(words) < 5:
+            raise LayoutError("region needs X Y WIDTH HEIGHT")
+        x, y, width, height = [number(w) for w in words[1:5]]
+        action = words[5:]
+    elif words[0] == 'cell':
+        if len(words) < 3:
+            raise LayoutError("cell needs ROW COL")
+        row, col = number(words[1]), number(words[2])
+        if not (0 <= row < 8 and 0 <= col < 12):
+            raise LayoutError("cell %d %d is not on the 8x12 grid" % (row, col))
+        x, y, width, height = col * 2, row * 3, 2, 3
+        action = words[3:]
+    else:
+        raise LayoutError("unknown line type '%s'" % words[0])
+    if not (0 <= x < RESOLUTION and 0 <= y < RESOLUTION and
+            0 < width <= RESOLUTION - x and 0 < height <= RESOLUTION - y):
+        raise LayoutError("region is not on the membrane")
+    return (x, y, width, height) + parse_action(action, macros)
+
+
+def compile_layout(lines, name='layout'):
+    # Macros first so regions can use macros defined after them
+    lines = list(lines)
+    macros = {}
+    code = bytearray()
+    regions = []
+    for lineno, line in enumerate(lines, 1):
+        try:
+            tokens = tokenize(line)
+            if not tokens:
+                continue
+            if tokens[0].text == 'macro':
+                if len(tokens) < 3 or tokens[1].kind != 'word':
+                    raise LayoutError("macro needs NAME and steps")
+                if tokens[1].text in macros:
+                    raise LayoutError("macro '%s' defined twice" %
+                                      tokens[1].text)
+                if len(macros) >= KEYMAP_MAX_MACROS:
+                    raise LayoutError("more than %d macros" %
+                                      KEYMAP_MAX_MACROS)
+                macros[tokens[1].text] = len(macros)
+                code += compile_macro(tokens[2:])
+                if len(code) > KEYMAP_MACRO_SIZE:
+                    raise LayoutError("macros are more than %d bytes" %
+                                      KEYMAP_MACRO_SIZE)
+            else:
+                regions.append((lineno, tokens))
+        except LayoutError as e:
+            raise LayoutError('%s:%d: %s' % (name, lineno, e))
+
+    records = bytearray()
+    count = 0
+    for lineno, tokens in regions:
+        try:
+            if any(t.kind == 'text' for t in tokens):
+                raise LayoutError("text is only for macros")
+            region = parse_line([t.text for t in tokens], macros)
+        except LayoutError as e:
+            raise LayoutError('%s:%d: %s' % (name, lineno, e))
+        count += 1
+        if count >= KEYMAP_MAX_REGIONS:
+            raise LayoutError('%s:%d: more than %d regions' %
+                              (name, lineno, KEYMAP_MAX_REGIONS - 1))
+        records += struct.pack('<BBBBBBBB', *region, 0)
+    header = b'IKM1' + struct.pack('<BBHH', KEYMAP_VERSION, count,
+                                   crc16(records + code), len(code))
+    return header + records + code
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Compile an IntelliKeys overlay layout for ikrawevent_ard.')
+    parser.add_argument('layout', help='text layout file')
+    parser.add_argument('-o', '--output', default='KEYMAP.IKM',
+                        help='keymap file, default KEYMAP.IKM')
+    args = parser.parse_args()
+    with open(args.layout) as f:
+        try:
+            keymap = compile_layout(f, args.layout)
+        except LayoutError as e:
+            sys.exit(str(e))
+    with open(args.output, 'wb') as f:
+        f.write(keymap)
+    print('%s: %d regions, %d macro bytes, %d bytes' %
+          (args.output, keymap[5], keymap[8] | (keymap[9] << 8), len(keymap)))
+
+
+if __name__ == '__main__':
+    main()
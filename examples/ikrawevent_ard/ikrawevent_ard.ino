@@ -10,6 +10,9 @@
  *
  * This program ikrawevent_ard does the same as ikrawevent_cp but is
  * written in C/C++ Arduino.
+ *
+ * Events and commands use the version 2 link protocol from the
+ * IntelliKeys_uhls library. See IKLink.h.
  */
 
 #define DEBUG_SERIAL 0
@@ -24,18 +27,52 @@ Adafruit_DotStar strip = Adafruit_DotStar(1, DATAPIN, CLOCKPIN, DOTSTAR_BRG);
 
 void IK_set_led(uint8_t num, uint8_t state);
 
-#include "intellikeys.h"
+#include <IKLink.h>
 #include "keymouse.h"
+#include "keymap.h"
+#include "macro.h"
+#include "modifier.h"
+
+void eventDecode(const uint8_t *buf, size_t len);
+IKLinkDecoder ikLinkIn(eventDecode);
+IKLinkEncoder ikLinkOut;
+// Time from the IK event arriving at ikrawevent until its frame has been
+// handled here, including the HID reports. Printed on the debug port every
+// IK_LATENCY_PERIOD ms.
+#define IK_LATENCY_PERIOD (10000) // ms
+IKLinkLatency ikLatency;
+uint32_t ikLatencyTime;
+
+// LEDs
+//
+// ikLeds is the LED state the IK should show. IK_set_led() and IK_leds()
+// only change ikLeds. IK_led_loop() sends the LEDs that differ from what
+// the IK shows in one IK_CMD_SET_LEDS so an LED turned on and off again in
+// the same pass of loop() is not sent at all. Older versions of ikrawevent
+// reject IK_CMD_SET_LEDS so fall back to one IK_CMD_LED per LED.
+uint16_t ikLeds;
+uint16_t ikLedsSent;    // LED state sent to the IK
+bool ikLedsBulk = true; // bridge has IK_CMD_SET_LEDS
+// All LEDs flash at startup. IK_led_loop() turns them off IK_LED_FLASH ms
+// after the commands queued in setup() have gone out.
+#define IK_LED_FLASH    (500)   // ms
+bool ikLedFlash;
+uint32_t ikLedFlashTime;
+bool ikConnected;
 
 /*
- * The native touch resolution is 24x24. For this example, each virtual button
- * is 2 native columns by 3 rows. This array represents the 8 rows of 12
- * virtual buttons. The elements are incremented with each native touch press
- * and decremented with each native touch release. When the count goes from 0
- * to 1, press action (see membrane_actions[]) is performed. When the count
- * goes from 1 to 0, the release action is performed.
+ * The native touch resolution is 24x24. The keymap (see keymap.h) divides it
+ * into regions. This array has one element for each region. The elements are
+ * incremented with each native touch press and decremented with each native
+ * touch release. When the count goes from 0 to 1, press action is performed.
+ * When the count goes from 1 to 0, the release action is performed.
+ *
+ * The built-in keymap is made from membrane_actions[] and
+ * membrane_actions_mouse[]. Each virtual button is 2 native columns by 3
+ * rows. These arrays represent the 8 rows of 12 virtual buttons. KEYMAP_FILE
+ * on the USB flash drive replaces the built-in keymap.
  */
-uint8_t membrane[8][12];
+uint8_t membrane[KEYMAP_MAX_REGIONS];
 
 const uint8_t membrane_actions[8][12] = {
   // Top row = 0
@@ -144,7 +181,9 @@ const uint8_t membrane_actions[8][12] = {
   0,
 };
 
+// 0 in membrane_actions_mouse means no mouse action
 enum mouse_actions {
+  MOUSE_NONE,
   MOUSE_MOVE_NW, MOUSE_MOVE_N, MOUSE_MOVE_NE,
   MOUSE_MOVE_W,  MOUSE_CLICK,  MOUSE_MOVE_E,
   MOUSE_MOVE_SW, MOUSE_MOVE_S, MOUSE_MOVE_SE,
@@ -258,13 +297,17 @@ const uint8_t membrane_actions_mouse[8][12] = {
   MOUSE_PRESS,  // mouse press/release
 };
 
-#define MOUSE_MOVE  (10)
 static bool num_lock=false;
 static bool caps_lock=false;
-static uint8_t shift_lock=0;  //0=off,1=on next key,2=lock on
-static uint8_t ctrl_lock=0; //0=off,1=on next key,2=lock on
-static uint8_t alt_lock=0;  //0=off,1=on next key,2=lock on
-static uint8_t gui_lock=0;  //0=off,1=on next key,2=lock on
+
+// The modifier keys lock so the keyboard can be used with one finger. See
+// modifier.h for the modes.
+const modifier_def_t modifier_keys[] = {
+  {HID_KEY_SHIFT_LEFT,   MODIFIER_STICKY, IK_LED_SHIFT},
+  {HID_KEY_ALT_LEFT,     MODIFIER_STICKY, IK_LED_ALT},
+  {HID_KEY_CONTROL_LEFT, MODIFIER_STICKY, IK_LED_CTRL_CMD},
+  {HID_KEY_GUI_LEFT,     MODIFIER_STICKY, IK_LED_CTRL_CMD},
+};
 
 void clear_membrane(void)
 {
@@ -272,203 +315,121 @@ void clear_membrane(void)
   if (num_lock) tinyusb_key_press(HID_KEY_NUM_LOCK);
   if (caps_lock) tinyusb_key_press(HID_KEY_CAPS_LOCK);
   num_lock = caps_lock = false;
-  shift_lock = ctrl_lock = alt_lock = gui_lock = 0;
-  //Mouse.release(MOUSE_ALL);
+  modifier_clear();
+  IK_leds(ModifierLedMask, 0);
+  macro_stop();
+  tinyusb_mouse_releaseAll();
   tinyusb_key_releaseAll();
 }
 
-void process_membrane_release(int x, int y)
+// Direction of each move region as x, y. The mouse engine in keymouse.h
+// moves the pointer while the region is held.
+const int8_t mouse_directions[][2] = {
+  {-1, -1}, {0, -1}, {1, -1},   // NW, N, NE
+  {-1,  0}, {0,  0}, {1,  0},   // W, (click), E
+  {-1,  1}, {0,  1}, {1,  1},   // SW, S, SE
+};
+
+void process_mouse(uint16_t mousecode, bool press)
 {
-  uint8_t row, col;
-  uint16_t keycode, mousecode;
-  col = x / 2;
-  row = y / 3;
-  membrane[row][col]--;
-  if (membrane[row][col] < 0) membrane[row][col] = 0;
-  if (membrane[row][col] != 0) return;
-  keycode = membrane_actions[row][col];
-  if (keycode) {
-    switch (keycode) {
-      case HID_KEY_SHIFT_LEFT:
-        /* fall through */
-      case HID_KEY_ALT_LEFT:
-        /* fall through */
-      case HID_KEY_CONTROL_LEFT:
-        /* fall through */
-      case HID_KEY_GUI_LEFT:
-        /* do nothing */
-        break;
-      default:
-        tinyusb_key_release(keycode);
-        break;
-    }
+  switch (mousecode) {
+    case MOUSE_MOVE_NW:
+    case MOUSE_MOVE_N:
+    case MOUSE_MOVE_NE:
+    case MOUSE_MOVE_W:
+    case MOUSE_MOVE_E:
+    case MOUSE_MOVE_SW:
+    case MOUSE_MOVE_S:
+    case MOUSE_MOVE_SE:
+      tinyusb_mouse_direction(mouse_directions[mousecode - MOUSE_MOVE_NW][0],
+          mouse_directions[mousecode - MOUSE_MOVE_NW][1], press);
+      break;
+    case MOUSE_CLICK:
+      if (press) tinyusb_mouse_click(MOUSE_BUTTON_LEFT, 1);
+      break;
+    case MOUSE_DOUBLE_CLICK:
+      if (press) tinyusb_mouse_click(MOUSE_BUTTON_LEFT, 2);
+      break;
+    case MOUSE_RIGHT_CLICK:
+      if (press) tinyusb_mouse_click(MOUSE_BUTTON_RIGHT, 1);
+      break;
+    case MOUSE_PRESS:
+      // Press and release the mousepad to hold the button down for a drag.
+      // Press and release again to let go.
+      if (press) tinyusb_mouse_drag();
+      break;
+    default:
+      break;
   }
-  else {
-    mousecode = membrane_actions_mouse[row][col];
-    if (mousecode) {
-      switch (mousecode) {
-        case MOUSE_MOVE_NW:
-          break;
-        case MOUSE_MOVE_N:
-          break;
-        case MOUSE_MOVE_NE:
-          break;
-        case MOUSE_MOVE_W:
-          break;
-        case MOUSE_CLICK:
-          break;
-        case MOUSE_MOVE_E:
-          break;
-        case MOUSE_MOVE_SW:
-          break;
-        case MOUSE_MOVE_S:
-          break;
-        case MOUSE_MOVE_SE:
-          break;
-        case MOUSE_DOUBLE_CLICK:
-          break;
-        case MOUSE_RIGHT_CLICK:
-          break;
-        case MOUSE_PRESS:
-          // Mouse.?
-          break;
-        default:
-          break;
-      }
+}
+
+// Press or release the modifiers of a keymap region. Modifiers held by a
+// locking modifier key stay down.
+void process_modifiers(uint8_t modifiers, bool press)
+{
+  if (!press) modifiers &= ~modifier_held();
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    if ((modifiers & (1 << bit)) == 0) continue;
+    if (press) {
+      tinyusb_key_press(HID_KEY_CONTROL_LEFT + bit);
+    }
+    else {
+      tinyusb_key_release(HID_KEY_CONTROL_LEFT + bit);
     }
   }
 }
 
-void process_locking(uint8_t &lock_status, uint8_t LED, uint16_t keycode)
+void process_membrane_release(int x, int y)
 {
-  switch (lock_status) {
-    case 0:
-      lock_status = 1;
-      IK_set_led(LED, 1);
-      break;
-    case 1:
-      lock_status = 2;
-      IK_set_led(LED, 1);
-      break;
-    case 2:
-      /* fall through */
-    default:
-      lock_status = 0;
-      tinyusb_key_release(keycode);
-      break;
+  uint8_t region = keymap_region(x, y);
+  if ((region == 0) || (membrane[region] == 0)) return;
+  if (--membrane[region] != 0) return;
+  const keymap_action_t *action = &Keymap->actions[region];
+  if (action->kind == KEYMAP_KEY) {
+    // Locking modifiers stay down until they are pressed again
+    if (modifier_find(action->code) < 0) tinyusb_key_release(action->code);
+    process_modifiers(action->modifiers, false);
+  }
+  else if (action->kind == KEYMAP_MOUSE) {
+    process_mouse(action->code, false);
   }
 }
 
 void process_membrane_press(int x, int y)
 {
-  uint8_t row, col;
-  uint16_t keycode, mousecode;
-  col = x / 2;
-  row = y / 3;
-  DBSerial.printf("col,row (%d,%d) membrane %d\n", col, row, membrane[row][col]);
-  if (membrane[row][col] == 0) {
-    keycode = membrane_actions[row][col];
-    if (keycode) {
-      tinyusb_key_press(keycode);
-      switch (keycode) {
-        case HID_KEY_CAPS_LOCK:
+  uint8_t region = keymap_region(x, y);
+  if (region == 0) return;
+  DBSerial.printf("region %d membrane %d\n", region, membrane[region]);
+  if (membrane[region] == 0) {
+    const keymap_action_t *action = &Keymap->actions[region];
+    uint8_t keycode = action->code;
+    if (action->kind == KEYMAP_KEY) {
+      process_modifiers(action->modifiers, true);
+      if (!modifier_press(keycode)) {
+        tinyusb_key_press(keycode);
+        if (keycode == HID_KEY_CAPS_LOCK) {
           caps_lock = !caps_lock;
-          break;
-        case HID_KEY_NUM_LOCK:
+        }
+        else if (keycode == HID_KEY_NUM_LOCK) {
           num_lock = !num_lock;
-          break;
-        case HID_KEY_SHIFT_LEFT:
-          process_locking(shift_lock, IK_LED_SHIFT, keycode);
-          if (shift_lock == 0) IK_set_led(IK_LED_SHIFT, 0);
-          break;
-        case HID_KEY_ALT_LEFT:
-          process_locking(alt_lock, IK_LED_ALT, keycode);
-          if (alt_lock == 0) IK_set_led(IK_LED_ALT, 0);
-          break;
-        case HID_KEY_CONTROL_LEFT:
-          process_locking(ctrl_lock, IK_LED_CTRL_CMD, keycode);
-          if (!ctrl_lock && !gui_lock) {
-            IK_set_led(IK_LED_CTRL_CMD, 0);
-          }
-          break;
-        case HID_KEY_GUI_LEFT:
-          process_locking(gui_lock, IK_LED_CTRL_CMD, keycode);
-          if (!ctrl_lock && !gui_lock) {
-            IK_set_led(IK_LED_CTRL_CMD, 0);
-          }
-          break;
-        default:
-          if (shift_lock == 1) {
-            shift_lock = 0;
-            IK_set_led(IK_LED_SHIFT, 0);
-            tinyusb_key_release(HID_KEY_SHIFT_LEFT);
-          }
-          if (alt_lock == 1) {
-            alt_lock = 0;
-            IK_set_led(IK_LED_ALT, 0);
-            tinyusb_key_release(HID_KEY_ALT_LEFT);
-          }
-          if (ctrl_lock == 1) {
-            ctrl_lock = 0;
-            if (!ctrl_lock && !gui_lock) {
-              IK_set_led(IK_LED_CTRL_CMD, 0);
-            }
-            tinyusb_key_release(HID_KEY_CONTROL_LEFT);
-          }
-          if (gui_lock == 1) {
-            gui_lock = 0;
-            if (!ctrl_lock && !gui_lock) {
-              IK_set_led(IK_LED_CTRL_CMD, 0);
-            }
-            tinyusb_key_release(HID_KEY_GUI_LEFT);
-          }
-          break;
-      }
-    }
-    else {
-      mousecode = membrane_actions_mouse[row][col];
-      if (mousecode) {
-        switch (mousecode) {
-          case MOUSE_MOVE_NW:
-            // Mouse.move(-MOUSE_MOVE, -MOUSE_MOVE, 0);
-            break;
-          case MOUSE_MOVE_N:
-            // Mouse.move(0, -MOUSE_MOVE, 0);
-            break;
-          case MOUSE_MOVE_NE:
-            // Mouse.move(MOUSE_MOVE, -MOUSE_MOVE, 0);
-            break;
-          case MOUSE_MOVE_W:
-            // Mouse.move(-MOUSE_MOVE, 0, 0);
-            break;
-          case MOUSE_CLICK:
-            // Mouse.click();
-            break;
-          case MOUSE_MOVE_E:
-            // Mouse.move(MOUSE_MOVE, 0, 0);
-            break;
-          case MOUSE_MOVE_SW:
-            // Mouse.move(MOUSE_MOVE, -MOUSE_MOVE, 0);
-            break;
-          case MOUSE_MOVE_S:
-            // Mouse.move(0, MOUSE_MOVE, 0);
-            break;
-          case MOUSE_MOVE_SE:
-            // Mouse.move(MOUSE_MOVE, MOUSE_MOVE, 0);
-            break;
-          case MOUSE_DOUBLE_CLICK:
-            break;
-          case MOUSE_RIGHT_CLICK:
-            break;
-          case MOUSE_PRESS:
-            break;
-          default:
-            break;
+        }
+        else {
+          modifier_next_key();
         }
       }
     }
+    else if (action->kind == KEYMAP_MACRO) {
+      // A macro types its own modifiers. It uses up a one shot modifier
+      // like any other key.
+      modifier_next_key();
+      macro_start(action->code);
+    }
+    else if (action->kind == KEYMAP_MOUSE) {
+      process_mouse(action->code, true);
+    }
+    IK_leds(ModifierLedMask, modifier_leds());
   }
-  membrane[row][col]++;
+  membrane[region]++;
 }
 
 void setup()
@@ -488,7 +449,12 @@ void setup()
   DBSerial.begin(115200);
   while(!DBSerial) delay(1);
 #endif
-  IKSerial.begin(115200);
+  modifier_begin(modifier_keys, sizeof(modifier_keys) / sizeof(modifier_keys[0]));
+  keymap_grid(Keymap, membrane_actions, membrane_actions_mouse);
+  if (keymap_load(keymap_spare(), KEYMAP_FILE)) Keymap = keymap_spare();
+  IKSerial.begin(ikl_baud(0));
+  ikLinkIn.onFrame(IK_frame);
+  IK_baud_start();
 
   IK_uart_setup();
   DBSerial.println("ikrawevent_ard setup done");
@@ -537,12 +503,7 @@ void IK_onoffswitch(int state)
   DBSerial.println(state);
   if (state == 0) {
     clear_membrane();
-    IK_set_led(IK_LED_SHIFT, 0);
-    IK_set_led(IK_LED_CAPS_LOCK, 0);
-    IK_set_led(IK_LED_MOUSE, 0);
-    IK_set_led(IK_LED_ALT, 0);
-    IK_set_led(IK_LED_CTRL_CMD, 0);
-    IK_set_led(IK_LED_NUM_LOCK, 0);
+    IK_leds(0xFFFF, 0);
   }
 }
 
@@ -570,47 +531,129 @@ void IK_corrdone()
 void IK_connect()
 {
   DBSerial.println("IK connect");
+  ikConnected = true;
+  // A new IK starts with all LEDs off
+  ikLedsSent = 0;
 }
 
 void IK_disconnect()
 {
   DBSerial.println("IK disconnect");
+  ikConnected = false;
 }
 
-void IK_sernum(const uint8_t *buf, size_t len)
+void IK_sernum(const uint8_t *sn)
 {
-  // The first byte is the event type so skip it
+  // The serial number is not NUL terminated
   DBSerial.print("IK serial number ");
-  DBSerial.write(buf+1, len-1);
+  DBSerial.write(sn, IK_EEPROM_SN_SIZE);
   DBSerial.println();
 }
 
-void eventDecode(const uint8_t *buf, size_t len)
+void IK_timeline(const uint8_t *params, size_t len)
+{
+  // params[0] is the number of entries. Each entry is milestone, state, and
+  // 16 bit milliseconds since the first milestone.
+  DBSerial.println("IK startup timeline");
+  for (uint8_t i = 0; (i < params[0]) && ((1 + (i * 4) + 4) <= len); i++) {
+    const uint8_t *entry = params + 1 + (i * 4);
+    DBSerial.printf("  milestone %d state %d %u ms\n", entry[0], entry[1],
+        entry[2] | (entry[3] << 8));
+  }
+}
+
+// IK_EVENT_SNAPSHOT is the whole IK state in one event. See IKLink.h and
+// the ikrawevent README for the layout.
+void IK_snapshot(const uint8_t *params)
+{
+  if (params[0] == 0) {
+    DBSerial.println("IK snapshot not ready");
+    return;
+  }
+  ikConnected = true;
+  const uint8_t *membrane = params + 1;
+  const uint8_t *p = membrane + IKL_SNAPSHOT_BITMAP;
+  DBSerial.printf("IK snapshot switches %02x sensors %02x LEDs %04x\n",
+      p[0], p[1], p[2] | (p[3] << 8));
+  if (p[4] != 255) IK_onoffswitch(p[4]);
+  IK_version(p[5], p[6]);
+  if (p[7] != 0) IK_sernum(p + 7);
+
+  // Replace the membrane state with the keys held down now
+  clear_membrane();
+  for (int y = 0; y < IK_RESOLUTION_Y; y++) {
+    for (int x = 0; x < IK_RESOLUTION_X; x++) {
+      if (membrane[(y * IKL_SNAPSHOT_ROW) + (x / 8)] & (1 << (x & 7))) {
+        process_membrane_press(x, y);
+      }
+    }
+  }
+}
+
+void IK_membrane(bool press, uint8_t x, uint8_t y)
+{
+  if (press) {
+    IK_press(x, y);
+  }
+  else {
+    IK_release(x, y);
+  }
+}
+
+// Called after all events of a frame have been handled
+void IK_frame(const ikl_header_t *header)
+{
+  if (header) ikLatency.frame(header, micros());
+}
+
+void IK_latency_loop()
+{
+  ikl_latency_t result;
+
+  if ((millis() - ikLatencyTime) < IK_LATENCY_PERIOD) return;
+  ikLatencyTime = millis();
+  if (!ikLatency.report(&result)) return;
+  DBSerial.printf("link frames %lu lost %lu latency us p50 %lu p90 %lu p99 %lu max %lu\n",
+      result.frames, result.lost, result.p50, result.p90, result.p99,
+      result.max);
+}
+
+// record is {type, params...}
+void eventDecode(const uint8_t *record, size_t len)
 {
-  switch (buf[0]) {
+  ikl_event_t ev;
+
+  if (!ikl_parse_event(record, len, &ev)) {
+    DBSerial.print("IK eventDecode Bad event ");
+    DBSerial.print(record[0]);
+    DBSerial.print(" len ");
+    DBSerial.println(len);
+    return;
+  }
+  switch (ev.type) {
     case IK_EVENT_MEMBRANE_PRESS:
-      IK_press(buf[1], buf[2]);
+      IK_press(ev.a, ev.b);
       break;
     case IK_EVENT_MEMBRANE_RELEASE:
-      IK_release(buf[1], buf[2]);
+      IK_release(ev.a, ev.b);
       break;
     case IK_EVENT_SWITCH:
-      IK_switch(buf[1], buf[2]);
+      IK_switch(ev.a, ev.b);
       break;
     case IK_EVENT_SENSOR_CHANGE:
-      IK_sensor(buf[1], buf[2]);
+      IK_sensor(ev.a, ev.b);
       break;
     case IK_EVENT_VERSION:
-      IK_version(buf[1], buf[2]);
+      IK_version(ev.a, ev.b);
       break;
     case IK_EVENT_ONOFFSWITCH:
-      IK_onoffswitch(buf[1]);
+      IK_onoffswitch(ev.a);
       break;
     case IK_EVENT_CORRECT_MEMBRANE:
-      IK_corrmemb(buf[1], buf[2]);
+      IK_corrmemb(ev.a, ev.b);
       break;
     case IK_EVENT_CORRECT_SWITCH:
-      IK_corrswitch(buf[1], buf[2]);
+      IK_corrswitch(ev.a, ev.b);
       break;
     case IK_EVENT_CORRECT_DONE:
       IK_corrdone();
@@ -622,133 +665,483 @@ void eventDecode(const uint8_t *buf, size_t len)
       IK_disconnect();
       break;
     case IK_EVENT_SERNUM:
-      IK_sernum(buf, len);
+      IK_sernum(ev.params);
+      break;
+    case IK_EVENT_TIMELINE:
+      IK_timeline(ev.params, ev.len);
+      break;
+    case IK_EVENT_BAUD_TEST:
+      IK_baud_echo(ev.params, ev.len);
+      break;
+    case IK_EVENT_MEMBRANE_PACKED:
+      ikl_unpack_membrane(ev.params, ev.len, IK_membrane);
+      break;
+    case IK_EVENT_SNAPSHOT:
+      IK_snapshot(ev.params);
+      break;
+    case IK_EVENT_ACK:
+      IK_ack(ev.a, ev.b);
       break;
     default:
-      DBSerial.print("IK eventDecode Unknown event ");
-      DBSerial.println(buf[0]);
       break;
   }
 }
 
 // IK commands
+//
+// Commands are queued then sent by IK_command_loop() with a sequence number
+// after the command type. The bridge returns {IK_EVENT_ACK, seq, status}
+// after it runs each command. Up to IK_CMD_WINDOW commands may wait for
+// their ACK so there is no need to sleep after each command. A command
+// without an ACK after IK_CMD_TIMEOUT ms is given up, for example when the
+// frame was lost or the IK is not connected. Commands are not resent.
+//
+// A frame of IK_CMD_WINDOW commands is at most 7 * 7 + 6 + 5 = 60 bytes on
+// the wire: 7 bytes for each record {len, type, seq, 4 params}, 6 for the
+// credit record IK_credit_loop() adds, and 5 for the flags, CRC, COBS code
+// and delimiter. ikrawevent decodes up to IKL_RX_BUDGET bytes per loop() so
+// it takes the whole frame in one pass.
+#define IK_CMD_QUEUE    (32)  // Must be a power of 2
+#define IK_CMD_WINDOW   (7)
+#define IK_CMD_TIMEOUT  (100) // ms
+#define IK_CMD_PARAMS   (4)   // IK_CMD_SET_LEDS is the longest
+#if ((IK_CMD_WINDOW * (3 + IK_CMD_PARAMS)) + 6 + 5) > IKL_RX_BUDGET
+#error "A frame of IK_CMD_WINDOW commands is longer than IKL_RX_BUDGET"
+#endif
+
+typedef struct {
+  uint8_t command;
+  uint8_t len;
+  uint8_t params[IK_CMD_PARAMS];
+} ik_cmd_t;
+
+ik_cmd_t cmdQueue[IK_CMD_QUEUE];
+uint8_t cmdHead, cmdTail;
+
+// Commands sent but not yet ACKed, oldest first
+struct {
+  uint8_t seq;
+  uint8_t command;
+  uint32_t sent;
+} cmdInFlight[IK_CMD_WINDOW];
+uint8_t cmdInFlightCount;
+uint8_t cmdSeq;
+
+// Statistics
+uint32_t cmdDropped;    // queue full
+uint32_t cmdTimeouts;   // no ACK
+uint32_t cmdRejected;   // ACK with error status
+
+bool IK_command(uint8_t command, const uint8_t *params, uint8_t len)
+{
+  if ((len > IK_CMD_PARAMS) || ((uint8_t)(cmdHead - cmdTail) >= IK_CMD_QUEUE)) {
+    cmdDropped++;
+    return false;
+  }
+  ik_cmd_t *cmd = &cmdQueue[cmdHead & (IK_CMD_QUEUE-1)];
+  cmd->command = command;
+  cmd->len = len;
+  if (len) memcpy(cmd->params, params, len);
+  cmdHead++;
+  return true;
+}
+
+// UART rate negotiation. Both sides start at 115200. First send the test
+// pattern at 115200. If it comes back, ikrawevent is at 115200 too, so
+// there is no need to wait for its watchdog after a reset of this board.
+// Ask ikrawevent for the fastest rate, check it with the test pattern, and
+// try the next slower rate on error. After an error wait until ikrawevent
+// has gone back to 115200.
+// If no frame arrives for IK_BAUD_PROBE ms, send the test pattern again to
+// check that the link still works. Queued commands wait until the rate is
+// chosen.
+#define IK_BAUD_MAX       (IKL_BAUD_COUNT - 1)
+#define IK_BAUD_TIMEOUT   (200)   // ms
+#define IK_BAUD_SETTLE    (10)    // ms
+#define IK_BAUD_WAIT      (1200)  // ms, longer than IK_BAUD_WATCHDOG in ikrawevent
+#define IK_BAUD_PROBE     (2000)  // ms
+
+enum {
+  IK_BAUD_DONE,
+  IK_BAUD_START,    // IK_CMD_BAUD_TEST sent at 115200 after reset
+  IK_BAUD_REQUEST,  // IK_CMD_BAUD sent, waiting for its ACK
+  IK_BAUD_SWITCH,   // new rate set, let ikrawevent switch too
+  IK_BAUD_TEST,     // IK_CMD_BAUD_TEST sent, waiting for IK_EVENT_BAUD_TEST
+  IK_BAUD_FAILED    // back at 115200, waiting for ikrawevent to do the same
+};
+uint8_t ikBaudState = IK_BAUD_START;
+uint8_t ikBaudIndex;              // rate in use
+uint8_t ikBaudTry = IK_BAUD_MAX + 1;  // rate being tried
+uint8_t ikBaudSeq;
+uint32_t ikBaudTime;
+uint32_t ikLastFrame;             // millis() of the last valid frame
+uint32_t ikLastFrames;
+
+// Remove the in-flight commands up to and including seq. The bridge runs
+// commands in order and merges ACKs when the link is busy so an ACK also
+// covers older commands.
+void IK_ack(uint8_t seq, uint8_t status)
+{
+  if ((ikBaudState == IK_BAUD_REQUEST) && (seq == ikBaudSeq)) {
+    IK_baud_ack(status);
+    return;
+  }
+  for (uint8_t i = 0; i < cmdInFlightCount; i++) {
+    if (cmdInFlight[i].seq == seq) {
+      uint8_t command = cmdInFlight[i].command;
+      cmdInFlightCount -= i + 1;
+      memmove(&cmdInFlight[0], &cmdInFlight[i + 1],
+          cmdInFlightCount * sizeof(cmdInFlight[0]));
+      if (status != 0) {
+        cmdRejected++;
+        DBSerial.printf("IK command seq %d rejected\n", seq);
+        // Older versions of ikrawevent do not have the snapshot
+        if (command == IK_CMD_GET_SNAPSHOT) IK_get_state();
+        if (command == IK_CMD_SET_LEDS) IK_leds_rejected();
+      }
+      return;
+    }
+  }
+}
+
+// Flow control for events. Tell ikrawevent how many bytes have been read
+// from the UART so it never sends more than the UART RX buffer holds. Send
+// a credit record when half the buffer has been read and every
+// IKL_CREDIT_PERIOD ms so a lost credit record does not stop the events.
+// The window is the UART RX buffer of the core, SERIAL_BUFFER_SIZE in
+// RingBuffer.h on SAMD. It must hold one frame of the longest kind. A core
+// without SERIAL_BUFFER_SIZE must have an RX buffer of at least
+// IKL_MIN_WINDOW bytes.
+#ifdef SERIAL_BUFFER_SIZE
+#if SERIAL_BUFFER_SIZE < IKL_MIN_WINDOW
+#error "The UART RX buffer is smaller than IKL_MIN_WINDOW"
+#endif
+#define IK_RX_WINDOW      (SERIAL_BUFFER_SIZE)
+#else
+#define IK_RX_WINDOW      (IKL_MIN_WINDOW)
+#endif
+uint16_t ikRxCount;
+uint16_t ikRxGranted;
+uint32_t ikCreditTime;
+
+void IK_credit_loop(uint32_t now)
+{
+  if (((uint16_t)(ikRxCount - ikRxGranted) < (IK_RX_WINDOW / 2)) &&
+      ((now - ikCreditTime) < IKL_CREDIT_PERIOD)) return;
+  uint8_t params[] = {(uint8_t)ikRxCount, (uint8_t)(ikRxCount >> 8),
+    (uint8_t)IK_RX_WINDOW, (uint8_t)(IK_RX_WINDOW >> 8)};
+  if (ikLinkOut.add(IK_CMD_CREDIT, params, sizeof(params))) {
+    ikRxGranted = ikRxCount;
+    ikCreditTime = now;
+  }
+}
+
+// Send as many queued commands as the window allows in one frame
+void IK_command_loop()
+{
+  uint8_t frame[IKL_MAX_ENCODED];
+  uint32_t now = millis();
+
+  IK_credit_loop(now);
+
+  while ((cmdInFlightCount > 0) &&
+      ((now - cmdInFlight[0].sent) > IK_CMD_TIMEOUT)) {
+    cmdTimeouts++;
+    cmdInFlightCount--;
+    memmove(&cmdInFlight[0], &cmdInFlight[1],
+        cmdInFlightCount * sizeof(cmdInFlight[0]));
+  }
+
+  while ((ikBaudState == IK_BAUD_DONE) && (cmdHead != cmdTail) &&
+      (cmdInFlightCount < IK_CMD_WINDOW)) {
+    ik_cmd_t *cmd = &cmdQueue[cmdTail & (IK_CMD_QUEUE-1)];
+    uint8_t params[1 + IK_CMD_PARAMS];
+    params[0] = cmdSeq;
+    memcpy(params + 1, cmd->params, cmd->len);
+    if (!ikLinkOut.add(cmd->command, params, 1 + cmd->len)) break;
+    cmdInFlight[cmdInFlightCount].seq = cmdSeq++;
+    cmdInFlight[cmdInFlightCount].command = cmd->command;
+    cmdInFlight[cmdInFlightCount].sent = now;
+    cmdInFlightCount++;
+    cmdTail++;
+  }
+  if (!ikLinkOut.empty()) {
+    IKSerial.write(frame, ikLinkOut.encode(frame));
+  }
+}
+
+// Send a link command right away, outside the command queue
+void IK_baud_send(uint8_t command, const uint8_t *params, uint8_t len)
+{
+  uint8_t frame[IKL_MAX_ENCODED];
+  uint8_t record[1 + IKL_BAUD_TEST_LEN];
+
+  ikBaudSeq = cmdSeq++;
+  record[0] = ikBaudSeq;
+  memcpy(record + 1, params, len);
+  ikLinkOut.add(command, record, 1 + len);
+  IKSerial.write(frame, ikLinkOut.encode(frame));
+  ikBaudTime = millis();
+}
+
+void IK_set_baud(uint8_t index)
+{
+  IKSerial.flush();
+  IKSerial.end();
+  IKSerial.begin(ikl_baud(index));
+  ikBaudIndex = index;
+}
+
+void IK_baud_request()
+{
+  if (ikBaudTry == 0) {
+    // Stay at the start rate
+    ikBaudState = IK_BAUD_DONE;
+    return;
+  }
+  IK_baud_send(IK_CMD_BAUD, &ikBaudTry, 1);
+  ikBaudState = IK_BAUD_REQUEST;
+}
+
+void IK_baud_start()
+{
+  IK_baud_send(IK_CMD_BAUD_TEST, ikl_baud_test(), IKL_BAUD_TEST_LEN);
+  ikBaudState = IK_BAUD_START;
+}
+
+void IK_baud_fail()
+{
+  DBSerial.printf("IK baud %lu failed\n",
+      ikl_baud((ikBaudState == IK_BAUD_START) ? 0 : ikBaudTry));
+  if (ikBaudIndex != 0) IK_set_baud(0);
+  ikBaudState = IK_BAUD_FAILED;
+  ikBaudTime = millis();
+}
+
+void IK_baud_ack(uint8_t status)
+{
+  if (status != 0) {
+    // ikrawevent does not support this rate so it did not change
+    ikBaudTry--;
+    IK_baud_request();
+    return;
+  }
+  IK_set_baud(ikBaudTry);
+  ikBaudState = IK_BAUD_SWITCH;
+  ikBaudTime = millis();
+}
+
+void IK_baud_echo(const uint8_t *pattern, size_t len)
+{
+  if ((ikBaudState != IK_BAUD_TEST) && (ikBaudState != IK_BAUD_START)) return;
+  if ((len == IKL_BAUD_TEST_LEN) &&
+      (memcmp(pattern, ikl_baud_test(), IKL_BAUD_TEST_LEN) == 0)) {
+    if (ikBaudState == IK_BAUD_START) {
+      ikBaudTry--;
+      IK_baud_request();
+      return;
+    }
+    DBSerial.printf("IK baud %lu\n", ikl_baud(ikBaudIndex));
+    ikBaudState = IK_BAUD_DONE;
+  }
+  else {
+    IK_baud_fail();
+  }
+}
+
+void IK_baud_loop()
+{
+  uint32_t now = millis();
+
+  if (ikLinkIn.frames != ikLastFrames) {
+    ikLastFrames = ikLinkIn.frames;
+    ikLastFrame = now;
+  }
+  switch (ikBaudState) {
+    case IK_BAUD_DONE:
+      if ((ikBaudIndex != 0) && ((now - ikLastFrame) > IK_BAUD_PROBE) &&
+          ((now - ikBaudTime) > IK_BAUD_PROBE)) {
+        // On error try the same rate again first
+        ikBaudTry = ikBaudIndex + 1;
+        IK_baud_send(IK_CMD_BAUD_TEST, ikl_baud_test(), IKL_BAUD_TEST_LEN);
+        ikBaudState = IK_BAUD_TEST;
+      }
+      break;
+    case IK_BAUD_START:
+    case IK_BAUD_REQUEST:
+    case IK_BAUD_TEST:
+      if ((now - ikBaudTime) > IK_BAUD_TIMEOUT) IK_baud_fail();
+      break;
+    case IK_BAUD_SWITCH:
+      if ((now - ikBaudTime) > IK_BAUD_SETTLE) {
+        IK_baud_send(IK_CMD_BAUD_TEST, ikl_baud_test(), IKL_BAUD_TEST_LEN);
+        ikBaudState = IK_BAUD_TEST;
+      }
+      break;
+    case IK_BAUD_FAILED:
+      if ((now - ikBaudTime) > IK_BAUD_WAIT) {
+        ikBaudTry--;
+        IK_baud_request();
+      }
+      break;
+  }
+}
+
 void IK_get_version()
 {
-  uint8_t outbuf[] = {0xFF, 0x01, IK_CMD_GET_VERSION};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  IK_command(IK_CMD_GET_VERSION, NULL, 0);
+}
+
+// Set the LEDs in mask to state. See ikLeds.
+void IK_leds(uint16_t mask, uint16_t state)
+{
+  ikLeds = (ikLeds & ~mask) | (state & mask);
 }
 
 void IK_set_led(uint8_t num, uint8_t state)
 {
-  uint8_t outbuf[] = {0xFF, 0x03, IK_CMD_LED, num, state};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  if (num < 16) IK_leds(1 << num, (state) ? (1 << num) : 0);
+}
+
+// Send now without changing ikLeds, for example to flash the LEDs. LEDs
+// whose command did not fit in the command queue stay in ikLedsSent as
+// they were so IK_led_loop() tries them again.
+void IK_send_leds(uint16_t mask, uint16_t state)
+{
+  if (ikLedsBulk) {
+    uint8_t params[] = {(uint8_t)mask, (uint8_t)(mask >> 8),
+      (uint8_t)state, (uint8_t)(state >> 8)};
+    if (!IK_command(IK_CMD_SET_LEDS, params, sizeof(params))) return;
+  }
+  else {
+    for (uint8_t i = 0; i < 16; i++) {
+      if ((mask & (1 << i)) == 0) continue;
+      uint8_t params[] = {i, (uint8_t)((state >> i) & 1)};
+      if (!IK_command(IK_CMD_LED, params, sizeof(params))) {
+        mask &= (1 << i) - 1;
+        break;
+      }
+    }
+  }
+  ikLedsSent = (ikLedsSent & ~mask) | (state & mask);
+}
+
+void IK_led_loop()
+{
+  if (ikLedFlash) {
+    if (cmdHead != cmdTail) {
+      ikLedFlashTime = millis();
+      return;
+    }
+    if ((millis() - ikLedFlashTime) < IK_LED_FLASH) return;
+    ikLedFlash = false;
+  }
+  uint16_t changed = ikLeds ^ ikLedsSent;
+  if (changed) IK_send_leds(changed, ikLeds);
+}
+
+void IK_leds_rejected()
+{
+  // The IK is there so the bridge does not know the command
+  if (ikConnected && ikLedsBulk) {
+    DBSerial.println("IK_CMD_SET_LEDS not supported");
+    ikLedsBulk = false;
+  }
+  // Send all of them again. Without an IK the bridge rejects every LED
+  // command so wait for IK_connect(), which sends them all anyway.
+  if (ikConnected) ikLedsSent = ~ikLeds;
 }
 
 void IK_set_tone(uint8_t frequency, uint8_t duration, uint8_t volume)
 {
-  uint8_t outbuf[] = {0xFF, 0x03, IK_CMD_TONE, frequency, duration, volume};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  uint8_t params[] = {frequency, duration, volume};
+  IK_command(IK_CMD_TONE, params, sizeof(params));
 }
 
 void IK_get_onoff()
 {
-  uint8_t outbuf[] = {0xFF, 0x01, IK_CMD_ONOFFSWITCH};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  IK_command(IK_CMD_ONOFFSWITCH, NULL, 0);
 }
 
 void IK_get_correct()
 {
-  uint8_t outbuf[] = {0xFF, 0x01, IK_CMD_CORRECT};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  IK_command(IK_CMD_CORRECT, NULL, 0);
 }
 
 void IK_reset()
 {
-  uint8_t outbuf[] = {0xFF, 0x01, IK_CMD_RESET_DEVICE};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  IK_command(IK_CMD_RESET_DEVICE, NULL, 0);
 }
 
 void IK_get_all_sensors()
 {
-  uint8_t outbuf[] = {0xFF, 0x01, IK_CMD_ALL_SENSORS};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  IK_command(IK_CMD_ALL_SENSORS, NULL, 0);
 }
 
 void IK_get_sn()
 {
-  uint8_t outbuf[] = {0xFF, 0x01, IK_CMD_GET_SN};
-  IKSerial.write(outbuf, sizeof(outbuf));
-  delay(2);
+  IK_command(IK_CMD_GET_SN, NULL, 0);
 }
 
-void IK_uart_setup()
+void IK_get_snapshot()
 {
-  int i;
-
-  // All LEDs on
-  for (i = 0; i < 12; i++) IK_set_led(i, 1);
+  IK_command(IK_CMD_GET_SNAPSHOT, NULL, 0);
+}
 
-  IK_set_tone(0,0,0);
+// The state commands used before IK_CMD_GET_SNAPSHOT
+void IK_get_state()
+{
   IK_get_onoff();
   IK_get_all_sensors();
   IK_get_version();
   IK_get_sn();
-  IK_uart_loop();
   IK_get_correct();
-  IK_uart_loop();
+}
 
-  // All LEDs off
-  for (i = 0; i < 12; i++) IK_set_led(i, 0);
+void IK_set_options(uint8_t options)
+{
+  IK_command(IK_CMD_OPTIONS, &options, 1);
 }
 
+void IK_uart_setup()
+{
+  // Ask for packed membrane events and frame headers. Older versions of
+  // ikrawevent reject this and send frames without them, which also works.
+  IK_set_options(IKL_OPT_PACKED_MEMBRANE | IKL_OPT_FRAME_HEADER);
+
+  // All LEDs on. IK_led_loop() turns them off later.
+  IK_send_leds(0x0FFF, 0x0FFF);
+  ikLedFlash = true;
+
+  IK_set_tone(0,0,0);
+  // One round trip for the whole IK state. Falls back to IK_get_state()
+  // when the bridge rejects it.
+  IK_get_snapshot();
+}
+
+// ikLinkIn calls eventDecode for each event in each valid frame
 void IK_uart_loop()
 {
-  static uint8_t eventState=0;
-  static size_t  eventLen=0;
-  static uint8_t eventBuf[64];
-  static uint8_t eventIndex;
   uint8_t rawBuf[64];
 
   int bytesAvail;
   while ((bytesAvail = IKSerial.available()) > 0) {
     size_t bytesIn = IKSerial.readBytes(rawBuf, min(bytesAvail, sizeof(rawBuf)));
-    for (size_t i = 0; i < bytesIn; i++) {
-      switch(eventState) {
-        case 0:
-          if (rawBuf[i] == 0xFF) {
-            eventState = 1;
-          }
-          break;
-        case 1:
-          eventLen = rawBuf[i];
-          eventState = 2;
-          eventIndex = 0;
-          break;
-        case 2:
-          eventBuf[eventIndex] = rawBuf[i];
-          eventIndex++;
-          if (eventIndex >= eventLen) {
-            eventState = 0;
-            eventDecode(eventBuf, eventLen);
-          }
-          break;
-        default:
-          DBSerial.println("Invalid eventState");
-          break;
-      }
-    }
+    ikRxCount += bytesIn;
+    ikLinkIn.put(rawBuf, bytesIn);
   }
 }
 
 void loop()
 {
   IK_uart_loop();
+  macro_loop();
+  tinyusb_key_loop();
+  tinyusb_mouse_loop();
+  IK_baud_loop();
+  IK_led_loop();
+  IK_command_loop();
+  IK_latency_loop();
   tinyusb_loop();
+  if (keymap_loop()) clear_membrane();
 }
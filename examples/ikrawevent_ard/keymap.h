@@ -0,0 +1,314 @@
+// Overlay keymaps
+//
+// An overlay is a list of rectangular regions on the 24x24 membrane. Each
+// region sends a HID key code, optionally with modifiers held down, a
+// mouse action, or a macro. KEYMAP_FILE on the USB flash drive replaces
+// the built-in overlay. ikmapc.py compiles a text layout into the file.
+//
+// The regions are drawn into a cell table with one entry per membrane
+// switch so finding the region for a press is one table lookup.
+//
+// File format, all numbers little endian
+//
+//  offset  size
+//  0       4       "IKM1"
+//  4       1       version, KEYMAP_VERSION
+//  5       1       number of regions, 0..KEYMAP_MAX_REGIONS-1
+//  6       2       CRC-16/CCITT-FALSE of the region records and macros
+//  8       2       macro bytes, m, 0..KEYMAP_MACRO_SIZE
+//  10      8*n     region records
+//  10+8*n  m       macros
+//
+// Region record
+//
+//  0   x       left membrane column, 0..23
+//  1   y       top membrane row, 0..23
+//  2   width   columns, 1..24-x
+//  3   height  rows, 1..24-y
+//  4   kind    KEYMAP_KEY, KEYMAP_MOUSE, or KEYMAP_MACRO
+//  5   code    HID key code, mouse action, or macro number
+//  6   modifiers   HID modifier bits pressed with the key
+//  7   reserved, 0
+//
+// A later region covers an earlier one where they overlap.
+//
+// Macros are byte code, one macro after another. Macro numbers count from
+// 0 in the order they are in the file. Each macro ends with MACRO_END.
+//
+//  MACRO_END
+//  MACRO_PRESS key         press and hold a key
+//  MACRO_RELEASE key       release a key
+//  MACRO_TAP key modifiers press and release a key with exactly the
+//                          modifier bits held
+//  MACRO_DELAY n           wait n * 10 ms
+//  '\t', '\n', ' '..'~'    type the character on a US keyboard
+
+#ifndef __KEYMAP_H__
+#define __KEYMAP_H__
+
+#include <IKLink.h>
+
+#define KEYMAP_FILE         "KEYMAP.IKM"
+#define KEYMAP_VERSION      (2)
+#define KEYMAP_MAX_REGIONS  (128)   // including region 0, no region
+#define KEYMAP_MAX_MACROS   (32)
+#define KEYMAP_MACRO_SIZE   (512)   // bytes of macro byte code
+#define KEYMAP_HEADER_SIZE  (10)
+#define KEYMAP_REGION_SIZE  (8)
+// The host writes a file in several pieces. Wait until the flash has been
+// quiet this long before loading it.
+#define KEYMAP_SETTLE       (500)   // ms
+
+enum keymap_kind {
+    KEYMAP_NONE,
+    KEYMAP_KEY,
+    KEYMAP_MOUSE,
+    KEYMAP_MACRO
+};
+
+enum macro_op {
+    MACRO_END,
+    MACRO_PRESS,
+    MACRO_RELEASE,
+    MACRO_TAP,
+    MACRO_DELAY
+};
+
+// Bytes in the instruction starting with op, 0 if op is not valid
+inline uint8_t macro_op_size(uint8_t op)
+{
+    switch (op) {
+        case MACRO_END:
+        case '\t':
+        case '\n':
+            return 1;
+        case MACRO_PRESS:
+        case MACRO_RELEASE:
+        case MACRO_DELAY:
+            return 2;
+        case MACRO_TAP:
+            return 3;
+        default:
+            return ((op >= ' ') && (op <= '~')) ? 1 : 0;
+    }
+}
+
+typedef struct {
+    uint8_t kind;
+    uint8_t code;       // HID key code, mouse action, or macro number
+    uint8_t modifiers;  // HID modifier bits, KEYMAP_KEY only
+} keymap_action_t;
+
+typedef struct {
+    uint8_t regions;    // used entries in actions, including region 0
+    uint8_t cells[IK_RESOLUTION_Y][IK_RESOLUTION_X];   // region of each switch
+    keymap_action_t actions[KEYMAP_MAX_REGIONS];
+    uint8_t macroCount;
+    uint16_t macroStart[KEYMAP_MAX_MACROS];    // offset of each macro in macros
+    uint8_t macros[KEYMAP_MACRO_SIZE];
+    bool loaded;        // from KEYMAP_FILE, not built in
+    uint16_t crc;       // file header CRC
+} keymap_t;
+
+// Keymap is the keymap in use. A new keymap is loaded into the other one
+// then Keymap is switched over so a bad or half written file never
+// replaces a working keymap.
+keymap_t Keymaps[2];
+keymap_t *Keymap = &Keymaps[0];
+bool Keymap_changed;            // flash written since the last load
+uint32_t Keymap_changedTime;    // millis() of the last flash write
+
+inline keymap_t *keymap_spare()
+{
+    return (Keymap == &Keymaps[0]) ? &Keymaps[1] : &Keymaps[0];
+}
+
+// Region of membrane switch x, y. 0 is no region.
+inline uint8_t keymap_region(int x, int y)
+{
+    if ((x < 0) || (x >= IK_RESOLUTION_X) || (y < 0) || (y >= IK_RESOLUTION_Y)) {
+        return 0;
+    }
+    return Keymap->cells[y][x];
+}
+
+// Add a region. Returns false if the keymap is full or the region is
+// not on the membrane.
+bool keymap_add(keymap_t *map, uint8_t x, uint8_t y, uint8_t width,
+        uint8_t height, const keymap_action_t *action)
+{
+    if ((map->regions >= KEYMAP_MAX_REGIONS) ||
+            (width == 0) || (height == 0) ||
+            (x >= IK_RESOLUTION_X) || (width > (IK_RESOLUTION_X - x)) ||
+            (y >= IK_RESOLUTION_Y) || (height > (IK_RESOLUTION_Y - y))) {
+        return false;
+    }
+    uint8_t region = map->regions++;
+    map->actions[region] = *action;
+    for (uint8_t row = y; row < (y + height); row++) {
+        memset(&map->cells[row][x], region, width);
+    }
+    return true;
+}
+
+void keymap_clear(keymap_t *map)
+{
+    memset(map, 0, sizeof(*map));
+    map->regions = 1;
+}
+
+// Build the keymap from tables of 8 rows of 12 virtual buttons, each 2
+// columns by 3 rows of the membrane. A button with the same action as the
+// button to its left extends that region so a wide key such as the space
+// bar is pressed once no matter how many of its buttons are touched.
+void keymap_grid(keymap_t *map, const uint8_t keys[8][12],
+        const uint8_t mouse[8][12])
+{
+    keymap_clear(map);
+    for (uint8_t row = 0; row < 8; row++) {
+        for (uint8_t col = 0; col < 12; col++) {
+            keymap_action_t action = {KEYMAP_NONE, 0, 0};
+            if (keys[row][col]) {
+                action.kind = KEYMAP_KEY;
+                action.code = keys[row][col];
+            }
+            else if (mouse[row][col]) {
+                action.kind = KEYMAP_MOUSE;
+                action.code = mouse[row][col];
+            }
+            else {
+                continue;
+            }
+            uint8_t x = col * 2, y = row * 3;
+            uint8_t left = (x > 0) ? map->cells[y][x-1] : 0;
+            if (left && (memcmp(&map->actions[left], &action, sizeof(action)) == 0)) {
+                for (uint8_t i = 0; i < 3; i++) {
+                    memset(&map->cells[y+i][x], left, 2);
+                }
+            }
+            else {
+                keymap_add(map, x, y, 2, 3, &action);
+            }
+        }
+    }
+}
+
+// Find the start of each macro. Returns false if the byte code runs past
+// the end or has a bad instruction.
+bool keymap_index_macros(keymap_t *map, uint16_t len)
+{
+    uint16_t pc = 0;
+    map->macroCount = 0;
+    while (pc < len) {
+        if (map->macroCount >= KEYMAP_MAX_MACROS) return false;
+        map->macroStart[map->macroCount++] = pc;
+        uint8_t op;
+        do {
+            if (pc >= len) return false;
+            op = map->macros[pc];
+            uint8_t size = macro_op_size(op);
+            if ((size == 0) || (size > (len - pc))) return false;
+            pc += size;
+        } while (op != MACRO_END);
+    }
+    return true;
+}
+
+// Load a keymap file into map. map is left in an unknown state if the
+// file is missing or not valid.
+bool keymap_load(keymap_t *map, const char *path)
+{
+    FatFile mapFile;
+    uint8_t header[KEYMAP_HEADER_SIZE];
+    uint8_t buf[KEYMAP_REGION_SIZE];
+
+    if (!mapFile.open(path, O_RDONLY)) return false;
+    bool ok = false;
+    do {
+        if ((mapFile.read(header, KEYMAP_HEADER_SIZE) != KEYMAP_HEADER_SIZE) ||
+                (memcmp(header, "IKM1", 4) != 0) ||
+                (header[4] != KEYMAP_VERSION) ||
+                (header[5] >= KEYMAP_MAX_REGIONS)) {
+            break;
+        }
+        uint8_t count = header[5];
+        uint16_t crc = header[6] | (header[7] << 8);
+        uint16_t macroLen = header[8] | (header[9] << 8);
+        if ((macroLen > KEYMAP_MACRO_SIZE) ||
+                (mapFile.fileSize() != (KEYMAP_HEADER_SIZE +
+                    ((uint32_t)count * KEYMAP_REGION_SIZE) + macroLen))) {
+            break;
+        }
+        keymap_clear(map);
+        uint16_t fileCrc = 0xFFFF;
+        uint8_t i;
+        for (i = 0; i < count; i++) {
+            if (mapFile.read(buf, KEYMAP_REGION_SIZE) != KEYMAP_REGION_SIZE) break;
+            for (uint8_t j = 0; j < KEYMAP_REGION_SIZE; j++) {
+                fileCrc = ikl_crc16_update(fileCrc, buf[j]);
+            }
+            keymap_action_t action = {buf[4], buf[5], buf[6]};
+            if ((action.kind < KEYMAP_KEY) || (action.kind > KEYMAP_MACRO)) break;
+            if (!keymap_add(map, buf[0], buf[1], buf[2], buf[3], &action)) break;
+        }
+        if ((i != count) ||
+                (mapFile.read(map->macros, macroLen) != macroLen)) {
+            break;
+        }
+        for (uint16_t j = 0; j < macroLen; j++) {
+            fileCrc = ikl_crc16_update(fileCrc, map->macros[j]);
+        }
+        if ((fileCrc != crc) || !keymap_index_macros(map, macroLen)) break;
+        // Every macro region must have a macro
+        for (i = 1; i < map->regions; i++) {
+            if ((map->actions[i].kind == KEYMAP_MACRO) &&
+                    (map->actions[i].code >= map->macroCount)) {
+                break;
+            }
+        }
+        ok = (i == map->regions);
+        map->loaded = ok;
+        map->crc = crc;
+    } while (0);
+    mapFile.close();
+    return ok;
+}
+
+// Call from the MSC flush callback after each write to the flash
+void keymap_flash_written()
+{
+    Keymap_changed = true;
+    Keymap_changedTime = millis();
+}
+
+// Same file as the keymap in use
+bool keymap_same(const keymap_t *a, const keymap_t *b)
+{
+    return a->loaded && b->loaded && (a->crc == b->crc) &&
+        (a->regions == b->regions) && (a->macroCount == b->macroCount);
+}
+
+// Call once per pass of loop(). Returns true after Keymap has been
+// replaced. The caller must release everything pressed with the old
+// keymap because the region numbers no longer mean the same thing. Flash
+// writes that leave KEYMAP_FILE as it was, for example the host updating
+// the directory, do not replace Keymap.
+bool keymap_loop()
+{
+    if (!Keymap_changed || ((millis() - Keymap_changedTime) < KEYMAP_SETTLE)) {
+        return false;
+    }
+    Keymap_changed = false;
+    keymap_t *spare = keymap_spare();
+    if (!keymap_load(spare, KEYMAP_FILE)) {
+        DBSerial.println("keymap " KEYMAP_FILE " not loaded");
+        return false;
+    }
+    if (keymap_same(spare, Keymap)) return false;
+    DBSerial.printf("keymap " KEYMAP_FILE " %d regions %d macros\n",
+            spare->regions - 1, spare->macroCount);
+    Keymap = spare;
+    return true;
+}
+
+#endif /* __KEYMAP_H__ */
@@ -16,6 +16,7 @@
 #include "SdFat.h"
 #include "Adafruit_SPIFlash.h"
 #include <Adafruit_TinyUSB.h>
+#include "keymap.h"
 
 #if defined(__SAMD51__) || defined(NRF52840_XXAA)
 Adafruit_FlashTransport_QSPI flashTransport(PIN_QSPI_SCK, PIN_QSPI_CS, PIN_QSPI_IO0, PIN_QSPI_IO1, PIN_QSPI_IO2, PIN_QSPI_IO3);
@@ -45,14 +46,49 @@ bool Flash_changed;
 enum
 {
     RID_KEYBOARD = 1,
-    RID_MOUSE
+    RID_MOUSE,
+    RID_NKRO
 };
 
+// N-key rollover. A large overlay can hold down more than the 6 keys of
+// the standard keyboard report. The NKRO report has one bit for each of
+// the first NKRO_KEYS key codes so any number of keys can be down. Set
+// KEY_NKRO to 0 to start with the 6 key report. tinyusb_key_nkro()
+// switches at run time. The 6 key report stays in the descriptor for hosts
+// that do not handle the NKRO report.
+#ifndef KEY_NKRO
+#define KEY_NKRO    1
+#endif
+#define NKRO_KEYS   (128)
+#define NKRO_BYTES  (NKRO_KEYS / 8)
+
+// Modifier bits then one bit per key code 0..NKRO_KEYS-1
+#define TUD_HID_REPORT_DESC_NKRO(...) \
+    HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+    HID_USAGE      ( HID_USAGE_DESKTOP_KEYBOARD ), \
+    HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+        __VA_ARGS__ \
+        HID_USAGE_PAGE   ( HID_USAGE_PAGE_KEYBOARD ), \
+        HID_USAGE_MIN    ( 224 ), \
+        HID_USAGE_MAX    ( 231 ), \
+        HID_LOGICAL_MIN  ( 0 ), \
+        HID_LOGICAL_MAX  ( 1 ), \
+        HID_REPORT_COUNT ( 8 ), \
+        HID_REPORT_SIZE  ( 1 ), \
+        HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+        HID_USAGE_MIN    ( 0 ), \
+        HID_USAGE_MAX    ( NKRO_KEYS - 1 ), \
+        HID_REPORT_COUNT ( NKRO_KEYS ), \
+        HID_REPORT_SIZE  ( 1 ), \
+        HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+    HID_COLLECTION_END
+
 // HID report descriptor using TinyUSB's template
 uint8_t const desc_hid_report[] =
 {
     TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(RID_KEYBOARD), ),
-    TUD_HID_REPORT_DESC_MOUSE   ( HID_REPORT_ID(RID_MOUSE), )
+    TUD_HID_REPORT_DESC_MOUSE   ( HID_REPORT_ID(RID_MOUSE), ),
+    TUD_HID_REPORT_DESC_NKRO    ( HID_REPORT_ID(RID_NKRO), )
 };
 
 // USB HID object
@@ -91,6 +127,7 @@ void msc_flush_cb (void)
     fatfs.cacheClear();
 
     Flash_changed = true;
+    keymap_flash_written();
 
     digitalWrite(LED_BUILTIN, LOW);
 }
@@ -199,19 +236,61 @@ void tinyusb_loop()
     }
 }
 
-void tinyusb_mouse_move(int8_t x, int8_t y)
+// Keyboard state after all key changes so far. Each key code has one bit
+// so a press or release is O(1) no matter how many keys are down. Key
+// codes NKRO_KEYS and up are ignored. No keyboard key uses them.
+uint8_t KeyBitmap[NKRO_BYTES];
+uint8_t KeyModifiers;
+bool KeyNKRO = KEY_NKRO;
+
+// Key changes are merged into one report per pass of loop() and sent by
+// tinyusb_key_loop(). A release after a press that has not been queued
+// yet queues the state with the press first so the host sees every key,
+// for example Q with the sticky SHIFT before the SHIFT is released.
+// The queue holds the reports until the host polls for them, one per
+// poll interval, instead of dropping them when usb_hid is busy.
+#define KEY_REPORT_QUEUE    (8)     // Must be a power of 2
+
+// modifiers and keys are the NKRO report
+typedef struct {
+    uint8_t modifiers;
+    uint8_t keys[NKRO_BYTES];
+    bool nkro;          // send as the NKRO or the 6 key report
+} key_report_t;
+
+key_report_t KeyReports[KEY_REPORT_QUEUE];
+uint8_t KeyReportHead;
+uint8_t KeyReportTail;
+bool KeyChanged;        // state differs from the last queued report
+bool KeyPressPending;   // a key was pressed since the last queued report
+uint32_t KeyReportsMerged;  // reports replaced because the queue was full
+
+// Queue the current state. If the queue is full, replace the newest
+// report so the host still gets the latest state.
+void tinyusb_key_queue()
 {
-    if (usb_hid.ready()) {
-        int8_t const delta = 5;
-        usb_hid.mouseMove(RID_MOUSE, delta, delta); // right + down
-
-        // delay a bit before attempt to send keyboard report
-        delay(1);
+    if ((uint8_t)(KeyReportHead - KeyReportTail) >= KEY_REPORT_QUEUE) {
+        KeyReportHead--;
+        KeyReportsMerged++;
     }
+    key_report_t *report = &KeyReports[KeyReportHead++ & (KEY_REPORT_QUEUE-1)];
+    report->modifiers = KeyModifiers;
+    memcpy(report->keys, KeyBitmap, sizeof(report->keys));
+    report->nkro = KeyNKRO;
+    KeyChanged = false;
+    KeyPressPending = false;
 }
 
-uint8_t KeysDown[6];
-uint8_t KeyModifiers;
+void tinyusb_key_wakeup()
+{
+    // Remote wakeup
+    if ( USBDevice.suspended() )
+    {
+        // Wake up host if we are in suspend mode
+        // and REMOTE_WAKEUP feature is enabled by host
+        USBDevice.remoteWakeup();
+    }
+}
 
 inline bool isModifierKey(uint8_t hid_keycode)
 {
@@ -226,71 +305,264 @@ inline uint8_t maskModifierKey(uint8_t hid_keycode)
 
 void tinyusb_key_press(uint8_t hid_keycode)
 {
-    // Remote wakeup
-    if ( USBDevice.suspended() )
-    {
-        // Wake up host if we are in suspend mode
-        // and REMOTE_WAKEUP feature is enabled by host
-        USBDevice.remoteWakeup();
-    }
+    tinyusb_key_wakeup();
     if (isModifierKey(hid_keycode)) {
         KeyModifiers |= maskModifierKey(hid_keycode);
     }
-    if ( usb_hid.ready() ) {
-        // Add keycode to KeysDown
-        for (int i = 0; i < sizeof(KeysDown); i++) {
-            if ((KeysDown[i] == 0) || (KeysDown[i] == hid_keycode)) {
-                KeysDown[i] = hid_keycode;
-                break;
-            }
-        }
-        usb_hid.keyboardReport(RID_KEYBOARD, KeyModifiers, KeysDown);
+    else if (hid_keycode < NKRO_KEYS) {
+        KeyBitmap[hid_keycode >> 3] |= 1 << (hid_keycode & 7);
     }
+    KeyChanged = true;
+    KeyPressPending = true;
 }
 
 void tinyusb_key_release(uint8_t hid_keycode)
 {
-    // Remote wakeup
-    if ( USBDevice.suspended() )
-    {
-        // Wake up host if we are in suspend mode
-        // and REMOTE_WAKEUP feature is enabled by host
-        USBDevice.remoteWakeup();
-    }
+    tinyusb_key_wakeup();
+    if (KeyPressPending) tinyusb_key_queue();
     if (isModifierKey(hid_keycode)) {
         KeyModifiers &= ~(maskModifierKey(hid_keycode));
     }
-    if ( usb_hid.ready() )
-    {
-        // Remove keycode from KeysDown but also pack all non-zero
-        // values to left side.
-        int dest = 0;
-        for (int i = 0; i < sizeof(KeysDown); i++) {
-            if (KeysDown[i] == hid_keycode) {
-                KeysDown[i] = 0;
-            }
-            else if (KeysDown[i] != 0) {
-                KeysDown[dest++] = KeysDown[i];
+    else if (hid_keycode < NKRO_KEYS) {
+        KeyBitmap[hid_keycode >> 3] &= ~(1 << (hid_keycode & 7));
+    }
+    KeyChanged = true;
+}
+
+void tinyusb_key_releaseAll()
+{
+    tinyusb_key_wakeup();
+    if (KeyPressPending) tinyusb_key_queue();
+    KeyModifiers = 0;
+    memset(KeyBitmap, 0, sizeof(KeyBitmap));
+    KeyChanged = true;
+}
+
+// Type one key with exactly modifiers held then put the modifiers back.
+// This queues two reports and may queue the current state first so check
+// tinyusb_key_space() before calling.
+void tinyusb_key_tap(uint8_t hid_keycode, uint8_t modifiers)
+{
+    tinyusb_key_wakeup();
+    if (KeyChanged) tinyusb_key_queue();
+    uint8_t saved = KeyModifiers;
+    KeyModifiers = modifiers;
+    tinyusb_key_press(hid_keycode);
+    tinyusb_key_queue();
+    KeyModifiers = saved;
+    tinyusb_key_release(hid_keycode);
+}
+
+// Number of reports that can be queued without replacing one. A change
+// not queued yet takes one.
+uint8_t tinyusb_key_space()
+{
+    uint8_t used = (uint8_t)(KeyReportHead - KeyReportTail) + (KeyChanged ? 1 : 0);
+    return (used >= KEY_REPORT_QUEUE) ? 0 : KEY_REPORT_QUEUE - used;
+}
+
+// Send the 6 key report for the keys in report. If more than 6 keys are
+// down, send the ErrorRollOver code in every slot as the HID spec asks.
+bool tinyusb_key_send6(const key_report_t *report)
+{
+    uint8_t keys[6] = {0};
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < NKRO_BYTES; i++) {
+        if (report->keys[i] == 0) continue;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            if ((report->keys[i] & (1 << bit)) == 0) continue;
+            if (count == sizeof(keys)) {
+                memset(keys, 0x01, sizeof(keys));
+                return usb_hid.keyboardReport(RID_KEYBOARD, report->modifiers, keys);
             }
+            keys[count++] = (i * 8) + bit;
         }
-        usb_hid.keyboardReport(RID_KEYBOARD, KeyModifiers, KeysDown);
     }
+    return usb_hid.keyboardReport(RID_KEYBOARD, report->modifiers, keys);
 }
 
-void tinyusb_key_releaseAll()
+// Call once per pass of loop() after the IK events have been handled
+void tinyusb_key_loop()
 {
-    // Remote wakeup
-    if ( USBDevice.suspended() )
-    {
-        // Wake up host if we are in suspend mode
-        // and REMOTE_WAKEUP feature is enabled by host
-        USBDevice.remoteWakeup();
+    if (KeyChanged) tinyusb_key_queue();
+    if ((KeyReportHead != KeyReportTail) && usb_hid.ready()) {
+        key_report_t *report = &KeyReports[KeyReportTail & (KEY_REPORT_QUEUE-1)];
+        bool sent = (report->nkro) ?
+            usb_hid.sendReport(RID_NKRO, report, 1 + NKRO_BYTES) :
+            tinyusb_key_send6(report);
+        if (sent) KeyReportTail++;
     }
-    KeyModifiers = 0;
-    memset(KeysDown, 0, sizeof(KeysDown));
-    if ( usb_hid.ready() )
-    {
-        usb_hid.keyboardReport(RID_KEYBOARD, KeyModifiers, KeysDown);
+}
+
+// Switch between the NKRO and the 6 key report. All keys are released in
+// the old report first so no key is left down in the report that is no
+// longer used.
+void tinyusb_key_nkro(bool nkro)
+{
+    if (nkro == KeyNKRO) return;
+    tinyusb_key_releaseAll();
+    tinyusb_key_queue();
+    KeyNKRO = nkro;
+}
+
+// Mouse keys. While a direction region is held the pointer moves at a
+// speed that grows with the hold time along the selected curve. Regions
+// held at the same time add up, for example N and E move NE. Diagonal
+// moves are scaled by 1/sqrt(2) so the pointer speed is the same in all
+// directions. tinyusb_mouse_loop() sends a movement report each time the
+// host has taken the last one so the pointer moves at the USB poll rate
+// no matter how often the IK sends events.
+#define MOUSE_CURVE_POINTS  (4)
+#define MOUSE_MAX_DT        (50000) // usec, limit the jump after a stall
+
+// The speed is interpolated between the points. The speed after the last
+// point stays at the last speed.
+typedef struct {
+    uint16_t msec;      // time the region has been held
+    uint16_t speed;     // pixels per second
+} mouse_curve_point_t;
+
+enum {
+    MOUSE_CURVE_SLOW,
+    MOUSE_CURVE_MEDIUM,
+    MOUSE_CURVE_FAST,
+    MOUSE_CURVE_COUNT
+};
+
+const mouse_curve_point_t MouseCurves[MOUSE_CURVE_COUNT][MOUSE_CURVE_POINTS] = {
+    { {0,  50}, {300, 100}, {1000,  300}, {2000,  500} },
+    { {0, 100}, {300, 200}, {1000,  600}, {2000, 1000} },
+    { {0, 200}, {300, 400}, {1000, 1200}, {2000, 2000} },
+};
+
+uint8_t MouseCurve = MOUSE_CURVE_MEDIUM;
+
+// Number of regions held that point in each direction
+uint8_t MouseUp, MouseDown, MouseLeft, MouseRight;
+uint32_t MouseMoveStart;    // micros() when the pointer started moving
+uint32_t MouseMoveLast;     // micros() of the last movement
+int32_t MouseFracX, MouseFracY; // thousandths of a pixel not sent yet
+uint8_t MouseButtons;       // buttons held down, for example a drag
+
+// Clicks are button states sent one per report so the host sees every
+// press and release even when they happen in the same pass of loop().
+#define MOUSE_BUTTON_QUEUE  (8)     // Must be a power of 2
+uint8_t MouseButtonQueue[MOUSE_BUTTON_QUEUE];
+uint8_t MouseButtonHead;
+uint8_t MouseButtonTail;
+
+void tinyusb_mouse_curve(uint8_t curve)
+{
+    if (curve < MOUSE_CURVE_COUNT) MouseCurve = curve;
+}
+
+// Pixels per second after the region has been held for msec
+uint16_t tinyusb_mouse_speed(uint32_t msec)
+{
+    const mouse_curve_point_t *curve = MouseCurves[MouseCurve];
+    for (uint8_t i = 1; i < MOUSE_CURVE_POINTS; i++) {
+        if (msec < curve[i].msec) {
+            uint32_t span = curve[i].msec - curve[i-1].msec;
+            int32_t rise = (int32_t)curve[i].speed - curve[i-1].speed;
+            return curve[i-1].speed +
+                (rise * (int32_t)(msec - curve[i-1].msec)) / (int32_t)span;
+        }
+    }
+    return curve[MOUSE_CURVE_POINTS-1].speed;
+}
+
+inline bool tinyusb_mouse_moving()
+{
+    return (MouseUp != MouseDown) || (MouseLeft != MouseRight);
+}
+
+// A release after tinyusb_mouse_releaseAll() has nothing to count down
+inline void tinyusb_mouse_count(uint8_t &count, bool press)
+{
+    if (press) count++;
+    else if (count) count--;
+}
+
+// dx and dy are -1, 0, or 1. press is true when the region is pressed and
+// false when it is released.
+void tinyusb_mouse_direction(int8_t dx, int8_t dy, bool press)
+{
+    bool wasMoving = tinyusb_mouse_moving();
+    if (dx < 0) tinyusb_mouse_count(MouseLeft, press);
+    if (dx > 0) tinyusb_mouse_count(MouseRight, press);
+    if (dy < 0) tinyusb_mouse_count(MouseUp, press);
+    if (dy > 0) tinyusb_mouse_count(MouseDown, press);
+    if (!wasMoving && tinyusb_mouse_moving()) {
+        tinyusb_key_wakeup();
+        MouseMoveStart = MouseMoveLast = micros();
+        MouseFracX = MouseFracY = 0;
+    }
+}
+
+void tinyusb_mouse_queue(uint8_t buttons)
+{
+    if ((uint8_t)(MouseButtonHead - MouseButtonTail) >= MOUSE_BUTTON_QUEUE) return;
+    MouseButtonQueue[MouseButtonHead++ & (MOUSE_BUTTON_QUEUE-1)] = buttons;
+}
+
+// Press and release button count times. Buttons held down, for example
+// for a drag, stay down.
+void tinyusb_mouse_click(uint8_t button, uint8_t count)
+{
+    tinyusb_key_wakeup();
+    while (count--) {
+        tinyusb_mouse_queue(MouseButtons | button);
+        tinyusb_mouse_queue(MouseButtons);
+    }
+}
+
+// Press the left button for a drag. The next call releases it.
+void tinyusb_mouse_drag()
+{
+    tinyusb_key_wakeup();
+    MouseButtons ^= MOUSE_BUTTON_LEFT;
+    tinyusb_mouse_queue(MouseButtons);
+}
+
+void tinyusb_mouse_releaseAll()
+{
+    MouseUp = MouseDown = MouseLeft = MouseRight = 0;
+    if (MouseButtons) {
+        MouseButtons = 0;
+        tinyusb_mouse_queue(MouseButtons);
+    }
+}
+
+// Call once per pass of loop() after tinyusb_key_loop(). Keyboard reports
+// go first because both share usb_hid.
+void tinyusb_mouse_loop()
+{
+    if (!usb_hid.ready()) return;
+    if (MouseButtonHead != MouseButtonTail) {
+        uint8_t buttons = MouseButtonQueue[MouseButtonTail & (MOUSE_BUTTON_QUEUE-1)];
+        if (usb_hid.mouseReport(RID_MOUSE, buttons, 0, 0, 0, 0)) MouseButtonTail++;
+        return;
+    }
+    if (!tinyusb_mouse_moving()) return;
+
+    uint32_t now = micros();
+    uint32_t dt = min(now - MouseMoveLast, (uint32_t)MOUSE_MAX_DT);
+    MouseMoveLast = now;
+    int8_t dirX = (MouseRight > MouseLeft) ? 1 : (MouseRight < MouseLeft) ? -1 : 0;
+    int8_t dirY = (MouseDown > MouseUp) ? 1 : (MouseDown < MouseUp) ? -1 : 0;
+    int32_t speed = tinyusb_mouse_speed((now - MouseMoveStart) / 1000);
+    if (dirX && dirY) speed = (speed * 181) / 256;
+    // thousandths of a pixel, at most 2000 * 50000 / 1000
+    int32_t step = (speed * (int32_t)dt) / 1000;
+    MouseFracX += dirX * step;
+    MouseFracY += dirY * step;
+
+    int32_t x = constrain(MouseFracX / 1000, -127, 127);
+    int32_t y = constrain(MouseFracY / 1000, -127, 127);
+    if ((x == 0) && (y == 0)) return;
+    if (usb_hid.mouseReport(RID_MOUSE, MouseButtons, x, y, 0, 0)) {
+        MouseFracX -= x * 1000;
+        MouseFracY -= y * 1000;
     }
 }
 
@@ -0,0 +1,120 @@
+// Macros
+//
+// A macro region types a word or a key sequence. See keymap.h for the
+// byte code. macro_loop() runs the byte code a little at a time from
+// loop() so IK events are still handled while a long macro is typed. It
+// only runs an instruction when the keyboard report queue has room for
+// its reports so the macro is typed as fast as the host polls without
+// losing keys.
+//
+// Characters and MACRO_TAP set the modifiers for that one key then put
+// them back so a locked SHIFT or CTRL does not change what the macro
+// types. MACRO_PRESS and MACRO_RELEASE change the keyboard state like a
+// membrane key.
+
+#ifndef __MACRO_H__
+#define __MACRO_H__
+
+#include "keymouse.h"
+#include "keymap.h"
+
+// Macros pressed while one is running wait their turn
+#define MACRO_QUEUE         (4)     // Must be a power of 2
+// Most reports queued by one instruction, see tinyusb_key_tap()
+#define MACRO_REPORTS       (3)
+
+// HID key code of ' ' to '~' on a US keyboard. 0x80 is SHIFT.
+#define MACRO_SHIFT         (0x80)
+const uint8_t MacroAscii[] = {
+    0x2c, 0x9e, 0xb4, 0xa0, 0xa1, 0xa2, 0xa4, 0x34,  //   ! " # $ % & '
+    0xa6, 0xa7, 0xa5, 0xae, 0x36, 0x2d, 0x37, 0x38,  // ( ) * + , - . /
+    0x27, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24,  // 0 1 2 3 4 5 6 7
+    0x25, 0x26, 0xb3, 0x33, 0xb6, 0x2e, 0xb7, 0xb8,  // 8 9 : ; < = > ?
+    0x9f, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,  // @ A B C D E F G
+    0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92,  // H I J K L M N O
+    0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,  // P Q R S T U V W
+    0x9b, 0x9c, 0x9d, 0x2f, 0x31, 0x30, 0xa3, 0xad,  // X Y Z [ \ ] ^ _
+    0x35, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,  // ` a b c d e f g
+    0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,  // h i j k l m n o
+    0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a,  // p q r s t u v w
+    0x1b, 0x1c, 0x1d, 0xaf, 0xb1, 0xb0, 0xb5,        // x y z { | } ~
+};
+
+const uint8_t *MacroPC;         // next instruction, NULL if idle
+uint32_t MacroDelayStart;       // millis() when MACRO_DELAY started
+uint32_t MacroDelay;            // ms left to wait
+uint8_t MacroQueue[MACRO_QUEUE];
+uint8_t MacroHead;
+uint8_t MacroTail;
+
+// Queue macro number macro of the current keymap
+void macro_start(uint8_t macro)
+{
+    if (macro >= Keymap->macroCount) return;
+    if ((uint8_t)(MacroHead - MacroTail) >= MACRO_QUEUE) return;
+    MacroQueue[MacroHead++ & (MACRO_QUEUE-1)] = macro;
+}
+
+// Stop the running macro and forget the waiting ones. Keys pressed by the
+// macro stay down so call tinyusb_key_releaseAll() too.
+void macro_stop()
+{
+    MacroPC = NULL;
+    MacroDelay = 0;
+    MacroTail = MacroHead;
+}
+
+inline bool macro_running()
+{
+    return (MacroPC != NULL) || (MacroHead != MacroTail);
+}
+
+// Call once per pass of loop() before tinyusb_key_loop()
+void macro_loop()
+{
+    while (tinyusb_key_space() >= MACRO_REPORTS) {
+        if (MacroDelay) {
+            if ((millis() - MacroDelayStart) < MacroDelay) return;
+            MacroDelay = 0;
+        }
+        if (MacroPC == NULL) {
+            if (MacroHead == MacroTail) return;
+            uint8_t macro = MacroQueue[MacroTail++ & (MACRO_QUEUE-1)];
+            MacroPC = &Keymap->macros[Keymap->macroStart[macro]];
+        }
+        uint8_t op = *MacroPC;
+        switch (op) {
+            case MACRO_END:
+                MacroPC = NULL;
+                break;
+            case MACRO_PRESS:
+                tinyusb_key_press(MacroPC[1]);
+                break;
+            case MACRO_RELEASE:
+                tinyusb_key_release(MacroPC[1]);
+                break;
+            case MACRO_TAP:
+                tinyusb_key_tap(MacroPC[1], MacroPC[2]);
+                break;
+            case MACRO_DELAY:
+                MacroDelay = MacroPC[1] * 10;
+                MacroDelayStart = millis();
+                break;
+            case '\t':
+                tinyusb_key_tap(HID_KEY_TAB, 0);
+                break;
+            case '\n':
+                tinyusb_key_tap(HID_KEY_RETURN, 0);
+                break;
+            default: {
+                uint8_t key = MacroAscii[op - ' '];
+                tinyusb_key_tap(key & ~MACRO_SHIFT,
+                        (key & MACRO_SHIFT) ? maskModifierKey(HID_KEY_SHIFT_LEFT) : 0);
+                break;
+            }
+        }
+        if (MacroPC) MacroPC += macro_op_size(op);
+    }
+}
+
+#endif /* __MACRO_H__ */
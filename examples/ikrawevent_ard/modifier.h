@@ -0,0 +1,138 @@
+// Locking modifier keys
+//
+// A table lists the modifier keys that lock instead of being held down,
+// how each one locks, and the IK LED that shows it. One finger typing
+// needs this because SHIFT cannot be held while another key is pressed.
+//
+//  MODIFIER_STICKY     press once for the next key, twice to lock, a third
+//                      time to turn off
+//  MODIFIER_ONE_SHOT   press once for the next key, again to turn off
+//  MODIFIER_TOGGLE     press once to lock, again to turn off
+//
+// Modifiers that share an LED, for example CTRL and GUI on the CTRL/CMD
+// LED, turn it on if any of them is on. modifier_leds() works out all of
+// the LEDs at once after each event so each LED is only changed once.
+
+#ifndef __MODIFIER_H__
+#define __MODIFIER_H__
+
+#include "keymouse.h"
+
+#define MODIFIER_MAX        (8)
+#define MODIFIER_NO_LED     (0xFF)
+
+enum modifier_mode {
+    MODIFIER_STICKY,
+    MODIFIER_ONE_SHOT,
+    MODIFIER_TOGGLE
+};
+
+enum modifier_state {
+    MODIFIER_OFF,
+    MODIFIER_NEXT_KEY,  // on for the next key only
+    MODIFIER_LOCKED
+};
+
+typedef struct {
+    uint8_t keycode;    // HID_KEY_CONTROL_LEFT..HID_KEY_GUI_RIGHT
+    uint8_t mode;       // modifier_mode
+    uint8_t led;        // IK LED number or MODIFIER_NO_LED
+} modifier_def_t;
+
+const modifier_def_t *ModifierDefs;
+uint8_t ModifierCount;
+uint8_t ModifierStates[MODIFIER_MAX];
+uint16_t ModifierLedMask;   // LEDs owned by the modifiers
+
+void modifier_begin(const modifier_def_t *defs, uint8_t count)
+{
+    ModifierDefs = defs;
+    ModifierCount = min(count, (uint8_t)MODIFIER_MAX);
+    memset(ModifierStates, MODIFIER_OFF, sizeof(ModifierStates));
+    ModifierLedMask = 0;
+    for (uint8_t i = 0; i < ModifierCount; i++) {
+        if (defs[i].led < 16) ModifierLedMask |= 1 << defs[i].led;
+    }
+}
+
+// Table entry for keycode, -1 if it is an ordinary key
+int modifier_find(uint8_t keycode)
+{
+    for (uint8_t i = 0; i < ModifierCount; i++) {
+        if (ModifierDefs[i].keycode == keycode) return i;
+    }
+    return -1;
+}
+
+// Press of a locking modifier key. Returns false if keycode is not one.
+bool modifier_press(uint8_t keycode)
+{
+    int i = modifier_find(keycode);
+    if (i < 0) return false;
+    uint8_t state = ModifierStates[i];
+    switch (ModifierDefs[i].mode) {
+        case MODIFIER_STICKY:
+            state = (state == MODIFIER_LOCKED) ? MODIFIER_OFF : state + 1;
+            break;
+        case MODIFIER_ONE_SHOT:
+            state = (state == MODIFIER_OFF) ? MODIFIER_NEXT_KEY : MODIFIER_OFF;
+            break;
+        case MODIFIER_TOGGLE:
+        default:
+            state = (state == MODIFIER_OFF) ? MODIFIER_LOCKED : MODIFIER_OFF;
+            break;
+    }
+    ModifierStates[i] = state;
+    if (state == MODIFIER_OFF) {
+        tinyusb_key_release(keycode);
+    }
+    else {
+        tinyusb_key_press(keycode);
+    }
+    return true;
+}
+
+// Call after an ordinary key has been pressed. Modifiers on for the next
+// key only turn off.
+void modifier_next_key()
+{
+    for (uint8_t i = 0; i < ModifierCount; i++) {
+        if (ModifierStates[i] == MODIFIER_NEXT_KEY) {
+            ModifierStates[i] = MODIFIER_OFF;
+            tinyusb_key_release(ModifierDefs[i].keycode);
+        }
+    }
+}
+
+// HID modifier bits held by locking modifier keys
+uint8_t modifier_held()
+{
+    uint8_t modifiers = 0;
+    for (uint8_t i = 0; i < ModifierCount; i++) {
+        if (ModifierStates[i] != MODIFIER_OFF) {
+            modifiers |= maskModifierKey(ModifierDefs[i].keycode);
+        }
+    }
+    return modifiers;
+}
+
+// Turn all modifiers off without releasing the keys. The caller releases
+// all keys.
+void modifier_clear()
+{
+    memset(ModifierStates, MODIFIER_OFF, sizeof(ModifierStates));
+}
+
+// LEDs that should be on, only the bits in ModifierLedMask mean anything
+uint16_t modifier_leds()
+{
+    uint16_t leds = 0;
+    for (uint8_t i = 0; i < ModifierCount; i++) {
+        if ((ModifierStates[i] != MODIFIER_OFF) && (ModifierDefs[i].led < 16)) {
+            leds |= 1 << ModifierDefs[i].led;
+        }
+    }
+    return leds;
+}
+
+#endif /* __MODIFIER_H__ */
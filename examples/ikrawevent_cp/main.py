@@ -6,19 +6,77 @@
 # Tested on Trinket M0 running
 #   Adafruit CircuitPython 4.1.0-rc.1 on 2019-07-19; Adafruit Trinket M0 with samd21e18
 
-import array
 import board
 import busio
 import time
 
 # Try timeout 0 for non-blocking read so other things can be done
 # in the main loop.
-uart = busio.UART(board.TX, board.RX, baudrate=115200, timeout=0)
+uart = busio.UART(board.TX, board.RX, baudrate=115200, timeout=0,
+        receiver_buffer_size=256)
+
+# Link protocol version 2. See IKLink.h in the IntelliKeys_uhls library.
+# Each frame is COBS(flags, record, ..., crc_lo, crc_hi) followed by 0x00.
+# Each record is len, type, params. len counts type and params.
+IKL_MAX_FRAME = 160
+frameBuf = bytearray()
+
+def crc16(buf):
+    # CRC-16/CCITT-FALSE
+    crc = 0xFFFF
+    for b in buf:
+        x = ((crc >> 8) ^ b) & 0xFF
+        x ^= x >> 4
+        crc = ((crc << 8) ^ (x << 12) ^ (x << 5) ^ x) & 0xFFFF
+    return crc
+
+def cobs_encode(buf):
+    out = bytearray([1])
+    code = 0
+    for b in buf:
+        if b == 0:
+            code = len(out)
+            out.append(1)
+        else:
+            out.append(b)
+            out[code] += 1
+            if out[code] == 0xFF:
+                code = len(out)
+                out.append(1)
+    return out
+
+def cobs_decode(buf):
+    out = bytearray()
+    i = 0
+    while i < len(buf):
+        code = buf[i]
+        if code == 0 or i + code > len(buf):
+            return None
+        out.extend(buf[i+1:i+code])
+        i += code
+        if code != 0xFF and i < len(buf):
+            out.append(0)
+    return out
+
+def frameDecode(buf):
+    frame = cobs_decode(buf)
+    if frame is None or len(frame) < 3:
+        return
+    crc = frame[-2] | (frame[-1] << 8)
+    frame = frame[:-2]
+    if crc16(frame) != crc or frame[0] != 0:
+        print("Bad frame")
+        return
+    i = 1
+    while i < len(frame):
+        n = frame[i]
+        if n == 0 or i + 1 + n > len(frame):
+            print("Bad record")
+            return
+        eventDecode(frame[i+1:i+1+n], n)
+        i += 1 + n
 
 # IntelliKeys Events
-eventState=0
-eventLen=0
-eventBuf=array.array('B', [0]*64)
 
 IK_EVENT_ACK                = 51
 IK_EVENT_MEMBRANE_PRESS     = 52
@@ -42,6 +100,7 @@ IK_EVENT_ALL_SENSORS        = 69
 IK_EVENT_CONNECT            = 81
 IK_EVENT_DISCONNECT         = 82
 IK_EVENT_SERNUM             = 83
+IK_EVENT_TIMELINE           = 84
 
 def IK_press(x, y):
     print("press", x, y)
@@ -83,6 +142,17 @@ def IK_sernum(buf, len):
         sernum = sernum + chr(buf[i])
     print("IK serial number", sernum)
 
+def IK_timeline(buf, len):
+    # buf[1] is the number of entries. Each entry is milestone, state, and
+    # 16 bit milliseconds since the first milestone.
+    print("IK startup timeline")
+    for i in range(0, buf[1]):
+        entry = 2 + (i * 4)
+        if entry + 4 > len:
+            break
+        print("  milestone", buf[entry], "state", buf[entry+1],
+                buf[entry+2] | (buf[entry+3] << 8), "ms")
+
 def eventDecode(buf, len):
     if (buf[0] == IK_EVENT_MEMBRANE_PRESS):
         IK_press(buf[1], buf[2])
@@ -108,6 +178,10 @@ def eventDecode(buf, len):
         IK_disconnect()
     elif (buf[0] == IK_EVENT_SERNUM):
         IK_sernum(buf, len)
+    elif (buf[0] == IK_EVENT_TIMELINE):
+        IK_timeline(buf, len)
+    elif (buf[0] == IK_EVENT_ACK):
+        pass
     else:
         print("Unknown event")
 
@@ -132,30 +206,66 @@ IK_CMD_START_OUTPUT         = 16
 IK_CMD_STOP_OUTPUT          = 17
 IK_CMD_ALL_SENSORS          = 18
 IK_CMD_GET_SN               = 40
+IK_CMD_CREDIT               = 41
+
+# Send one record as one frame
+def IK_send(record):
+    frame = bytearray([0, len(record)]) + bytearray(record)
+    crc = crc16(frame)
+    frame.append(crc & 0xFF)
+    frame.append(crc >> 8)
+    uart.write(cobs_encode(frame) + bytearray([0]))
+
+# The sequence number after the command type comes back in IK_EVENT_ACK when
+# the bridge has run the command.
+cmdSeq = 0
+def IK_command(record):
+    global cmdSeq
+    IK_send([record[0], cmdSeq] + record[1:])
+    cmdSeq = (cmdSeq + 1) & 0xFF
+
+# Flow control. Tell the bridge how many bytes have been read so it never
+# sends more than the UART receive buffer holds. The buffer must hold the
+# longest frame, a snapshot.
+RX_WINDOW = 256
+CREDIT_PERIOD = 0.1
+rxCount = 0
+rxGranted = 0
+creditTime = 0
+def IK_credit():
+    global rxGranted, creditTime
+    now = time.monotonic()
+    if ((rxCount - rxGranted) & 0xFFFF) < (RX_WINDOW // 2) and \
+            (now - creditTime) < CREDIT_PERIOD:
+        return
+    IK_send([IK_CMD_CREDIT, rxCount & 0xFF, (rxCount >> 8) & 0xFF,
+        RX_WINDOW & 0xFF, RX_WINDOW >> 8])
+    rxGranted = rxCount
+    creditTime = now
 
 def IK_get_version():
-    uart.write(array.array('B', [0xFF, 0x01, IK_CMD_GET_VERSION]))
+    IK_command([IK_CMD_GET_VERSION])
 
 def IK_set_led(num, state):
-    uart.write(array.array('B', [0xFF, 0x03, IK_CMD_LED, num, state]))
+    IK_command([IK_CMD_LED, num, state])
 
 def IK_set_tone(frequency, duration, volume):
-    uart.write(array.array('B', [0xFF, 0x03, IK_CMD_TONE, frequency, duration, volume]))
+    IK_command([IK_CMD_TONE, frequency, duration, volume])
 
 def IK_get_onoff():
-    uart.write(array.array('B', [0xFF, 0x01, IK_CMD_ONOFFSWITCH]))
+    IK_command([IK_CMD_ONOFFSWITCH])
 
 def IK_get_correct():
-    uart.write(array.array('B', [0xFF, 0x01, IK_CMD_CORRECT]))
+    IK_command([IK_CMD_CORRECT])
 
 def IK_reset():
-    uart.write(array.array('B', [0xFF, 0x01, IK_CMD_RESET_DEVICE]))
+    IK_command([IK_CMD_RESET_DEVICE])
 
 def IK_get_all_sensors():
-    uart.write(array.array('B', [0xFF, 0x01, IK_CMD_ALL_SENSORS]))
+    IK_command([IK_CMD_ALL_SENSORS])
 
 def IK_get_sn():
-    uart.write(array.array('B', [0xFF, 0x01, IK_CMD_GET_SN]))
+    IK_command([IK_CMD_GET_SN])
 
 # All LEDs on
 for i in range(0,12):
@@ -179,25 +289,19 @@ while True:
     data = uart.read(64)    # read up to 64 bytes
     #print(data)  # this is a bytearray type
 
-    # An IK binary event starts with 0xFF.
-    # The next byte is the event length
-    # The next byte is the event type
-    # The 0 or more following bytes are based on the event type
+    # Frames end with 0x00. 0x00 does not appear anywhere else so
+    # after an error the next frame starts after the next 0x00.
     if data is not None:
+        rxCount = (rxCount + len(data)) & 0xFFFF
         for i in range(0,len(data)):
             # Show the byte as 2 hex digits
             #print("%02x " % (data[i]), end='')
-            if eventState == 0:
-                if data[i] == 0xFF:
-                    eventState = 1
-            elif eventState == 1:
-                eventLen = data[i]
-                eventState = 2
-                eventIndex = 0
-            elif eventState == 2:
-                eventBuf[eventIndex] = data[i]
-                eventIndex += 1
-                if eventIndex >= eventLen:
-                    eventState = 0
-                    eventDecode(eventBuf, eventLen)
-
+            if data[i] == 0:
+                # Drop frames that are too long
+                if len(frameBuf) <= IKL_MAX_FRAME + 1:
+                    frameDecode(frameBuf)
+                frameBuf = bytearray()
+            elif len(frameBuf) <= IKL_MAX_FRAME + 1:
+                frameBuf.append(data[i])
+
+    IK_credit()
@@ -0,0 +1,285 @@
+// Test of the three output codecs of ikevent: IKJsonWriter, IKCborWriter
+// and the IKLink.h binary records. Each event is built with the codec
+// layer of the sketch, examples/ikevent/ikcodec.h. The CBOR of every
+// event must decode to the same object as its JSON line, and the binary
+// frame must decode to the ikrawevent record with dev last.
+//
+// For a typing session, the bench prints the bytes and the encode time per
+// event of each codec.
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "examples/ikevent/ikcodec.h"
+#include "iktest.h"
+
+#define IK_CODEC_COUNT  (3)
+
+static const char *codecNames[] = {"json", "binary", "cbor"};
+
+// The event being checked
+static const uint8_t *out;
+
+static size_t out_send(void)
+{
+    return IK_out_end(&out);
+}
+
+static size_t out_event(uint8_t type, const char *evt, int dev,
+        const char *key1, int val1, const char *key2, int val2)
+{
+    IK_out_begin(type, evt, dev);
+    IK_out_member(key1, val1);
+    IK_out_member(key2, val2);
+    return out_send();
+}
+
+// IK_timeline with count [milestone,state,ms] entries
+static size_t out_timeline(int dev, uint8_t count)
+{
+    IK_out_begin(IK_EVENT_TIMELINE, "timeline", dev);
+    if (ikCodec == IK_CODEC_BINARY) {
+        rawRecord[rawLen++] = count;
+        for (uint8_t i = 0; i < count; i++) {
+            uint32_t ms = i * 1000;
+            rawRecord[rawLen++] = i;
+            rawRecord[rawLen++] = i & 1;
+            rawRecord[rawLen++] = ms;
+            rawRecord[rawLen++] = ms >> 8;
+        }
+        return out_send();
+    }
+    IK_out_member("fwms", 70000);
+    IK_out_member("fwallms", -1);
+    IK_out_key("ms");
+    IK_out_array_begin();
+    for (uint8_t i = 0; i < count; i++) {
+        IK_out_array_begin();
+        IK_out_number(i);
+        IK_out_number(i & 1);
+        IK_out_number(i * 1000);
+        IK_out_array_end();
+    }
+    IK_out_array_end();
+    return out_send();
+}
+
+// A CBOR item as JSON text in the form IKJsonWriter writes. Returns the
+// bytes used or 0 if the item is not one IKCborWriter writes.
+static size_t cbor_to_json(const uint8_t *p, size_t len, std::string &s)
+{
+    if (len == 0) return 0;
+    uint8_t major = p[0] & 0xE0;
+    uint8_t info = p[0] & 0x1F;
+    size_t used = 1;
+    uint32_t arg = info;
+
+    if ((p[0] == IKC_MAP_START) || (p[0] == IKC_ARRAY_START)) {
+        bool map = (p[0] == IKC_MAP_START);
+        s += (map) ? '{' : '[';
+        for (int n = 0; ; n++) {
+            if (used >= len) return 0;
+            if (p[used] == IKC_BREAK) break;
+            if (n > 0) s += ',';
+            size_t k = cbor_to_json(p + used, len - used, s);
+            if (k == 0) return 0;
+            used += k;
+            if (map) {
+                s += ':';
+                k = cbor_to_json(p + used, len - used, s);
+                if (k == 0) return 0;
+                used += k;
+            }
+        }
+        s += (map) ? '}' : ']';
+        return used + 1;
+    }
+    if (info >= 24) {
+        size_t n = (info == 24) ? 1 : (info == 25) ? 2 : (info == 26) ? 4 : 0;
+        if ((n == 0) || (len < 1 + n)) return 0;
+        arg = 0;
+        for (size_t i = 0; i < n; i++) arg = (arg << 8) | p[used++];
+        // Shortest form only
+        if (arg < ((n == 1) ? 24U : (n == 2) ? 0x100U : 0x10000U)) return 0;
+    }
+    char buf[16];
+    switch (major) {
+        case IKC_UNSIGNED:
+            s.append(buf, ikj_format_int(buf, arg));
+            return used;
+        case IKC_NEGATIVE:
+            s.append(buf, ikj_format_int(buf, -1 - (int32_t)arg));
+            return used;
+        case IKC_TEXT: {
+            if (len < used + arg) return 0;
+            IKJsonWriter w;
+            w.string(std::string((const char *)p + used, arg).c_str());
+            s.append((const char *)w.data(), w.length());
+            return used + arg;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Build the event in each codec and compare
+static void check_codecs(size_t (*build)(void))
+{
+    ikCodec = IK_CODEC_JSON;
+    size_t n = build();
+    CHECK((n > 2) && (out[n - 2] == '\r') && (out[n - 1] == '\n'));
+    std::string line((const char *)out, (n > 2) ? n - 2 : 0);
+
+    ikCodec = IK_CODEC_CBOR;
+    n = build();
+    std::string decoded;
+    CHECK(cbor_to_json(out, n, decoded) == n);
+    if (decoded != line) printf("cbor %s\njson %s\n", decoded.c_str(), line.c_str());
+    CHECK(decoded == line);
+
+    ikCodec = IK_CODEC_BINARY;
+    n = build();
+    CHECK((n > 0) && (n <= IKL_MAX_ENCODED));
+}
+
+static size_t build_press(void)
+{
+    return out_event(IK_EVENT_MEMBRANE_PRESS, "press", 1, "x", 3, "y", 23);
+}
+
+static size_t build_sensor(void)
+{
+    return out_event(IK_EVENT_SENSOR_CHANGE, "sensor", 0, "num", 2, "val", 255);
+}
+
+static size_t build_big(void)
+{
+    return out_event(IK_EVENT_VERSION, "fwver", 0, "major", 65536, "minor", INT32_MIN);
+}
+
+static size_t build_connect(void)
+{
+    IK_out_begin(IK_EVENT_CONNECT, "connect", 0);
+    return out_send();
+}
+
+static size_t build_sernum(void)
+{
+    IK_out_begin(IK_EVENT_SERNUM, "sernum", 1);
+    IK_out_member("sn", "C\"1\\2\t34");
+    return out_send();
+}
+
+static size_t build_timeline(void)
+{
+    return out_timeline(0, 16);
+}
+
+static std::vector<uint8_t> lastRecord;
+
+static void on_record(const uint8_t *record, size_t len)
+{
+    lastRecord.assign(record, record + len);
+}
+
+static void test_codecs(void)
+{
+    // ikj_format_int at the edges
+    const int32_t values[] = {0, -1, 9, 10, -2147483647 - 1, 2147483647};
+    const char *texts[] = {"0", "-1", "9", "10", "-2147483648", "2147483647"};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        char buf[12];
+        size_t n = ikj_format_int(buf, values[i]);
+        CHECK((n == strlen(texts[i])) && (memcmp(buf, texts[i], n) == 0));
+    }
+
+    // Exact output for one event
+    ikCodec = IK_CODEC_JSON;
+    size_t n = build_press();
+    const char *text = "{\"evt\":\"press\",\"dev\":1,\"x\":3,\"y\":23}\r\n";
+    CHECK((n == strlen(text)) && (memcmp(out, text, n) == 0));
+    ikCodec = IK_CODEC_CBOR;
+    static const uint8_t map[] = {
+        0xBF, 0x63, 'e', 'v', 't', 0x65, 'p', 'r', 'e', 's', 's',
+        0x63, 'd', 'e', 'v', 0x01, 0x61, 'x', 0x03, 0x61, 'y', 0x17, 0xFF
+    };
+    n = build_press();
+    CHECK((n == sizeof(map)) && (memcmp(out, map, n) == 0));
+
+    // The binary record is the ikrawevent record plus dev
+    ikCodec = IK_CODEC_BINARY;
+    IKLinkDecoder decoder(on_record);
+    n = build_press();
+    decoder.put(out, n);
+    const uint8_t record[] = {IK_EVENT_MEMBRANE_PRESS, 3, 23, 1};
+    CHECK((lastRecord.size() == sizeof(record)) &&
+            (memcmp(lastRecord.data(), record, sizeof(record)) == 0));
+    ikl_event_t event;
+    CHECK(ikl_parse_event(lastRecord.data(), lastRecord.size(), &event));
+    CHECK((event.a == 3) && (event.b == 23));
+    n = build_timeline();
+    decoder.put(out, n);
+    CHECK((lastRecord.size() == 2 + (16 * 4) + 1) && (lastRecord[1] == 16));
+    n = build_sernum();
+    decoder.put(out, n);
+    CHECK(lastRecord.size() == 1 + IK_EEPROM_SN_SIZE + 1);
+    CHECK(decoder.frames == 3);
+
+    check_codecs(build_press);
+    check_codecs(build_sensor);
+    check_codecs(build_big);
+    check_codecs(build_connect);
+    check_codecs(build_sernum);
+    check_codecs(build_timeline);
+
+    // Too long for the line
+    ikCodec = IK_CODEC_JSON;
+    CHECK(out_timeline(0, 40) == 0);
+    ikCodec = IK_CODEC_CBOR;
+    CHECK(out_timeline(0, 40) == 0);
+}
+
+// Typing: press and release pairs with a sensor or switch now and then
+static void bench(void)
+{
+    const int events = 400000;
+
+    for (ikCodec = 0; ikCodec < IK_CODEC_COUNT; ikCodec++) {
+        size_t bytes = 0;
+        srand(43);
+        double start = ikt_seconds();
+        for (int i = 0; i < events; i++) {
+            int x = rand() % 24, y = rand() % 24;
+            switch (i % 16) {
+                case 14:
+                    bytes += out_event(IK_EVENT_SENSOR_CHANGE, "sensor", 0,
+                            "num", x % 3, "val", rand() & 0xFF);
+                    break;
+                case 15:
+                    bytes += out_event(IK_EVENT_SWITCH, "switch", 0, "num", x & 1, "st", y & 1);
+                    break;
+                default:
+                    if (i & 1) {
+                        bytes += out_event(IK_EVENT_MEMBRANE_RELEASE, "release", 0, "x", x, "y", y);
+                    }
+                    else {
+                        bytes += out_event(IK_EVENT_MEMBRANE_PRESS, "press", 0, "x", x, "y", y);
+                    }
+                    break;
+            }
+        }
+        double seconds = ikt_seconds() - start;
+        printf("ikcodec %-6s %5.1f bytes/event, %4.0f ns/event\n", codecNames[ikCodec],
+                (double)bytes / events, seconds / events * 1e9);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikcodec bench");
+    }
+    test_codecs();
+    return ikt_done("ikcodec");
+}
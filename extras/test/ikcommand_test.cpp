@@ -0,0 +1,238 @@
+// Test of the command input of ikrawevent. readCommand feeds the bytes the
+// UART already has to IKLinkDecoder, at most IKL_RX_BUDGET per loop(), and
+// execCommand drops commands that fail ikl_command_ok(). Here the commands
+// arrive in random pieces mixed with garbage, the way a noisy or half
+// connected UART delivers them.
+//
+// With "bench" it times one loop() worth of input instead.
+
+#include <stdlib.h>
+#include "IKLink.h"
+#include "iktest.h"
+
+#define MAX_COMMANDS    (4000)
+
+typedef struct {
+    uint8_t bytes[IKL_MAX_RECORD];
+    size_t len;
+} command_t;
+
+static command_t received[MAX_COMMANDS];
+static int receivedCount;
+static int cmdErrors;
+
+static void exec_command(const uint8_t *command, size_t len)
+{
+    if (!ikl_command_ok(command, len)) {
+        cmdErrors++;
+        return;
+    }
+    if (receivedCount < MAX_COMMANDS) {
+        memcpy(received[receivedCount].bytes, command, len);
+        received[receivedCount].len = len;
+    }
+    receivedCount++;
+}
+
+static void reset_received(void)
+{
+    receivedCount = 0;
+    cmdErrors = 0;
+}
+
+// {type, seq, params...} with random params
+static size_t make_command(uint8_t *command, uint8_t type, uint8_t seq, size_t params)
+{
+    command[0] = type;
+    command[1] = seq;
+    for (size_t i = 0; i < params; i++) command[2 + i] = rand();
+    return 2 + params;
+}
+
+// Every command with every length from none to 3 extra params. Only the
+// length in the table gets through.
+static void test_lengths(void)
+{
+    uint8_t command[IKL_MAX_RECORD];
+    uint8_t frame[IKL_MAX_ENCODED];
+    IKLinkDecoder decoder(exec_command);
+    IKLinkEncoder encoder;
+    int commands = 0;
+
+    for (int type = 0; type < 256; type++) {
+        int params = ikl_command_params(type);
+        if (params >= 0) commands++;
+        for (size_t len = 1; (int)len <= params + 5; len++) {
+            make_command(command, type, len, len - 1);
+            reset_received();
+            CHECK(encoder.add(command, len));
+            decoder.put(frame, encoder.encode(frame));
+            bool ok = (params >= 0) && ((int)len == params + 2);
+            CHECK(receivedCount == (ok ? 1 : 0));
+            CHECK(cmdErrors == (ok ? 0 : 1));
+        }
+    }
+    // IK_CMD_CREDIT has no seq and is checked on its own
+    CHECK(commands == 13);
+    CHECK(ikl_command_params(IK_CMD_CREDIT) < 0);
+}
+
+// Nothing comes out until the delimiter, however the frame is split
+static void test_partial(void)
+{
+    uint8_t command[IKL_MAX_RECORD];
+    uint8_t frame[IKL_MAX_ENCODED];
+    IKLinkDecoder decoder(exec_command);
+    IKLinkEncoder encoder;
+
+    size_t len = make_command(command, IK_CMD_BAUD_TEST, 7, IKL_BAUD_TEST_LEN);
+    encoder.add(command, len);
+    size_t n = encoder.encode(frame);
+    reset_received();
+    for (size_t i = 0; i < n - 1; i++) {
+        CHECK(!decoder.put(frame[i]));
+    }
+    CHECK(receivedCount == 0);
+    CHECK(decoder.put(frame[n - 1]));
+    CHECK(receivedCount == 1);
+    CHECK((received[0].len == len) && (memcmp(received[0].bytes, command, len) == 0));
+}
+
+// Random commands in frames of 1 to 4, with garbage between some frames:
+//   noise then 0x00: ends in an empty or bad frame, nothing is lost
+//   noise alone: runs into the next frame, which is lost
+//   frame cut short: that frame is lost
+//   command with a bad length: dropped by execCommand
+// The bytes reach the UART in random pieces and each loop() reads at most
+// IKL_RX_BUDGET of them.
+static void test_stream(void)
+{
+    static command_t expected[MAX_COMMANDS];
+    static uint8_t stream[MAX_COMMANDS * (IKL_MAX_ENCODED + 16)];
+    uint8_t command[IKL_MAX_RECORD];
+    uint8_t frame[IKL_MAX_ENCODED];
+    IKLinkEncoder encoder;
+    int expectedCount = 0;
+    int expectedErrors = 0;
+    int expectedFrames = 0;
+    size_t len = 0;
+    int sent = 0;
+
+    srand(32);
+    while (sent < MAX_COMMANDS - 4) {
+        int garbage = rand() % 10;
+        bool lost = false;
+        if (garbage == 0) {
+            for (int i = 1 + (rand() % 20); i > 0; i--) stream[len++] = 1 + (rand() % 255);
+            stream[len++] = 0;
+        }
+        else if (garbage == 1) {
+            for (int i = 1 + (rand() % 20); i > 0; i--) stream[len++] = 1 + (rand() % 255);
+            lost = true;
+        }
+
+        int first = expectedCount;
+        for (int i = 1 + (rand() % 4); i > 0; i--) {
+            int type;
+            do {
+                type = rand() & 0xFF;
+            } while (ikl_command_params(type) < 0);
+            size_t n = make_command(command, type, sent++, ikl_command_params(type));
+            if (garbage == 2) {
+                // One param too many or too few
+                n += (rand() & 1) ? 1 : -1;
+                expectedErrors++;
+            }
+            else {
+                memcpy(expected[expectedCount].bytes, command, n);
+                expected[expectedCount].len = n;
+                expectedCount++;
+            }
+            CHECK(encoder.add(command, n));
+        }
+        size_t n = encoder.encode(frame);
+        if (garbage == 3) {
+            n = 1 + (rand() % (n - 2));
+            frame[n - 1] = 0;
+            lost = true;
+        }
+        memcpy(stream + len, frame, n);
+        len += n;
+        if (lost) {
+            expectedCount = first;
+        }
+        else {
+            expectedFrames++;
+        }
+    }
+
+    IKLinkDecoder decoder(exec_command);
+    reset_received();
+    size_t arrived = 0, read = 0, most = 0;
+    int loops = 0;
+    while (read < len) {
+        // The UART receives 0 to 48 bytes per loop, or a burst of 300
+        size_t piece = (rand() % 50 == 0) ? 300 : rand() % 49;
+        arrived = (arrived + piece < len) ? arrived + piece : len;
+        // readCommand
+        size_t avail = arrived - read;
+        if (avail > IKL_RX_BUDGET) avail = IKL_RX_BUDGET;
+        if (avail > most) most = avail;
+        while (avail-- > 0) decoder.put(stream[read++]);
+        loops++;
+    }
+
+    CHECK(most == IKL_RX_BUDGET);
+    CHECK(loops >= (int)(len / IKL_RX_BUDGET));
+    CHECK(decoder.frames == (uint32_t)expectedFrames);
+    CHECK(cmdErrors == expectedErrors);
+    CHECK(receivedCount == expectedCount);
+    for (int i = 0; (i < receivedCount) && (i < expectedCount); i++) {
+        CHECK((received[i].len == expected[i].len) &&
+                (memcmp(received[i].bytes, expected[i].bytes, expected[i].len) == 0));
+    }
+}
+
+// The most work one loop() does on input: IKL_RX_BUDGET bytes of full
+// frames of the longest command.
+static void bench(void)
+{
+    static uint8_t stream[1 << 20];
+    uint8_t command[IKL_MAX_RECORD];
+    IKLinkEncoder encoder;
+    size_t len = 0;
+
+    while (len + IKL_MAX_ENCODED <= sizeof(stream)) {
+        size_t n = make_command(command, IK_CMD_BAUD_TEST, len, IKL_BAUD_TEST_LEN);
+        if (!encoder.add(command, n)) {
+            len += encoder.encode(stream + len);
+            encoder.add(command, n);
+        }
+    }
+
+    IKLinkDecoder decoder(exec_command);
+    reset_received();
+    int loops = 0;
+    double start = ikt_seconds();
+    for (size_t read = 0; read + IKL_RX_BUDGET <= len; read += IKL_RX_BUDGET) {
+        for (size_t i = 0; i < IKL_RX_BUDGET; i++) decoder.put(stream[read + i]);
+        loops++;
+    }
+    double seconds = ikt_seconds() - start;
+    CHECK(cmdErrors == 0);
+
+    printf("ikcommand: %.0f ns per loop of %d bytes, %.0f commands/s\n",
+            seconds / loops * 1e9, IKL_RX_BUDGET, receivedCount / seconds);
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikcommand bench");
+    }
+    test_lengths();
+    test_partial();
+    test_stream();
+    return ikt_done("ikcommand");
+}
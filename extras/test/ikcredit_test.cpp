@@ -0,0 +1,307 @@
+// Simulation of the credit based flow control between ikrawevent and a
+// client over a slow UART. The bridge side is IK_send and IK_flush from
+// ikrawevent.ino: IKLinkEventQueue::pushEvent, IKLinkCredit and
+// IKLinkEncoder, with the TX ring drained at the baud rate. The client reads its RX buffer
+// except while it is busy sending HID reports and grants credit like
+// IK_credit_loop in ikrawevent_ard.ino.
+//
+// The test checks that the client RX buffer never overflows, that
+// membrane, switch and snapshot records all arrive in order, that sensor
+// values are coalesced but the last value arrives, and that every rejected
+// ACK arrives. The bench mode prints the latency and loss of each link,
+// and of two links without credit to show what is lost then.
+
+#include <stdlib.h>
+#include <vector>
+#include "IKLink.h"
+#include "iktest.h"
+
+#define RUN_MS          (20000)
+#define DRAIN_MS        (5000)
+#define CREDIT_DELAY    (2)         // ms from client to bridge
+#define BUSY_PERIOD     (100)       // ms
+#define BUSY_MS         (40)        // ms of each period the client does not read
+
+typedef struct {
+    const char *name;
+    uint32_t baud;
+    size_t rxSize;      // client UART RX buffer
+    uint16_t window;    // 0 for no credit records
+} link_t;
+
+typedef std::vector<uint8_t> record_t;
+
+typedef struct {
+    uint32_t kept;          // records that must not be lost
+    uint32_t keptReceived;
+    uint32_t keptErrors;    // missing, changed or out of order
+    uint32_t sensors;
+    uint32_t sensorsReceived;
+    bool sensorsLast;       // the last value of each sensor arrived
+    uint32_t acks;
+    uint32_t acksReceived;
+    uint32_t ackErrors;     // rejected ACK missing or ACKs out of order
+    bool ackLast;           // the ACK of the last command arrived
+    uint32_t rxOverruns;    // bytes lost in the client RX buffer
+    uint32_t badFrames;
+    uint32_t queueLost;     // IKLinkEventQueue overflows
+    uint32_t stalls;        // ms the IK was not polled
+    double latencySum;      // ms, of the kept records
+    uint32_t latencyMax;
+} result_t;
+
+// Receiver side state for the callbacks
+static std::vector<record_t> rxRecords;
+
+static void on_record(const uint8_t *record, size_t len)
+{
+    rxRecords.push_back(record_t(record, record + len));
+}
+
+// An ACK with seq is, modulo 256, after prev
+static bool seq_after(uint8_t seq, uint8_t prev)
+{
+    uint8_t diff = seq - prev;
+    return (diff > 0) && (diff < 128);
+}
+
+static void simulate(const link_t &link, result_t &r)
+{
+    IKLinkEventQueue queue;
+    IKLinkCredit credit;
+    IKLinkEncoder encoder;
+    IKLinkDecoder decoder(on_record);
+    std::vector<uint8_t> txRing, rxBuffer;
+    std::vector<record_t> device;       // reports the IK holds until polled
+    std::vector<record_t> kept, acks;
+    std::vector<uint32_t> keptTime;
+    std::vector<uint32_t> grants[2];    // {time, count}, in flight to the bridge
+    uint8_t sensorLast[IK_MAX_SENSORS] = {0};
+    uint8_t sensorRx[IK_MAX_SENSORS] = {0};
+    double uartBytes = 0;
+    uint16_t rxCount = 0, rxGranted = 0;
+    uint32_t creditTime = 0;
+    uint8_t frameSeq = 0;
+    uint32_t nextKey = 0, nextSwitch = 0, nextCommand = 0;
+    uint8_t cmdSeq = 0;
+    size_t keptNext = 0, ackNext = 0;
+    uint8_t ackPrev = 0;
+    bool ackAny = false;
+
+    memset(&r, 0, sizeof(r));
+    rxRecords.clear();
+    encoder.useHeader(true);
+    srand(34);
+
+    for (uint32_t now = 0; now < RUN_MS + DRAIN_MS; now++) {
+        // The IK
+        if (now < RUN_MS) {
+            if (now >= nextKey) {
+                // A fingertip presses 1 to 4 cells, released later
+                int cells = 1 + (rand() % 4);
+                uint8_t x = rand() % 24, y = rand() % 24;
+                for (int i = 0; i < cells; i++) {
+                    device.push_back({IK_EVENT_MEMBRANE_PRESS, (uint8_t)(x + i), y});
+                }
+                for (int i = 0; i < cells; i++) {
+                    device.push_back({IK_EVENT_MEMBRANE_RELEASE, (uint8_t)(x + i), y});
+                }
+                nextKey = now + 15 + (rand() % 60);
+            }
+            if (now >= nextSwitch) {
+                device.push_back({IK_EVENT_SWITCH, (uint8_t)(rand() % 2), (uint8_t)(rand() % 2)});
+                nextSwitch = now + 300 + (rand() % 400);
+            }
+            uint8_t sensor = rand() % IK_MAX_SENSORS;
+            sensorLast[sensor] = rand();
+            device.push_back({IK_EVENT_SENSOR_CHANGE, sensor, sensorLast[sensor]});
+            if ((now % 1000) == 500) {
+                record_t snapshot(1 + ikl_event_params(IK_EVENT_SNAPSHOT));
+                snapshot[0] = IK_EVENT_SNAPSHOT;
+                for (size_t i = 1; i < snapshot.size(); i++) snapshot[i] = rand();
+                device.push_back(snapshot);
+            }
+        }
+
+        // Bridge loop(): ikey1.Task() only with headroom in the queue, then
+        // the commands from the client, then IK_flush.
+        size_t polled = 0;
+        while ((polled < device.size()) && (queue.space() >= IKL_QUEUE_HEADROOM)) {
+            const record_t &rec = device[polled++];
+            if (rec[0] == IK_EVENT_SENSOR_CHANGE) {
+                r.sensors++;
+            }
+            else {
+                kept.push_back(rec);
+                keptTime.push_back(now);
+            }
+            if (!queue.pushEvent(rec.data(), rec.size(), now * 1000)) {
+                r.queueLost++;
+            }
+        }
+        device.erase(device.begin(), device.begin() + polled);
+        if (!device.empty()) r.stalls++;
+        while (!grants[0].empty() && (grants[0][0] <= now)) {
+            credit.grant(grants[1][0], link.window, now);
+            grants[0].erase(grants[0].begin());
+            grants[1].erase(grants[1].begin());
+        }
+        if ((now < RUN_MS) && (now >= nextCommand)) {
+            // 1 in 10 commands is rejected
+            record_t ack = {IK_EVENT_ACK, cmdSeq++, (uint8_t)((rand() % 10) == 0)};
+            acks.push_back(ack);
+            r.acks++;
+            queue.pushEvent(ack.data(), ack.size(), now * 1000);
+            nextCommand = now + 1 + (rand() % 20);
+        }
+        while (!queue.empty() && ((1024 - txRing.size()) >= IKL_MAX_ENCODED)) {
+            uint8_t frame[IKL_MAX_ENCODED];
+            uint32_t usec;
+            queue.pop(encoder, credit.available(), credit.idle(), &usec);
+            if (encoder.empty()) break;
+            encoder.setHeader(frameSeq++, usec);
+            size_t len = encoder.encode(frame);
+            txRing.insert(txRing.end(), frame, frame + len);
+            credit.send(len);
+        }
+
+        // The UART, 10 bits per byte
+        uartBytes += link.baud / 10000.0;
+        size_t n = (size_t)uartBytes;
+        if (n > txRing.size()) n = txRing.size();
+        uartBytes -= n;
+        if (txRing.empty()) uartBytes = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (rxBuffer.size() < link.rxSize) {
+                rxBuffer.push_back(txRing[i]);
+            }
+            else {
+                r.rxOverruns++;
+            }
+        }
+        txRing.erase(txRing.begin(), txRing.begin() + n);
+
+        // The client
+        if ((now % BUSY_PERIOD) < (BUSY_PERIOD - BUSY_MS)) {
+            size_t before = rxRecords.size();
+            decoder.put(rxBuffer.data(), rxBuffer.size());
+            rxCount += rxBuffer.size();
+            rxBuffer.clear();
+            for (size_t i = before; i < rxRecords.size(); i++) {
+                const record_t &rec = rxRecords[i];
+                if (rec[0] == IK_EVENT_SENSOR_CHANGE) {
+                    r.sensorsReceived++;
+                    sensorRx[rec[1]] = rec[2];
+                }
+                else if (rec[0] == IK_EVENT_ACK) {
+                    r.acksReceived++;
+                    if (ackAny && !seq_after(rec[1], ackPrev)) r.ackErrors++;
+                    ackAny = true;
+                    ackPrev = rec[1];
+                    // Only accepted ACKs may have been merged into this one
+                    while ((ackNext < acks.size()) && (acks[ackNext] != rec)) {
+                        if (acks[ackNext][2] != 0) r.ackErrors++;
+                        ackNext++;
+                    }
+                    if (ackNext < acks.size()) {
+                        ackNext++;
+                    }
+                    else {
+                        r.ackErrors++;
+                    }
+                }
+                else {
+                    // Anything skipped was lost
+                    size_t k = keptNext;
+                    while ((k < kept.size()) && (kept[k] != rec)) k++;
+                    if (k == kept.size()) {
+                        r.keptErrors++;
+                        continue;
+                    }
+                    r.keptErrors += k - keptNext;
+                    uint32_t latency = now - keptTime[k];
+                    r.latencySum += latency;
+                    if (latency > r.latencyMax) r.latencyMax = latency;
+                    r.keptReceived++;
+                    keptNext = k + 1;
+                }
+            }
+            if ((link.window > 0) && ((now == 0) ||
+                    ((uint16_t)(rxCount - rxGranted) >= (link.window / 2)) ||
+                     ((now - creditTime) >= IKL_CREDIT_PERIOD))) {
+                grants[0].push_back(now + CREDIT_DELAY);
+                grants[1].push_back(rxCount);
+                rxGranted = rxCount;
+                creditTime = now;
+            }
+        }
+    }
+
+    r.kept = kept.size();
+    r.keptErrors += r.kept - keptNext;
+    r.badFrames = decoder.crcErrors + decoder.formatErrors + decoder.overruns;
+    r.queueLost += queue.overflows;
+    r.sensorsLast = (memcmp(sensorRx, sensorLast, sizeof(sensorRx)) == 0);
+    r.ackLast = ackAny && !acks.empty() && (ackPrev == acks.back()[1]);
+}
+
+static const link_t links[] = {
+    {"115200, window 256", 115200, 256, 256},
+    {"19200, window 256", 19200, 256, 256},
+    {"9600, window 256", 9600, 256, 256},
+    {"9600, window IKL_MIN_WINDOW", 9600, 256, IKL_MIN_WINDOW},
+    {"9600, RX buffer IKL_MIN_WINDOW", 9600, IKL_MIN_WINDOW, IKL_MIN_WINDOW},
+};
+
+static void test_links(void)
+{
+    result_t r;
+
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+        simulate(links[i], r);
+        if ((r.rxOverruns != 0) || (r.keptErrors != 0) || (r.ackErrors != 0)) {
+            printf("link \"%s\": %u overruns %u kept errors %u ACK errors\n",
+                    links[i].name, r.rxOverruns, r.keptErrors, r.ackErrors);
+        }
+        CHECK(r.rxOverruns == 0);
+        CHECK(r.badFrames == 0);
+        CHECK(r.queueLost == 0);
+        CHECK(r.kept > 1000);
+        CHECK(r.keptReceived == r.kept);
+        CHECK(r.keptErrors == 0);
+        CHECK(r.sensorsReceived <= r.sensors);
+        CHECK(r.sensorsLast);
+        CHECK(r.ackErrors == 0);
+        CHECK(r.ackLast);
+    }
+}
+
+static void report(const link_t &link)
+{
+    result_t r;
+
+    simulate(link, r);
+    printf("%-32s lost %u/%u edges, %u bytes; sensors %u/%u; ACKs %u/%u; "
+            "latency avg %.0f max %u ms; IK stalled %u ms\n", link.name,
+            r.kept - r.keptReceived, r.kept, r.rxOverruns,
+            r.sensorsReceived, r.sensors, r.acksReceived, r.acks,
+            (r.keptReceived) ? r.latencySum / r.keptReceived : 0.0, r.latencyMax,
+            r.stalls);
+}
+
+static void bench(void)
+{
+    for (size_t i = 0; i < sizeof(links) / sizeof(links[0]); i++) report(links[i]);
+    report({"115200, no credit", 115200, 256, 0});
+    report({"9600, no credit", 9600, 256, 0});
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikcredit bench");
+    }
+    test_links();
+    return ikt_done("ikcredit");
+}
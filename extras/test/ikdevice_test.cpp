@@ -0,0 +1,275 @@
+// Several IntelliKeys objects on the mock USB host of mock/Usb.h. Checks
+// the device registry limit, that TaskAll() polls every device once per
+// call and rotates the first, that eventDevice() names the right IK in
+// callbacks from Task(), from commands called outside Task(), from start()
+// and from Release(), and that a firmware download is only the state of
+// its own IK.
+//
+// Nothing is timed here. Given bench, it runs the same checks.
+
+#include <string>
+#include "IntelliKeys.h"
+#include "iktest.h"
+
+#define PID_FWLOAD      (0x0100)
+#define PID_RUNNING     (0x0101)
+#define LOOP_USEC       (100)
+
+USBHost UsbH;
+IntelliKeys ik0(&UsbH), ik1(&UsbH), ik2(&UsbH), ik3(&UsbH);
+// One more than IK_MAX_DEVICES
+IntelliKeys ikExtra(&UsbH);
+static IntelliKeys *iks[IK_MAX_DEVICES] = {&ik0, &ik1, &ik2, &ik3};
+static uint8_t addrs[IK_MAX_DEVICES];
+
+typedef struct {
+    uint8_t dev;        // eventDevice()->getIndex() in the callback
+    char kind;
+    int a;
+    std::string sn;
+} event_t;
+
+static std::vector<event_t> events;
+
+static void add_event(char kind, int a, const std::string &sn = "")
+{
+    IntelliKeys *ikey = IntelliKeys::eventDevice();
+    event_t e = {(uint8_t)((ikey) ? ikey->getIndex() : 254), kind, a, sn};
+    events.push_back(e);
+}
+
+static void on_press(int x, int) { add_event('p', x); }
+static void on_version(int major, int) { add_event('v', major); }
+static void on_connect(void) { add_event('c', 0); }
+static void on_disconnect(void) { add_event('d', 0); }
+static void on_serial(uint8_t serial[IK_EEPROM_SN_SIZE])
+{
+    add_event('s', 0, std::string((const char *)serial, strnlen((const char *)serial, IK_EEPROM_SN_SIZE)));
+}
+
+static size_t count(uint8_t dev, char kind)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        if ((events[i].dev == dev) && (events[i].kind == kind)) n++;
+    }
+    return n;
+}
+
+// loop() of a sketch
+static void run(uint32_t usec)
+{
+    for (uint32_t t = 0; t < usec; t += LOOP_USEC) {
+        UsbH.Task();
+        IntelliKeys::TaskAll();
+        mock_advance(LOOP_USEC);
+    }
+}
+
+static bool has_milestone(IntelliKeys &ikey, uint8_t milestone)
+{
+    const ik_milestone_t *timeline;
+    uint8_t n = ikey.getTimeline(&timeline);
+    for (uint8_t i = 0; i < n; i++) {
+        if (timeline[i].milestone == milestone) return true;
+    }
+    return false;
+}
+
+// Only IK_MAX_DEVICES objects get an index and a USB driver. Each IK is
+// started by its own object and the serial number read at start is
+// reported by that object.
+static void test_registry(void)
+{
+    for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+        CHECK(iks[i]->getIndex() == i);
+        iks[i]->onMembranePress(on_press);
+        iks[i]->onVersion(on_version);
+        iks[i]->onConnect(on_connect);
+        iks[i]->onDisconnect(on_disconnect);
+        iks[i]->onSerialNum(on_serial);
+    }
+    CHECK(ikExtra.getIndex() == IK_NO_INDEX);
+    CHECK(UsbH.numDrivers == IK_MAX_DEVICES);
+
+    const char *serials[] = {"SN-A", "SN-B", "SN-C", "SN-D"};
+    for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+        addrs[i] = UsbH.attach(PID_RUNNING, serials[i]);
+        CHECK(addrs[i] != 0);
+        CHECK(UsbH.driver(addrs[i]) == iks[i]);
+    }
+    CHECK(UsbH.attach(PID_RUNNING, "SN-E") == 0);
+    run(50000);
+
+    for (uint8_t i = 0; i < IK_MAX_DEVICES; i++) {
+        CHECK(iks[i]->isReady());
+        CHECK(count(i, 'c') == 1);
+        CHECK(count(i, 'v') == 1);
+        CHECK(count(i, 's') == 1);
+        CHECK(has_milestone(*iks[i], IK_MS_EEPROM_DONE));
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        CHECK(events[i].dev < IK_MAX_DEVICES);
+        if (events[i].kind == 's') CHECK(events[i].sn == serials[events[i].dev]);
+    }
+    CHECK(!ikExtra.isReady());
+}
+
+// With nothing to read, each TaskAll() polls each IK once and each IK is
+// first as often as the others. A busy IK still gets only one poll per call.
+static void test_fairness(void)
+{
+    const int calls = 400;
+    int first[MOCK_MAX_ADDRESS] = {0};
+    int polls[MOCK_MAX_ADDRESS] = {0};
+    bool once = true;
+
+    for (int i = 0; i < 200; i++) UsbH.report(addrs[0], IK_EVENT_MEMBRANE_PRESS, 1, 1);
+    for (int i = 0; i < calls; i++) {
+        size_t start = UsbH.transfers.size();
+        IntelliKeys::TaskAll();
+        mock_advance(LOOP_USEC);
+        int pollsThis[MOCK_MAX_ADDRESS] = {0};
+        bool firstSeen = false;
+        for (size_t j = start; j < UsbH.transfers.size(); j++) {
+            const mock_transfer_t &t = UsbH.transfers[j];
+            if ((t.kind != MOCK_IN) && (t.kind != MOCK_IN_EMPTY)) continue;
+            if (!firstSeen) first[t.addr]++;
+            firstSeen = true;
+            polls[t.addr]++;
+            pollsThis[t.addr]++;
+        }
+        for (uint8_t d = 0; d < IK_MAX_DEVICES; d++) {
+            if (pollsThis[addrs[d]] != 1) once = false;
+        }
+    }
+    CHECK(once);
+    for (uint8_t d = 0; d < IK_MAX_DEVICES; d++) {
+        CHECK(first[addrs[d]] == calls / IK_MAX_DEVICES);
+        CHECK(polls[addrs[d]] == calls);
+    }
+    CHECK(UsbH.pending(addrs[0]) == 0);
+    CHECK(count(0, 'p') == 200);
+}
+
+// eventDevice() in callbacks from Task(), from a command called from
+// loop(), from Release() and from start()
+static void test_tagging(void)
+{
+    events.clear();
+    for (uint8_t d = 0; d < IK_MAX_DEVICES; d++) {
+        UsbH.report(addrs[d], IK_EVENT_MEMBRANE_PRESS, 10 + d, 0);
+    }
+    IntelliKeys::TaskAll();
+    for (uint8_t d = 0; d < IK_MAX_DEVICES; d++) {
+        CHECK(count(d, 'p') == 1);
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        CHECK(events[i].a == 10 + events[i].dev);
+    }
+
+    // A command polls for events too. The last callback was from another IK.
+    events.clear();
+    ik2.get_onoff();
+    CHECK(IntelliKeys::eventDevice() == &ik2);
+    UsbH.report(addrs[1], IK_EVENT_MEMBRANE_PRESS, 21, 0);
+    ik1.setLED(IK_LED_SHIFT, 1);
+    UsbH.report(addrs[1], IK_EVENT_MEMBRANE_PRESS, 22, 0);
+    ik1.get_version();
+    // The version event is read by the next command
+    ik2.get_onoff();
+    ik1.get_onoff();
+    CHECK(count(1, 'p') == 2);
+    CHECK(count(1, 'v') == 1);
+    CHECK(events.size() == 3);
+
+    // Pulled out. The failed poll releases the driver.
+    events.clear();
+    UsbH.unplug(addrs[2]);
+    run(LOOP_USEC * 4);
+    CHECK(count(2, 'd') == 1);
+    CHECK(!ik2.isReady());
+    // The host noticed first
+    IntelliKeys::TaskAll();     // eventDevice() is the last IK polled
+    UsbH.detach(addrs[3]);
+    CHECK(count(3, 'd') == 1);
+    CHECK(events.size() == 2);
+
+    // Plugged in again, it goes to the first free object
+    events.clear();
+    UsbH.detach(addrs[2]);
+    CHECK(events.empty());
+    addrs[2] = UsbH.attach(PID_RUNNING, "SN-F");
+    CHECK(UsbH.driver(addrs[2]) == &ik2);
+    UsbH.report(addrs[0], IK_EVENT_MEMBRANE_PRESS, 1, 0);
+    run(50000);
+    CHECK(count(2, 'c') == 1);
+    CHECK(count(2, 'v') == 1);
+    CHECK(count(2, 's') == 1);
+    CHECK(count(0, 'p') == 1);
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].kind == 's') CHECK(events[i].sn == "SN-F");
+    }
+}
+
+// ik3 downloads the firmware while ik0 keeps sending events. The download
+// and its time belong to ik3 alone.
+static void test_download_state(void)
+{
+    events.clear();
+    UsbH.transfers.clear();
+    addrs[3] = UsbH.attach(PID_FWLOAD, "SN-G");
+    CHECK(UsbH.driver(addrs[3]) == &ik3);
+    CHECK(!ik3.isReady());
+
+    int presses = 0;
+    for (int pass = 0; (pass < 100000) && !has_milestone(ik3, IK_MS_FWLOAD_DONE); pass++) {
+        if ((presses < 100) && ((pass % 50) == 0)) {
+            UsbH.report(addrs[0], IK_EVENT_MEMBRANE_PRESS, presses % 24, 0);
+            presses++;
+        }
+        run(LOOP_USEC);
+    }
+    CHECK(has_milestone(ik3, IK_MS_FWLOAD_DONE));
+    CHECK(presses == 100);
+    CHECK(count(0, 'p') == 100);
+    CHECK(count(3, 'c') == 0);
+
+    size_t loads = 0;
+    bool others = false;
+    for (size_t i = 0; i < UsbH.transfers.size(); i++) {
+        const mock_transfer_t &t = UsbH.transfers[i];
+        if (t.kind != MOCK_CTRL) continue;
+        if (t.addr == addrs[3]) loads++;
+        else others = true;
+    }
+    CHECK(loads > 100);
+    CHECK(!others);
+    CHECK(ik3.firmwareLoadTime() > 0);
+    for (uint8_t d = 0; d < 3; d++) {
+        CHECK(iks[d]->firmwareLoadTime() == 0);
+        CHECK(!has_milestone(*iks[d], IK_MS_FWLOAD_START));
+    }
+    CHECK(IntelliKeys::firmwareLoadTimeAll() == ik3.firmwareLoadTime());
+
+    // Re-enumeration with the firmware running continues the timeline
+    uint32_t loadTime = ik3.firmwareLoadTime();
+    UsbH.detach(addrs[3]);
+    addrs[3] = UsbH.attach(PID_RUNNING, "SN-G");
+    CHECK(UsbH.driver(addrs[3]) == &ik3);
+    run(50000);
+    CHECK(ik3.isReady());
+    CHECK(count(3, 'c') == 1);
+    CHECK(has_milestone(ik3, IK_MS_FWLOAD_DONE));
+    CHECK(has_milestone(ik3, IK_MS_EEPROM_DONE));
+    CHECK(ik3.firmwareLoadTime() == loadTime);
+}
+
+int main(int, char **)
+{
+    test_registry();
+    test_fairness();
+    test_tagging();
+    test_download_state();
+    return ikt_done("ikdevice");
+}
@@ -0,0 +1,243 @@
+// Firmware download of two IKs at once on the mock USB host. The records of
+// the loader and the firmware (fwPhase 0 to 3) must go out one IK then the
+// other, at most one per IK per ms, in the right order for each IK. A
+// Release() in the middle of a download must take it off the count of
+// running downloads so firmwareLoadTimeAll() still ends.
+//
+// Run with bench to see the download time of one and of two IKs for a few
+// USB transfer times.
+
+#include <string>
+#include "IntelliKeys.h"
+#include "iktest.h"
+
+#define PID_FWLOAD      (0x0100)
+#define LOOP_USEC       (100)
+
+USBHost UsbH;
+IntelliKeys ikA(&UsbH), ikB(&UsbH);
+
+// Records of each kind in a hex image, as ezusb_DownloadIntelHex sends them
+static size_t hex_records(const INTEL_HEX_RECORD *hex, bool internal)
+{
+    size_t n = 0;
+    for (; hex->Type == 0; hex++) {
+        if (INTERNAL_RAM(hex->Address) == internal) n++;
+    }
+    return n;
+}
+
+// One letter for each control transfer: S = set interface, R/r = 8051
+// reset on/off, E = external RAM record, I = internal RAM record
+static char transfer_kind(const mock_transfer_t &t)
+{
+    if (t.code == 11) return 'S';
+    if ((t.code == ANCHOR_LOAD_INTERNAL) && (t.value == CPUCS_REG)) {
+        return (t.data[0]) ? 'R' : 'r';
+    }
+    return (t.code == ANCHOR_LOAD_INTERNAL) ? 'I' : 'E';
+}
+
+static bool is_record(char kind)
+{
+    return (kind == 'E') || (kind == 'I');
+}
+
+static bool done(IntelliKeys &ikey)
+{
+    const ik_milestone_t *timeline;
+    uint8_t n = ikey.getTimeline(&timeline);
+    return (n > 0) && (timeline[n - 1].milestone == IK_MS_FWLOAD_DONE);
+}
+
+static void run_until_done(int devices)
+{
+    for (int pass = 0; pass < 100000; pass++) {
+        if (done(ikA) && ((devices < 2) || done(ikB))) return;
+        UsbH.Task();
+        IntelliKeys::TaskAll();
+        mock_advance(LOOP_USEC);
+    }
+}
+
+// The control transfers of one IK with runs of records shortened to one
+// letter and counted
+static std::string sequence(uint8_t addr, size_t *records)
+{
+    std::string s;
+    *records = 0;
+    for (size_t i = 0; i < UsbH.transfers.size(); i++) {
+        const mock_transfer_t &t = UsbH.transfers[i];
+        if ((t.kind != MOCK_CTRL) || (t.addr != addr)) continue;
+        char kind = transfer_kind(t);
+        if (is_record(kind)) (*records)++;
+        if (s.empty() || (s[s.size() - 1] != kind) || !is_record(kind)) s += kind;
+    }
+    return s;
+}
+
+// Download time of devices IKs at once. Leaves them detached.
+static uint32_t load(int devices)
+{
+    uint8_t a, b = 0;
+
+    UsbH.transfers.clear();
+    a = UsbH.attach(PID_FWLOAD, "A");
+    if (devices > 1) b = UsbH.attach(PID_FWLOAD, "B");
+    run_until_done(devices);
+    uint32_t usec = IntelliKeys::firmwareLoadTimeAll();
+    UsbH.detach(a);
+    if (b) UsbH.detach(b);
+    return usec;
+}
+
+static void test_interleave(void)
+{
+    const size_t records = hex_records(loader, false) + hex_records(loader, true) +
+        hex_records(firmware, false) + hex_records(firmware, true);
+
+    uint32_t single = load(1);
+    CHECK(single >= records * 1000);
+    CHECK(single == ikA.firmwareLoadTime());
+
+    UsbH.transfers.clear();
+    uint8_t a = UsbH.attach(PID_FWLOAD, "A");
+    uint8_t b = UsbH.attach(PID_FWLOAD, "B");
+    CHECK(UsbH.driver(a) == &ikA);
+    CHECK(UsbH.driver(b) == &ikB);
+    CHECK(IntelliKeys::firmwareLoading() == 0);
+    run_until_done(2);
+    CHECK(done(ikA) && done(ikB));
+    CHECK(IntelliKeys::firmwareLoading() == 0);
+
+    // Each IK gets the loader then the firmware: fwPhase 0, 1, 2, 3. A
+    // phase with no records sends nothing.
+    std::string expected = "SR";
+    if (hex_records(loader, false)) expected += 'E';
+    if (hex_records(loader, true)) expected += 'I';
+    expected += 'r';
+    if (hex_records(firmware, false)) expected += 'E';
+    expected += 'R';
+    if (hex_records(firmware, true)) expected += 'I';
+    expected += 'r';
+    size_t countA, countB;
+    CHECK(sequence(a, &countA) == expected);
+    CHECK(sequence(b, &countB) == expected);
+    CHECK(countA == records);
+    CHECK(countB == records);
+
+    // The records alternate. Neither IK gets more than one record ahead
+    // and one IK never sends two within a ms.
+    int ahead = 0, maxAhead = 0;
+    uint32_t last[2] = {0, 0};
+    bool first[2] = {true, true};
+    bool spaced = true;
+    for (size_t i = 0; i < UsbH.transfers.size(); i++) {
+        const mock_transfer_t &t = UsbH.transfers[i];
+        if ((t.kind != MOCK_CTRL) || !is_record(transfer_kind(t))) continue;
+        int dev = (t.addr == a) ? 0 : 1;
+        ahead += (dev == 0) ? 1 : -1;
+        if (abs(ahead) > maxAhead) maxAhead = abs(ahead);
+        if (!first[dev] && ((t.usec - last[dev]) < 1000)) spaced = false;
+        first[dev] = false;
+        last[dev] = t.usec;
+    }
+    CHECK(maxAhead == 1);
+    CHECK(spaced);
+
+    // Two at once take no longer than one
+    uint32_t both = IntelliKeys::firmwareLoadTimeAll();
+    CHECK(both >= single);
+    CHECK(both <= single + 2 * LOOP_USEC);
+    CHECK(ikA.firmwareLoadTime() <= both);
+    CHECK(ikB.firmwareLoadTime() <= both);
+
+    // The IKs re-enumerate. Releasing a finished download does not change
+    // the count.
+    UsbH.detach(a);
+    UsbH.detach(b);
+    CHECK(IntelliKeys::firmwareLoading() == 0);
+}
+
+// ikA is unplugged halfway through. ikB must finish and
+// firmwareLoadTimeAll() must end.
+static void test_release(void)
+{
+    UsbH.transfers.clear();
+    uint8_t a = UsbH.attach(PID_FWLOAD, "A");
+    uint8_t b = UsbH.attach(PID_FWLOAD, "B");
+    for (int pass = 0; pass < 3000; pass++) {
+        IntelliKeys::TaskAll();
+        mock_advance(LOOP_USEC);
+    }
+    CHECK(IntelliKeys::firmwareLoading() == 2);
+    CHECK(IntelliKeys::firmwareLoadTimeAll() == 0);
+
+    // The next record to ikA fails and its driver is released
+    UsbH.unplug(a);
+    for (int pass = 0; pass < 20; pass++) {
+        IntelliKeys::TaskAll();
+        mock_advance(LOOP_USEC);
+    }
+    CHECK(IntelliKeys::firmwareLoading() == 1);
+    CHECK(!done(ikA));
+    CHECK(IntelliKeys::firmwareLoadTimeAll() == 0);
+    UsbH.detach(a);
+    CHECK(IntelliKeys::firmwareLoading() == 1);
+
+    for (int pass = 0; (pass < 100000) && !done(ikB); pass++) {
+        IntelliKeys::TaskAll();
+        mock_advance(LOOP_USEC);
+    }
+    CHECK(done(ikB));
+    CHECK(IntelliKeys::firmwareLoading() == 0);
+    CHECK(IntelliKeys::firmwareLoadTimeAll() > 0);
+    CHECK(ikB.firmwareLoadTime() > 0);
+    UsbH.detach(b);
+
+    // Pulled out before the download started
+    a = UsbH.attach(PID_FWLOAD, "A");
+    UsbH.detach(a);
+    CHECK(IntelliKeys::firmwareLoading() == 0);
+
+    // Both pulled out during the download
+    a = UsbH.attach(PID_FWLOAD, "A");
+    b = UsbH.attach(PID_FWLOAD, "B");
+    for (int pass = 0; pass < 100; pass++) {
+        IntelliKeys::TaskAll();
+        mock_advance(LOOP_USEC);
+    }
+    CHECK(IntelliKeys::firmwareLoading() == 2);
+    UsbH.detach(b);
+    UsbH.detach(a);
+    CHECK(IntelliKeys::firmwareLoading() == 0);
+
+    // The next download is timed from its own start
+    uint32_t single = load(1);
+    CHECK(single == ikA.firmwareLoadTime());
+}
+
+static void bench(void)
+{
+    const uint32_t costs[] = {0, 250, 500, 1000};
+
+    for (size_t i = 0; i < sizeof(costs) / sizeof(costs[0]); i++) {
+        UsbH.transferUsec = costs[i];
+        uint32_t one = load(1);
+        uint32_t two = load(2);
+        printf("ikfwload: %4u us/transfer: 1 IK %.0f ms, 2 IKs %.0f ms\n",
+                (unsigned)costs[i], one / 1000.0, two / 1000.0);
+    }
+    UsbH.transferUsec = 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikfwload bench");
+    }
+    test_interleave();
+    test_release();
+    return ikt_done("ikfwload");
+}
@@ -0,0 +1,224 @@
+// Test of the IKJsonReader command parser and of commandId(), the ikj_hash
+// dispatch of ikevent in examples/ikevent/ikcommand.h. A set of malformed
+// lines must each be dropped and counted, with the next line parsed as
+// usual. Lines fed in random pieces must parse the same as whole lines.
+//
+// The bench argument measures commands/s instead.
+
+#include <stdlib.h>
+#include <string>
+#include "examples/ikevent/ikcommand.h"
+#include "iktest.h"
+
+// Names of the JSON_CMD values
+static const char *names[] = {
+    NULL, "setsnd", "setled", "getsn", "reset", "getver", "getsnsrs",
+    "getonoff", "getcorr", "setbatch", "setcodec", "record", "replay"
+};
+
+// Feed a line without its line end. Returns the result of the '\n'.
+static bool feed(IKJsonReader &reader, const char *line)
+{
+    while (*line) CHECK(!reader.put(*line++));
+    return reader.put('\n');
+}
+
+static void test_hash(void)
+{
+    // FNV-1a test vectors
+    CHECK(ikj_hash("") == 2166136261UL);
+    CHECK(ikj_hash("a") == 0xE40C292CUL);
+    CHECK(ikj_hash("foobar") == 0xBF9CF968UL);
+
+    for (int id = JSON_CMD_SETSND; id <= JSON_CMD_REPLAY; id++) {
+        CHECK(commandId(names[id]) == id);
+    }
+    const char *unknown[] = {"", "setle", "setledd", "SETLED", "setled ", "getsnsr", "x"};
+    for (size_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++) {
+        CHECK(commandId(unknown[i]) == JSON_CMD_UNKNOWN);
+    }
+    CHECK(commandId(NULL) == JSON_CMD_UNKNOWN);
+}
+
+static void test_valid(void)
+{
+    IKJsonReader reader;
+
+    CHECK(feed(reader, "{\"cmd\":\"setled\",\"num\":1,\"val\":1}"));
+    CHECK(strcmp(reader.string("cmd"), "setled") == 0);
+    CHECK(reader.number("num", -1) == 1);
+    CHECK(reader.number("val", -1) == 1);
+    CHECK(reader.number("dev", 7) == 7);
+    // The wrong kind is the same as missing
+    CHECK(reader.string("num") == NULL);
+    CHECK(reader.number("cmd", 7) == 7);
+
+    CHECK(feed(reader, " \t{ \"cmd\" : \"setsnd\" , \"freq\" : -440 ,\"dura\":999999999 } \r"));
+    CHECK(strcmp(reader.string("cmd"), "setsnd") == 0);
+    CHECK(reader.number("freq", 0) == -440);
+    CHECK(reader.number("dura", 0) == 999999999);
+
+    CHECK(feed(reader, "{}"));
+    CHECK(reader.string("cmd") == NULL);
+
+    // The limits: 7 char keys, 15 char strings, IKJ_MAX_MEMBERS members
+    CHECK(feed(reader, "{\"abcdefg\":\"abcdefghijklmno\"}"));
+    CHECK(strcmp(reader.string("abcdefg"), "abcdefghijklmno") == 0);
+    CHECK(feed(reader, "{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5,\"f\":6,\"g\":7,\"h\":8}"));
+    CHECK(reader.number("h", 0) == 8);
+
+    // Blank lines are not errors
+    CHECK(!reader.put('\n'));
+    CHECK(!feed(reader, "  \r"));
+    CHECK(reader.errors == 0);
+    CHECK(reader.lines == 5);
+}
+
+static void test_malformed(void)
+{
+    static const char *bad[] = {
+        "cmd",
+        "[1,2]",
+        "{",
+        "{\"cmd\":\"getsn\"",
+        "{\"cmd\":\"getsn\"}}",
+        "{\"cmd\":\"getsn\"} x",
+        "{\"cmd\":\"getsn\"}{\"cmd\":\"reset\"}",
+        "{\"cmd\":\"getsn\",}",
+        "{,}",
+        "{\"cmd\" \"getsn\"}",
+        "{\"cmd\":}",
+        "{cmd:\"getsn\"}",
+        "{'cmd':'getsn'}",
+        "{\"cmd\":\"get",
+        "{\"cmd\":\"getsn}",
+        "{\"cmd\":\"get\\\"sn\"}",
+        "{\"cmd\":\"get\\u0041sn\"}",
+        "{\"cmd\":\"get\tsn\"}",
+        "{\"cmd\":{\"name\":\"getsn\"}}",
+        "{\"cmd\":[\"getsn\"]}",
+        "{\"on\":true}",
+        "{\"on\":false}",
+        "{\"on\":null}",
+        "{\"num\":1.5}",
+        "{\"num\":1e3}",
+        "{\"num\":+1}",
+        "{\"num\":-}",
+        "{\"num\":0x10}",
+        "{\"num\":1234567890}",
+        "{\"abcdefgh\":1}",
+        "{\"cmd\":\"abcdefghijklmnop\"}",
+        "{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5,\"f\":6,\"g\":7,\"h\":8,\"i\":9}",
+    };
+    const size_t count = sizeof(bad) / sizeof(bad[0]);
+    IKJsonReader reader;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t errors = reader.errors;
+        if (feed(reader, bad[i])) printf("accepted: %s\n", bad[i]);
+        CHECK(reader.errors == errors + 1);
+        CHECK(reader.string("cmd") == NULL);
+        // The next line is fine
+        CHECK(feed(reader, "{\"cmd\":\"getver\"}"));
+        CHECK(commandId(reader.string("cmd")) == JSON_CMD_GETVER);
+    }
+    CHECK(reader.errors == count);
+    CHECK(reader.lines == count);
+}
+
+// Commands as a client sends them, with both line ends
+static std::string command_stream(int lines)
+{
+    std::string s;
+    char buf[80];
+
+    srand(41);
+    for (int i = 0; i < lines; i++) {
+        switch (rand() % 4) {
+            case 0:
+                snprintf(buf, sizeof(buf), "{\"cmd\":\"setled\",\"num\":%d,\"val\":%d}",
+                        rand() % 12, rand() % 2);
+                break;
+            case 1:
+                snprintf(buf, sizeof(buf), "{\"cmd\":\"setsnd\",\"freq\":%d,\"dura\":%d,\"vol\":%d}",
+                        rand() % 2000, rand() % 500, rand() % 100);
+                break;
+            case 2:
+                snprintf(buf, sizeof(buf), "{\"cmd\":\"getsn\",\"dev\":%d}", rand() % 2);
+                break;
+            default:
+                snprintf(buf, sizeof(buf), "{\"cmd\":\"setbatch\",\"ms\":%d,\"lines\":%d}",
+                        rand() % 10, rand() % 16);
+                break;
+        }
+        s += buf;
+        s += (rand() & 1) ? "\r\n" : "\n";
+    }
+    return s;
+}
+
+// The same lines come out whether the bytes arrive one at a time or in
+// pieces of any size, since loop() only reads what has arrived
+static void test_partial(void)
+{
+    const int lines = 2000;
+    std::string s = command_stream(lines);
+    IKJsonReader whole, pieces;
+    int wholeLines = 0, pieceLines = 0;
+    int32_t wholeSum = 0, pieceSum = 0;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        if (whole.put(s[i])) {
+            wholeLines++;
+            wholeSum += commandId(whole.string("cmd")) + whole.number("num", 0) +
+                whole.number("freq", 0) + whole.number("lines", 0);
+        }
+    }
+    for (size_t i = 0; i < s.size(); ) {
+        size_t n = rand() % 40;
+        for (; (n > 0) && (i < s.size()); n--, i++) {
+            if (pieces.put(s[i])) {
+                pieceLines++;
+                pieceSum += commandId(pieces.string("cmd")) + pieces.number("num", 0) +
+                    pieces.number("freq", 0) + pieces.number("lines", 0);
+            }
+        }
+    }
+    CHECK(wholeLines == lines);
+    CHECK(pieceLines == lines);
+    CHECK(pieceSum == wholeSum);
+    CHECK(whole.errors == 0);
+    CHECK(pieces.errors == 0);
+}
+
+static void bench(void)
+{
+    const int lines = 200000;
+    std::string s = command_stream(lines);
+    IKJsonReader reader;
+    int counts[JSON_CMD_REPLAY + 1] = {0};
+
+    double start = ikt_seconds();
+    for (size_t i = 0; i < s.size(); i++) {
+        if (reader.put(s[i])) counts[commandId(reader.string("cmd"))]++;
+    }
+    double seconds = ikt_seconds() - start;
+    CHECK(reader.lines == (uint32_t)lines);
+    CHECK(counts[JSON_CMD_UNKNOWN] == 0);
+
+    printf("ikjson: %.0f commands/s, %.1f MB/s\n", lines / seconds,
+            s.size() / seconds / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikjson bench");
+    }
+    test_hash();
+    test_valid();
+    test_malformed();
+    test_partial();
+    return ikt_done("ikjson");
+}
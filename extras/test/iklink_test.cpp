@@ -0,0 +1,557 @@
+// Conformance test for the IKLink.h v2 link protocol. Every command and
+// event record the link carries is sent through the encoder and decoder,
+// alone and packed with others, with and without the frame header. Then a
+// corpus of broken frames checks that each one is dropped and that the
+// decoder is back in sync for the next frame, and a long stream with
+// random damage checks that only the undamaged frames get through.
+//
+// "iklink_test bench" also measures encode and decode speed.
+
+#include <stdlib.h>
+#include "IKLink.h"
+#include "iktest.h"
+
+#define MAX_SEEN    (256)
+
+static uint8_t seen[MAX_SEEN][IKL_MAX_RECORD];
+static size_t seenLen[MAX_SEEN];
+static int seenCount;
+static ikl_header_t lastHeader;
+static bool lastHadHeader;
+static int frameCount;
+
+static void on_record(const uint8_t *record, size_t len)
+{
+    CHECK(len <= IKL_MAX_RECORD);
+    if (seenCount < MAX_SEEN) {
+        memcpy(seen[seenCount], record, len);
+        seenLen[seenCount] = len;
+    }
+    seenCount++;
+}
+
+static void on_frame(const ikl_header_t *header)
+{
+    lastHadHeader = (header != NULL);
+    if (header) lastHeader = *header;
+    frameCount++;
+}
+
+static void reset_seen(void)
+{
+    seenCount = 0;
+    frameCount = 0;
+    lastHadHeader = false;
+}
+
+// {type, params...} with n params. The params run through values with
+// 0x00 and 0xFF so COBS has something to do. Returns the record length.
+static size_t make_record(uint8_t *record, uint8_t type, size_t n, uint8_t salt)
+{
+    static const uint8_t values[] = {0x00, 0xFF, 0x01, 0x80, 0x7F, 0x00, 0x00, 0x17};
+    record[0] = type;
+    for (size_t i = 0; i < n; i++) {
+        record[1 + i] = values[(i + salt) % sizeof(values)] ^ (uint8_t)(i / sizeof(values));
+    }
+    return 1 + n;
+}
+
+// Decoded frame body to wire bytes: CRC, COBS and the delimiter
+static size_t raw_frame(const uint8_t *body, size_t len, uint8_t *out)
+{
+    uint8_t buf[IKL_MAX_FRAME + 2];
+    memcpy(buf, body, len);
+    uint16_t crc = ikl_crc16(body, len);
+    buf[len++] = (uint8_t)crc;
+    buf[len++] = (uint8_t)(crc >> 8);
+    size_t n = ikl_cobs_encode(buf, len, out);
+    out[n++] = 0;
+    return n;
+}
+
+static void check_round_trip(const uint8_t *record, size_t len, bool header)
+{
+    IKLinkEncoder encoder;
+    IKLinkDecoder decoder(on_record);
+    uint8_t frame[IKL_MAX_ENCODED];
+
+    decoder.onFrame(on_frame);
+    encoder.useHeader(header);
+    encoder.setHeader(0xA5, 0x80FF0001);
+    CHECK(encoder.add(record, len));
+    size_t expected = encoder.encodedSize();
+    size_t n = encoder.encode(frame);
+    CHECK(n <= expected);
+    CHECK(n <= IKL_MAX_ENCODED);
+    // 0x00 only as the delimiter
+    CHECK(frame[n-1] == 0);
+    CHECK(memchr(frame, 0, n - 1) == NULL);
+
+    reset_seen();
+    for (size_t i = 0; i < n; i++) {
+        CHECK(decoder.put(frame[i]) == (i == (n - 1)));
+    }
+    CHECK(decoder.frames == 1);
+    CHECK(seenCount == 1);
+    CHECK(seenLen[0] == len);
+    CHECK(memcmp(seen[0], record, len) == 0);
+    CHECK(lastHadHeader == header);
+    if (header) {
+        CHECK(lastHeader.seq == 0xA5);
+        CHECK(lastHeader.usec == 0x80FF0001);
+    }
+}
+
+static void test_commands(void)
+{
+    uint8_t record[IKL_MAX_RECORD];
+    int commands = 0;
+
+    for (int cmd = 0; cmd < 256; cmd++) {
+        int params = ikl_command_params(cmd);
+        if (params < 0) continue;
+        commands++;
+        // {type, seq, params...}
+        size_t len = make_record(record, cmd, 1 + params, cmd);
+        check_round_trip(record, len, false);
+        check_round_trip(record, len, true);
+    }
+    // Every command in the ikrawevent README
+    CHECK(commands == 13);
+    CHECK(ikl_command_params(IK_CMD_SET_LEDS) == 4);
+    CHECK(ikl_command_params(IK_CMD_CREDIT) < 0);
+
+    // Credit has no seq, in the old and the new length
+    for (size_t params = 3; params <= 4; params++) {
+        size_t len = make_record(record, IK_CMD_CREDIT, params, 3);
+        check_round_trip(record, len, false);
+    }
+}
+
+static void test_events(void)
+{
+    uint8_t record[IKL_MAX_RECORD];
+    ikl_event_t event;
+    int events = 0;
+
+    memset(&event, 0, sizeof(event));
+
+    for (int type = 0; type < 256; type++) {
+        int params = ikl_event_params(type);
+        if (params < 0) {
+            record[0] = type;
+            CHECK(!ikl_parse_event(record, 3, &event));
+            continue;
+        }
+        events++;
+        size_t len = make_record(record, type, params, type);
+        check_round_trip(record, len, false);
+        check_round_trip(record, len, true);
+
+        CHECK(ikl_parse_event(seen[0], seenLen[0], &event));
+        CHECK(event.type == type);
+        CHECK(event.len == (size_t)params);
+        CHECK(event.a == ((params > 0) ? record[1] : 0));
+        CHECK(event.b == ((params > 1) ? record[2] : 0));
+        if (params > 0) CHECK(!ikl_parse_event(record, len - 1, &event));
+        // Extra bytes are for later fields and are ignored
+        len = make_record(record, type, params + 3, type);
+        CHECK(ikl_parse_event(record, len, &event));
+    }
+    CHECK(events == 18);
+
+    // Variable length events
+    for (int n = 0; n <= IKL_PACKED_MAX_WORDS; n++) {
+        size_t len = make_record(record, IK_EVENT_MEMBRANE_PACKED, 2 * n, n);
+        check_round_trip(record, len, false);
+    }
+    for (int n = 0; n <= 16; n++) {     // IK_TIMELINE_SIZE entries
+        size_t len = make_record(record, IK_EVENT_TIMELINE, 1 + (4 * n), n);
+        record[1] = n;
+        check_round_trip(record, len, true);
+    }
+}
+
+// Records packed into as few frames as possible come out in order
+static void test_multi_record(void)
+{
+    static uint8_t records[MAX_SEEN][IKL_MAX_RECORD];
+    static size_t lens[MAX_SEEN];
+    int count = 0;
+
+    for (int type = 0; (type < 256) && (count < MAX_SEEN); type++) {
+        int params = ikl_event_params(type);
+        if (params < 0) continue;
+        for (uint8_t salt = 0; (salt < 8) && (count < MAX_SEEN); salt++) {
+            lens[count] = make_record(records[count], type, params, salt);
+            count++;
+        }
+    }
+
+    IKLinkEncoder encoder;
+    IKLinkDecoder decoder(on_record);
+    uint8_t frame[IKL_MAX_ENCODED];
+    decoder.onFrame(on_frame);
+    reset_seen();
+    int frames = 0;
+    for (int i = 0; i < count; i++) {
+        if (!encoder.add(records[i], lens[i])) {
+            decoder.put(frame, encoder.encode(frame));
+            frames++;
+            CHECK(encoder.add(records[i], lens[i]));
+        }
+    }
+    decoder.put(frame, encoder.encode(frame));
+    frames++;
+
+    CHECK(frameCount == frames);
+    CHECK(frames < count);
+    CHECK(seenCount == count);
+    for (int i = 0; (i < count) && (i < seenCount); i++) {
+        CHECK((seenLen[i] == lens[i]) && (memcmp(seen[i], records[i], lens[i]) == 0));
+    }
+}
+
+static void test_cobs(void)
+{
+    static uint8_t in[600], out[700], buf[700];
+    const size_t lengths[] = {0, 1, 2, 253, 254, 255, 256, 507, 508, 509, 600};
+
+    for (int pattern = 0; pattern < 3; pattern++) {
+        for (size_t k = 0; k < sizeof(lengths) / sizeof(lengths[0]); k++) {
+            size_t len = lengths[k];
+            for (size_t i = 0; i < len; i++) {
+                in[i] = (pattern == 0) ? 0 : (pattern == 1) ? 1 + (i % 255) : rand();
+            }
+            size_t n = ikl_cobs_encode(in, len, out);
+            CHECK(n <= len + (len / 254) + 1);
+            CHECK(memchr(out, 0, n) == NULL);
+            memcpy(buf, out, n);
+            CHECK(ikl_cobs_decode(buf, n) == len);
+            CHECK(memcmp(buf, in, len) == 0);
+        }
+    }
+}
+
+// The CRC check value of CRC-16/CCITT-FALSE, and one frame on the wire so
+// an accidental change of the format is caught
+static void test_golden(void)
+{
+    CHECK(ikl_crc16((const uint8_t *)"123456789", 9) == 0x29B1);
+
+    // {IK_EVENT_MEMBRANE_PRESS, 3, 0} in a frame without header
+    static const uint8_t wire[] = {0x01, 0x04, 0x03, 0x34, 0x03, 0x03, 0xE6, 0xC6, 0x00};
+    uint8_t params[] = {3, 0};
+    uint8_t frame[IKL_MAX_ENCODED];
+    IKLinkEncoder encoder;
+    encoder.add(IK_EVENT_MEMBRANE_PRESS, params, sizeof(params));
+    size_t n = encoder.encode(frame);
+    CHECK(n == sizeof(wire));
+    CHECK(memcmp(frame, wire, sizeof(wire)) == 0);
+}
+
+typedef struct {
+    const char *name;
+    uint8_t bytes[320];
+    size_t len;
+    uint32_t frames;        // valid frames expected
+    uint32_t rejected;      // crcErrors + formatErrors + overruns expected
+} corrupt_t;
+
+static void add_bytes(corrupt_t *c, const uint8_t *bytes, size_t len)
+{
+    memcpy(c->bytes + c->len, bytes, len);
+    c->len += len;
+}
+
+static void test_corrupt(void)
+{
+    static corrupt_t corpus[16];
+    int count = 0;
+    uint8_t good[IKL_MAX_ENCODED];
+    uint8_t body[IKL_MAX_FRAME];
+    uint8_t params[] = {5, 7};
+    size_t goodLen;
+    corrupt_t *c;
+
+    IKLinkEncoder encoder;
+    encoder.add(IK_EVENT_MEMBRANE_PRESS, params, sizeof(params));
+    encoder.add(IK_EVENT_MEMBRANE_RELEASE, params, sizeof(params));
+    goodLen = encoder.encode(good);
+
+    c = &corpus[count++];
+    c->name = "good frame";
+    add_bytes(c, good, goodLen);
+    c->frames = 1;
+
+    c = &corpus[count++];
+    c->name = "empty frames";
+    add_bytes(c, (const uint8_t *)"\0\0\0", 3);
+
+    c = &corpus[count++];
+    c->name = "bit flip";
+    add_bytes(c, good, goodLen);
+    c->bytes[3] ^= 0x10;
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "cut short";
+    add_bytes(c, good, goodLen / 2);
+    add_bytes(c, (const uint8_t *)"", 1);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "byte lost";
+    add_bytes(c, good, 4);
+    add_bytes(c, good + 5, goodLen - 5);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "noise then frame";
+    add_bytes(c, (const uint8_t *)"\x55\xAA\x12", 3);
+    add_bytes(c, good, goodLen);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "too long";
+    memset(c->bytes, 0x55, 300);
+    c->len = 300;
+    add_bytes(c, (const uint8_t *)"", 1);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "bad COBS";
+    add_bytes(c, (const uint8_t *)"\x05\x01\x02\x00", 4);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "too short for CRC";
+    add_bytes(c, (const uint8_t *)"\x02\x01\x00", 3);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "unknown flags";
+    body[0] = 0x80;
+    body[1] = 3;
+    body[2] = IK_EVENT_MEMBRANE_PRESS;
+    body[3] = 1;
+    body[4] = 2;
+    c->len = raw_frame(body, 5, c->bytes);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "record past the end";
+    body[0] = 0;
+    body[1] = 9;
+    c->len = raw_frame(body, 5, c->bytes);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "record length 0";
+    body[1] = 0;
+    c->len = raw_frame(body, 2, c->bytes);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "header flag without header";
+    body[0] = IKL_FLAG_HEADER;
+    body[1] = 1;
+    body[2] = IK_EVENT_CONNECT;
+    c->len = raw_frame(body, 3, c->bytes);
+    c->rejected = 1;
+
+    c = &corpus[count++];
+    c->name = "v1 framing";
+    add_bytes(c, (const uint8_t *)"\xFF\x03\x34\x05\x07\xFF\x03\x35\x05\x07\x00", 11);
+    c->rejected = 1;
+
+    for (int i = 0; i < count; i++) {
+        c = &corpus[i];
+        IKLinkDecoder decoder(on_record);
+        reset_seen();
+        decoder.put(c->bytes, c->len);
+        uint32_t rejected = decoder.crcErrors + decoder.formatErrors + decoder.overruns;
+        if ((decoder.frames != c->frames) || (rejected != c->rejected)) {
+            printf("corpus \"%s\": %u frames %u rejected\n", c->name,
+                    decoder.frames, rejected);
+        }
+        CHECK(decoder.frames == c->frames);
+        CHECK(rejected == c->rejected);
+        // Back in sync for the next frame
+        int before = seenCount;
+        decoder.put(good, goodLen);
+        CHECK(decoder.frames == c->frames + 1);
+        CHECK(seenCount == before + 2);
+    }
+}
+
+// Random damage to a stream of frames: a bit flip, a byte lost, a byte
+// added or the frame cut short. Every frame left alone must come through
+// and no damaged frame may get through.
+#define NOISE_FRAMES    (5000)
+
+static uint32_t noiseHash;
+static uint32_t noiseIds[NOISE_FRAMES];
+static uint32_t noiseHashes[NOISE_FRAMES];
+static int noiseCount;
+
+// FNV-1a
+static uint32_t hash_bytes(uint32_t h, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+static void on_noise_record(const uint8_t *record, size_t len)
+{
+    noiseHash = hash_bytes(noiseHash, record, len);
+}
+
+static void on_noise_frame(const ikl_header_t *header)
+{
+    CHECK(header != NULL);
+    if (header && (noiseCount < NOISE_FRAMES)) {
+        noiseIds[noiseCount] = header->usec;
+        noiseHashes[noiseCount] = noiseHash;
+    }
+    noiseCount++;
+    noiseHash = 2166136261;
+}
+
+// Damage the bytes before the delimiter so the next frame is not touched
+static size_t damage(uint8_t *frame, size_t n)
+{
+    size_t body = n - 1;
+    size_t at = rand() % body;
+
+    switch (rand() % 4) {
+        case 0:
+            frame[at] ^= 1 << (rand() % 8);
+            return n;
+        case 1:
+            memmove(frame + at, frame + at + 1, n - at - 1);
+            return n - 1;
+        case 2:
+            memmove(frame + at + 1, frame + at, n - at);
+            frame[at] = rand();
+            return n + 1;
+        default:
+            at = 1 + (rand() % (body - 1));
+            frame[at] = 0;
+            return at + 1;
+    }
+}
+
+static void test_noise(void)
+{
+    static uint8_t stream[NOISE_FRAMES * (IKL_MAX_ENCODED + 1)];
+    static uint32_t expected[NOISE_FRAMES];
+    static bool damaged[NOISE_FRAMES];
+    uint8_t frame[IKL_MAX_ENCODED + 1];
+    uint8_t record[IKL_MAX_RECORD];
+    size_t len = 0;
+    int intact = 0;
+    IKLinkEncoder encoder;
+
+    srand(30);
+    encoder.useHeader(true);
+    for (int i = 0; i < NOISE_FRAMES; i++) {
+        uint32_t h = 2166136261;
+        encoder.setHeader(i, i);
+        for (int records = 1 + (rand() % 8); records > 0; records--) {
+            int type;
+            do {
+                type = rand() & 0xFF;
+            } while (ikl_event_params(type) < 0);
+            size_t n = make_record(record, type, ikl_event_params(type), rand());
+            // A snapshot fills most of a frame
+            if (!encoder.add(record, n)) break;
+            h = hash_bytes(h, record, n);
+        }
+        expected[i] = h;
+        size_t n = encoder.encode(frame);
+        damaged[i] = (rand() % 4) == 0;
+        if (damaged[i]) {
+            n = damage(frame, n);
+        }
+        else {
+            intact++;
+        }
+        memcpy(stream + len, frame, n);
+        len += n;
+    }
+
+    IKLinkDecoder decoder(on_noise_record);
+    decoder.onFrame(on_noise_frame);
+    noiseCount = 0;
+    noiseHash = 2166136261;
+    decoder.put(stream, len);
+
+    uint32_t rejected = decoder.crcErrors + decoder.formatErrors + decoder.overruns;
+    CHECK(noiseCount == intact);
+    CHECK(decoder.frames == (uint32_t)intact);
+    CHECK(rejected >= (uint32_t)(NOISE_FRAMES - intact));
+    // In order, and only the frames that were not damaged
+    int next = 0;
+    for (int i = 0; i < noiseCount; i++) {
+        while ((next < NOISE_FRAMES) && damaged[next]) next++;
+        CHECK(noiseIds[i] == (uint32_t)next);
+        if (noiseIds[i] < NOISE_FRAMES) {
+            CHECK(noiseHashes[i] == expected[noiseIds[i]]);
+        }
+        next++;
+    }
+}
+
+// Typing: frames of 8 membrane events
+static void bench(void)
+{
+    const int frames = 200000;
+    const int perFrame = 8;
+    static uint8_t stream[frames * 40];
+    size_t len = 0;
+    IKLinkEncoder encoder;
+
+    double start = ikt_seconds();
+    for (int i = 0; i < frames; i++) {
+        for (int j = 0; j < perFrame; j++) {
+            uint8_t params[] = {(uint8_t)((i + j) % 24), (uint8_t)(j % 24)};
+            encoder.add((j & 1) ? IK_EVENT_MEMBRANE_RELEASE : IK_EVENT_MEMBRANE_PRESS,
+                    params, sizeof(params));
+        }
+        len += encoder.encode(stream + len);
+    }
+    double encodeTime = ikt_seconds() - start;
+
+    IKLinkDecoder decoder(on_record);
+    reset_seen();
+    start = ikt_seconds();
+    decoder.put(stream, len);
+    double decodeTime = ikt_seconds() - start;
+    CHECK(decoder.frames == (uint32_t)frames);
+
+    printf("iklink encode: %.0f frames/s, %.1f MB/s\n", frames / encodeTime,
+            len / encodeTime / 1e6);
+    printf("iklink decode: %.0f frames/s, %.0f events/s, %.1f MB/s\n",
+            frames / decodeTime, (double)frames * perFrame / decodeTime,
+            len / decodeTime / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("iklink bench");
+    }
+    test_commands();
+    test_events();
+    test_multi_record();
+    test_cobs();
+    test_golden();
+    test_corrupt();
+    test_noise();
+    return ikt_done("iklink");
+}
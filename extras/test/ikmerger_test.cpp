@@ -0,0 +1,231 @@
+// IntelliKeysMerger with three IKs on the mock USB host. Events from the
+// IKs arrive interleaved in random bursts and must come out of read() in
+// time order with the events of each IK in order. When the reader stops,
+// each queue must stop at IKM_QUEUE_SIZE with the rest left in the IK,
+// and the dropped, stalled and highWater counters must say what happened.
+//
+// Bench mode: the time of Task() and read() per event with three busy IKs.
+
+#include <string>
+#include "IntelliKeysMerger.h"
+#include "iktest.h"
+
+#define PID_RUNNING     (0x0101)
+#define LOOP_USEC       (100)
+#define NUM_IKS         (3)
+
+USBHost UsbH;
+IntelliKeys ik0(&UsbH), ik1(&UsbH), ik2(&UsbH), ik3(&UsbH);
+IntelliKeys ikExtra(&UsbH);
+IntelliKeysMerger merger;
+static IntelliKeys *iks[NUM_IKS] = {&ik0, &ik1, &ik2};
+static uint8_t addrs[NUM_IKS];
+static const char *serials[NUM_IKS] = {"SN-0", "SN-1", "SN-2"};
+
+static std::vector<ik_merged_event_t> received;
+
+static size_t read_all(size_t max = 1000000)
+{
+    ik_merged_event_t event;
+    size_t n = 0;
+    while ((n < max) && merger.read(&event)) {
+        received.push_back(event);
+        n++;
+    }
+    return n;
+}
+
+static void run(int passes, bool reading)
+{
+    for (int i = 0; i < passes; i++) {
+        UsbH.Task();
+        merger.Task();
+        if (reading) read_all();
+        mock_advance(LOOP_USEC);
+    }
+}
+
+// A press whose x, y carry a sequence number
+static void press(uint8_t d, uint16_t seq)
+{
+    UsbH.report(addrs[d], IK_EVENT_MEMBRANE_PRESS, seq & 0xFF, seq >> 8);
+}
+
+static bool in_time_order(void)
+{
+    for (size_t i = 1; i < received.size(); i++) {
+        if (received[i].usec < received[i - 1].usec) return false;
+    }
+    return true;
+}
+
+static void test_add(void)
+{
+    CHECK(!merger.add(NULL));
+    CHECK(merger.add(&ik0));
+    CHECK(merger.add(&ik1));
+    CHECK(merger.add(&ik2));
+    // No index, though there is room
+    CHECK(!merger.add(&ikExtra));
+    CHECK(merger.add(&ik3));
+    CHECK(!merger.add(&ik0));
+    CHECK(merger.device(2) == &ik2);
+    CHECK(merger.device(IK_NO_INDEX) == NULL);
+    CHECK(merger.stats(4) == NULL);
+    CHECK(strcmp(merger.serialNumber(4), "") == 0);
+}
+
+// Each IK connects, then its serial number is read. The events carry the
+// index and serial number of their own IK.
+static void test_connect(void)
+{
+    for (uint8_t d = 0; d < NUM_IKS; d++) {
+        addrs[d] = UsbH.attach(PID_RUNNING, serials[d]);
+        CHECK(UsbH.driver(addrs[d]) == iks[d]);
+    }
+    received.clear();
+    run(500, true);
+    CHECK(in_time_order());
+    for (uint8_t d = 0; d < NUM_IKS; d++) {
+        int connect = -1, sernum = -1;
+        for (size_t i = 0; i < received.size(); i++) {
+            const ik_merged_event_t &e = received[i];
+            CHECK(e.dev < NUM_IKS);
+            if (e.dev != d) continue;
+            if (e.type == IK_EVENT_CONNECT) {
+                CHECK(connect < 0);
+                connect = i;
+            }
+            if (e.type == IK_EVENT_SERNUM) {
+                CHECK(sernum < 0);
+                sernum = i;
+                CHECK(strcmp(e.sn, serials[d]) == 0);
+            }
+        }
+        CHECK((connect >= 0) && (sernum > connect));
+        CHECK(strcmp(merger.serialNumber(d), serials[d]) == 0);
+        CHECK(merger.stats(d)->dropped == 0);
+    }
+    CHECK(merger.available() == 0);
+}
+
+// Random bursts on random IKs while the reader takes a few events at a
+// time. Nothing is lost and the order holds.
+static void test_order(void)
+{
+    uint16_t sent[NUM_IKS] = {0};
+
+    received.clear();
+    srand(29);
+    for (int step = 0; step < 20000; step++) {
+        if ((rand() % 4) == 0) {
+            uint8_t d = rand() % NUM_IKS;
+            for (int n = 1 + (rand() % 8); n > 0; n--) press(d, sent[d]++);
+        }
+        UsbH.Task();
+        merger.Task();
+        read_all(rand() % 4);
+        mock_advance(rand() % (3 * LOOP_USEC));
+    }
+    run(2000, true);
+    CHECK(merger.available() == 0);
+
+    uint16_t next[NUM_IKS] = {0};
+    bool inOrder = true;
+    for (size_t i = 0; i < received.size(); i++) {
+        const ik_merged_event_t &e = received[i];
+        if (e.type != IK_EVENT_MEMBRANE_PRESS) continue;
+        if ((e.a | (e.b << 8)) != next[e.dev]) inOrder = false;
+        next[e.dev]++;
+        CHECK(strcmp(e.sn, serials[e.dev]) == 0);
+    }
+    CHECK(inOrder);
+    CHECK(in_time_order());
+    for (uint8_t d = 0; d < NUM_IKS; d++) {
+        CHECK(next[d] == sent[d]);
+        CHECK(merger.stats(d)->dropped == 0);
+        CHECK(merger.stats(d)->highWater <= IKM_QUEUE_SIZE - IKM_QUEUE_HEADROOM + 1);
+    }
+}
+
+// The reader stops. ik0 has a lot to say, ik1 a little.
+static void test_backpressure(void)
+{
+    const int burst = 100;
+    const int passes = 200;
+    const uint8_t full = IKM_QUEUE_SIZE - IKM_QUEUE_HEADROOM + 1;
+    uint32_t stalled0 = merger.stats(0)->stalled;
+    uint32_t stalled1 = merger.stats(1)->stalled;
+
+    received.clear();
+    for (int i = 0; i < burst; i++) press(0, i);
+    for (int i = 0; i < 5; i++) press(1, i);
+    run(passes, false);
+
+    // Task() stops polling ik0 and leaves the events in the IK
+    CHECK(merger.available() == full + 5);
+    CHECK(merger.stats(0)->highWater == full);
+    CHECK(merger.stats(0)->stalled - stalled0 == (uint32_t)(passes - full));
+    CHECK(merger.stats(0)->dropped == 0);
+    CHECK(UsbH.pending(addrs[0]) == (size_t)(burst - full));
+    CHECK(merger.stats(1)->stalled == stalled1);
+    CHECK(UsbH.pending(addrs[1]) == 0);
+
+    // A command called from loop() polls whether or not there is room
+    for (int i = 0; i < 5; i++) ik0.get_onoff();
+    CHECK(merger.stats(0)->highWater == IKM_QUEUE_SIZE);
+    CHECK(merger.stats(0)->dropped == 5 - (IKM_QUEUE_SIZE - full));
+
+    // The reader catches up
+    run(passes, true);
+    uint16_t next = 0;
+    int gaps = 0;
+    for (size_t i = 0; i < received.size(); i++) {
+        const ik_merged_event_t &e = received[i];
+        if ((e.dev != 0) || (e.type != IK_EVENT_MEMBRANE_PRESS)) continue;
+        uint16_t seq = e.a | (e.b << 8);
+        if (seq != next) gaps += seq - next;
+        next = seq + 1;
+    }
+    CHECK(next == burst);
+    CHECK(gaps == (int)merger.stats(0)->dropped);
+    CHECK(in_time_order());
+    CHECK(merger.available() == 0);
+    CHECK(UsbH.pending(addrs[0]) == 0);
+}
+
+static void bench(void)
+{
+    const int events = 300000;
+    int sent = 0;
+
+    received.clear();
+    double start = ikt_seconds();
+    while (sent < events) {
+        for (uint8_t d = 0; d < NUM_IKS; d++) {
+            press(d, sent++);
+        }
+        merger.Task();
+        read_all();
+        received.clear();
+        UsbH.transfers.clear();
+        mock_advance(LOOP_USEC);
+    }
+    run(100, true);
+    double seconds = ikt_seconds() - start;
+    printf("ikmerger: %.2f us/event through IntelliKeys and the merger\n",
+            seconds * 1e6 / sent);
+}
+
+int main(int argc, char **argv)
+{
+    test_add();
+    test_connect();
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikmerger bench");
+    }
+    test_order();
+    test_backpressure();
+    return ikt_done("ikmerger");
+}
@@ -0,0 +1,253 @@
+// Test of the packed membrane events of IKLink.h. IKLinkMembranePacker
+// records are sent through the link and ikl_unpack_membrane must give back
+// the same events in the same order.
+//
+// Its bench prints the bytes per membrane event of a typing session,
+// packed and not packed, the way ikrawevent sends them.
+
+#include <stdlib.h>
+#include <vector>
+#include "IKLink.h"
+#include "iktest.h"
+
+typedef struct {
+    bool press;
+    uint8_t x;
+    uint8_t y;
+} membrane_t;
+
+static std::vector<membrane_t> unpacked;
+static size_t linkBytes;
+
+static void on_membrane(bool press, uint8_t x, uint8_t y)
+{
+    membrane_t event = {press, x, y};
+    unpacked.push_back(event);
+}
+
+static void on_record(const uint8_t *record, size_t len)
+{
+    if (record[0] == IK_EVENT_MEMBRANE_PACKED) {
+        ikl_unpack_membrane(record + 1, len - 1, on_membrane);
+    }
+    else if ((record[0] == IK_EVENT_MEMBRANE_PRESS) ||
+            (record[0] == IK_EVENT_MEMBRANE_RELEASE)) {
+        CHECK(len == 3);
+        on_membrane(record[0] == IK_EVENT_MEMBRANE_PRESS, record[1], record[2]);
+    }
+}
+
+static void send(IKLinkEncoder &encoder, IKLinkDecoder &decoder,
+        const uint8_t *record, uint8_t len)
+{
+    uint8_t frame[IKL_MAX_ENCODED];
+
+    if (!encoder.add(record, len)) {
+        size_t n = encoder.encode(frame);
+        linkBytes += n;
+        decoder.put(frame, n);
+        CHECK(encoder.add(record, len));
+    }
+}
+
+static void flush(IKLinkEncoder &encoder, IKLinkDecoder &decoder)
+{
+    uint8_t frame[IKL_MAX_ENCODED];
+
+    if (encoder.empty()) return;
+    size_t n = encoder.encode(frame);
+    linkBytes += n;
+    decoder.put(frame, n);
+}
+
+// Send the events of each poll as IK_send and IK_flush do, packed or not.
+// A frame goes out after each poll. Returns the bytes on the link.
+static size_t send_polls(const std::vector<std::vector<membrane_t> > &polls, bool packed)
+{
+    IKLinkMembranePacker packer;
+    IKLinkEncoder encoder;
+    IKLinkDecoder decoder(on_record);
+    uint8_t record[1 + (2 * IKL_PACKED_MAX_WORDS)];
+
+    unpacked.clear();
+    linkBytes = 0;
+    for (size_t i = 0; i < polls.size(); i++) {
+        for (size_t j = 0; j < polls[i].size(); j++) {
+            const membrane_t &e = polls[i][j];
+            if (packed) {
+                if (packer.add(e.press, e.x, e.y)) continue;
+                send(encoder, decoder, record, packer.take(IK_EVENT_MEMBRANE_PACKED, record));
+                CHECK(packer.add(e.press, e.x, e.y));
+            }
+            else {
+                record[0] = (e.press) ? IK_EVENT_MEMBRANE_PRESS : IK_EVENT_MEMBRANE_RELEASE;
+                record[1] = e.x;
+                record[2] = e.y;
+                send(encoder, decoder, record, 3);
+            }
+        }
+        if (!packer.empty()) {
+            send(encoder, decoder, record, packer.take(IK_EVENT_MEMBRANE_PACKED, record));
+        }
+        flush(encoder, decoder);
+    }
+    CHECK(decoder.crcErrors + decoder.formatErrors + decoder.overruns == 0);
+    return linkBytes;
+}
+
+static bool same_events(const std::vector<std::vector<membrane_t> > &polls)
+{
+    size_t k = 0;
+    for (size_t i = 0; i < polls.size(); i++) {
+        for (size_t j = 0; j < polls[i].size(); j++, k++) {
+            const membrane_t &e = polls[i][j];
+            if ((k >= unpacked.size()) || (unpacked[k].press != e.press) ||
+                    (unpacked[k].x != e.x) || (unpacked[k].y != e.y)) {
+                return false;
+            }
+        }
+    }
+    return k == unpacked.size();
+}
+
+// A fingertip covers 1 to 4 cells in a row on 1 or 2 rows. The presses
+// come in one poll and the releases in a later one. Now and then two
+// fingers overlap.
+static void typing(std::vector<std::vector<membrane_t> > &polls, int touches)
+{
+    polls.clear();
+    srand(36);
+    for (int t = 0; t < touches; t++) {
+        std::vector<membrane_t> press, release;
+        uint8_t x = rand() % 21, y = rand() % 23;
+        uint8_t width = 1 + (rand() % 4);
+        uint8_t rows = 1 + (rand() % 2);
+        for (uint8_t row = y; row < y + rows; row++) {
+            for (uint8_t col = x; col < x + width; col++) {
+                membrane_t p = {true, col, row};
+                membrane_t r = {false, col, row};
+                press.push_back(p);
+                release.push_back(r);
+            }
+        }
+        polls.push_back(press);
+        if ((rand() % 5) == 0) {
+            // Another finger goes down before this one comes up
+            membrane_t p = {true, (uint8_t)(rand() % 24), (uint8_t)(rand() % 24)};
+            membrane_t r = {false, p.x, p.y};
+            polls.push_back(std::vector<membrane_t>(1, p));
+            polls.push_back(release);
+            polls.push_back(std::vector<membrane_t>(1, r));
+        }
+        else {
+            polls.push_back(release);
+        }
+    }
+}
+
+static void test_packer(void)
+{
+    IKLinkMembranePacker packer;
+    uint8_t record[1 + (2 * IKL_PACKED_MAX_WORDS)];
+
+    // The word layout
+    CHECK(packer.empty());
+    CHECK(packer.add(true, 3, 4));
+    CHECK(!packer.empty());
+    CHECK(packer.take(IK_EVENT_MEMBRANE_PACKED, record) == 3);
+    CHECK((record[0] == IK_EVENT_MEMBRANE_PACKED) && (record[1] == 0x80) && (record[2] == 0x8C));
+    CHECK(packer.empty());
+    CHECK(packer.take(IK_EVENT_MEMBRANE_PACKED, record) == 1);
+
+    // Out of range
+    CHECK(!packer.add(true, 32, 0));
+    CHECK(!packer.add(false, 0, 32));
+    CHECK(packer.empty());
+
+    // A whole row is one word, the longest run
+    for (uint8_t x = 0; x < 32; x++) CHECK(packer.add(false, x, 31));
+    CHECK(packer.take(IK_EVENT_MEMBRANE_PACKED, record) == 3);
+    CHECK((record[1] == 0xFF) && (record[2] == 0x03));
+
+    // Runs only grow to the right with the same state and row
+    CHECK(packer.add(true, 5, 1));
+    CHECK(packer.add(true, 6, 1));
+    CHECK(packer.add(false, 7, 1));
+    CHECK(packer.add(true, 8, 2));
+    CHECK(packer.add(true, 7, 2));
+    CHECK(packer.take(IK_EVENT_MEMBRANE_PACKED, record) == 9);
+
+    // Full after IKL_PACKED_MAX_WORDS words
+    for (int i = 0; i < IKL_PACKED_MAX_WORDS; i++) {
+        CHECK(packer.add((i & 1) != 0, 0, 0));
+    }
+    CHECK(!packer.add(false, 0, 0));
+    CHECK(packer.take(IK_EVENT_MEMBRANE_PACKED, record) == 1 + (2 * IKL_PACKED_MAX_WORDS));
+    CHECK(packer.add(false, 0, 0));
+
+    // An odd byte at the end is ignored
+    unpacked.clear();
+    record[1] = 0x80;
+    record[2] = 0x8C;
+    ikl_unpack_membrane(record + 1, 3, on_membrane);
+    CHECK(unpacked.size() == 1);
+}
+
+// Random events and a typing session come back the same, packed or not
+static void test_round_trip(void)
+{
+    std::vector<std::vector<membrane_t> > polls;
+
+    srand(360);
+    for (int i = 0; i < 2000; i++) {
+        std::vector<membrane_t> poll;
+        for (int j = rand() % 40; j > 0; j--) {
+            membrane_t e = {(rand() & 1) != 0, (uint8_t)(rand() % 32), (uint8_t)(rand() % 32)};
+            // Often the next cell in the row so runs form
+            if (!poll.empty() && (rand() & 1)) {
+                e.press = poll.back().press;
+                e.x = (poll.back().x + 1) % 32;
+                e.y = poll.back().y;
+            }
+            poll.push_back(e);
+        }
+        polls.push_back(poll);
+    }
+    send_polls(polls, false);
+    CHECK(same_events(polls));
+    send_polls(polls, true);
+    CHECK(same_events(polls));
+
+    typing(polls, 1000);
+    size_t plain = send_polls(polls, false);
+    CHECK(same_events(polls));
+    size_t packed = send_polls(polls, true);
+    CHECK(same_events(polls));
+    CHECK(packed < plain);
+}
+
+static void bench(void)
+{
+    std::vector<std::vector<membrane_t> > polls;
+    typing(polls, 10000);
+    size_t events = 0;
+    for (size_t i = 0; i < polls.size(); i++) events += polls[i].size();
+
+    size_t plain = send_polls(polls, false);
+    size_t packed = send_polls(polls, true);
+    printf("ikpacked: %zu membrane events in %zu polls\n", events, polls.size());
+    // v1 sent {0xFF, 3, code, x, y} for each event
+    printf("ikpacked: v1 5.00, v2 %.2f, v2 packed %.2f bytes/event\n",
+            (double)plain / events, (double)packed / events);
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikpacked bench");
+    }
+    test_packer();
+    test_round_trip();
+    return ikt_done("ikpacked");
+}
@@ -0,0 +1,395 @@
+// Test of IKRecord.h: the record encoding, the decoder, the IKRecorder ring,
+// logs on a file through IKRecordFile, and IKReplayer timing at 1x, 10x
+// and maximum speed.
+//
+// "ikrecord_test bench" measures the log size and the replay rate of a
+// long typing session at maximum speed. IntelliKeys::replay() needs the
+// USB host library, so the reports go to a callback instead of the driver.
+
+// A small ring so the tests fill it
+#define IKR_RING_SIZE   (64)
+
+#include <stdlib.h>
+#include <vector>
+#include "IKRecord.h"
+#include "IKProtocol.h"
+#include "iktest.h"
+
+typedef std::vector<uint8_t> report_t;
+
+static std::vector<report_t> played;
+
+static void on_report(const uint8_t *report, size_t len)
+{
+    CHECK(len == IKR_REPORT_LEN);
+    played.push_back(report_t(report, report + len));
+}
+
+static report_t press(uint8_t x, uint8_t y)
+{
+    report_t r(IKR_REPORT_LEN, 0);
+    r[0] = IK_EVENT_MEMBRANE_PRESS;
+    r[1] = x;
+    r[2] = y;
+    return r;
+}
+
+// Reads from a byte vector
+class Source {
+    public:
+        Source(const std::vector<uint8_t> &data) : bytes(data), at(0)
+        {
+        }
+
+        int read(void) {
+            return (at < bytes.size()) ? bytes[at++] : -1;
+        }
+
+    private:
+        const std::vector<uint8_t> &bytes;
+        size_t at;
+};
+
+// Takes at most room bytes, like a full flash
+class ShortSink {
+    public:
+        ShortSink(size_t n) : room(n), taken(0)
+        {
+        }
+
+        size_t write(const uint8_t *data, size_t len) {
+            (void)data;
+            size_t n = (len < room) ? len : room;
+            room -= n;
+            taken += n;
+            return n;
+        }
+
+        size_t room;
+        size_t taken;
+};
+
+static void test_encode(void)
+{
+    uint8_t out[IKR_MAX_RECORD];
+    report_t r = press(3, 4);
+
+    // The example in IKRecord.h: a press 3 ms after the previous report
+    static const uint8_t golden[] = {0x83, 0xF7, 0x02, IK_EVENT_MEMBRANE_PRESS, 3, 4};
+    CHECK(ikr_encode(out, 3000, r.data(), r.size()) == sizeof(golden));
+    CHECK(memcmp(out, golden, sizeof(golden)) == 0);
+
+    // Every lead length and every report length
+    const uint32_t times[] = {0, 1, 7, 8, 1023, 1024, 0x7FFFF, 0x80000, 0x7FFFFFF,
+        0x8000000, 0xFFFFFFFF};
+    for (size_t t = 0; t < sizeof(times) / sizeof(times[0]); t++) {
+        for (size_t len = 0; len <= IKR_REPORT_LEN; len++) {
+            uint8_t report[IKR_REPORT_LEN + 2];
+            for (size_t i = 0; i < sizeof(report); i++) report[i] = 0x80 | i;
+            size_t n = ikr_encode(out, times[t], report, len + 2);
+            CHECK(n <= IKR_MAX_RECORD);
+            // Reports longer than IKR_REPORT_LEN are cut
+            for (size_t i = len; i < sizeof(report); i++) report[i] = 0;
+            n = ikr_encode(out, times[t], report, IKR_REPORT_LEN);
+            uint64_t lead = ((uint64_t)times[t] << 4) | len;
+            size_t leadLen = 1;
+            while (lead >>= 7) leadLen++;
+            CHECK(n == leadLen + len);
+
+            IKRecordDecoder decoder;
+            for (size_t i = 0; i < n; i++) {
+                CHECK(decoder.put(out[i]) == ((i == n - 1) ? 1 : 0));
+            }
+            CHECK(!decoder.partial());
+            CHECK(decoder.usec == times[t]);
+            CHECK(memcmp(decoder.report, report, IKR_REPORT_LEN) == 0);
+        }
+    }
+
+    uint8_t header[IKR_HEADER_LEN];
+    ikr_header(header);
+    CHECK(ikr_check_header(header));
+    header[4]++;
+    CHECK(!ikr_check_header(header));
+}
+
+static void test_decoder_errors(void)
+{
+    IKRecordDecoder decoder;
+    static const uint8_t good[] = {0x83, 0xF7, 0x02, IK_EVENT_MEMBRANE_PRESS, 3, 4};
+
+    // n is 9
+    CHECK(decoder.put(0x09) == -1);
+    CHECK(!decoder.partial());
+    // Lead longer than IKR_MAX_LEAD bytes
+    for (int i = 0; i < IKR_MAX_LEAD; i++) CHECK(decoder.put(0x80) == 0);
+    CHECK(decoder.partial());
+    CHECK(decoder.put(0x00) == -1);
+    // usec longer than 32 bits
+    for (int i = 0; i < IKR_MAX_LEAD - 1; i++) CHECK(decoder.put(0x80) == 0);
+    CHECK(decoder.put(0x02) == -1);
+
+    // Back in step for the next record
+    for (size_t i = 0; i < sizeof(good); i++) {
+        CHECK(decoder.put(good[i]) == ((i == sizeof(good) - 1) ? 1 : 0));
+        if (i < sizeof(good) - 1) CHECK(decoder.partial());
+    }
+    CHECK((decoder.usec == 3000) && (decoder.report[1] == 3) && (decoder.report[7] == 0));
+}
+
+// Decode everything read() gives after rewind()
+static std::vector<report_t> read_ring(IKRecorder &rec, int *errors)
+{
+    std::vector<report_t> reports;
+    IKRecordDecoder decoder;
+    int c;
+
+    *errors = 0;
+    rec.rewind();
+    while ((c = rec.read()) >= 0) {
+        int rc = decoder.put(c);
+        if (rc < 0) (*errors)++;
+        if (rc == 1) reports.push_back(report_t(decoder.report, decoder.report + IKR_REPORT_LEN));
+    }
+    if (decoder.partial()) (*errors)++;
+    return reports;
+}
+
+// The ring keeps the newest whole records. Records of every length and
+// lead length are mixed so drop() has to find each record boundary.
+static void test_ring(void)
+{
+    IKRecorder rec;
+    std::vector<report_t> sent;
+    uint32_t usec = 0;
+    int errors;
+
+    srand(50);
+    for (int i = 0; i < 500; i++) {
+        report_t r(IKR_REPORT_LEN, 0);
+        size_t len = rand() % (IKR_REPORT_LEN + 1);
+        for (size_t j = 0; j < len; j++) r[j] = 1 + (rand() % 255);
+        r[0] = i;
+        // 1 to 5 byte leads
+        usec += (rand() & 1) ? rand() % 8 : (uint32_t)rand() << (rand() % 4);
+        rec.record(usec, r.data(), r.size());
+        sent.push_back(r);
+
+        CHECK(rec.used() <= IKR_RING_SIZE);
+        std::vector<report_t> kept = read_ring(rec, &errors);
+        CHECK(errors == 0);
+        CHECK(kept.size() == rec.reports - rec.dropped);
+        CHECK((kept.size() > 0) && (kept.back() == r));
+        // The last kept.size() sent, in order
+        bool same = true;
+        for (size_t j = 0; j < kept.size(); j++) {
+            same = same && (kept[j] == sent[sent.size() - kept.size() + j]);
+        }
+        CHECK(same);
+    }
+    CHECK(rec.reports == 500);
+    CHECK(rec.dropped > 400);
+
+    // Records dropped under the cursor restart read() at the oldest record
+    rec.rewind();
+    CHECK(rec.read() >= 0);
+    for (int i = 0; i < 20; i++) {
+        report_t r = press(i, 0);
+        rec.record(usec += 3000, r.data(), r.size());
+    }
+    IKRecordDecoder decoder;
+    int c, records = 0;
+    while ((c = rec.read()) >= 0) {
+        if (decoder.put(c) == 1) records++;
+    }
+    CHECK(!decoder.partial());
+    CHECK(records == (int)(rec.reports - rec.dropped));
+}
+
+static void test_file(void)
+{
+    IKRecorder rec;
+    FILE *f = tmpfile();
+    IKRecordFile file(f);
+    std::vector<report_t> sent;
+    uint8_t header[IKR_HEADER_LEN];
+    size_t bytes = 0;
+
+    CHECK(f != NULL);
+    if (f == NULL) return;
+    ikr_header(header);
+    CHECK(file.write(header, sizeof(header)) == sizeof(header));
+    // Drain before the ring fills so nothing is dropped
+    for (int i = 0; i < 300; i++) {
+        report_t r = press(i % 24, i / 24);
+        if (i % 7 == 0) r[0] = IK_EVENT_SENSOR_CHANGE;
+        rec.record(1000 + (i * 2500), r.data(), r.size());
+        sent.push_back(r);
+        if (rec.used() > IKR_RING_SIZE / 2) bytes += rec.drain(file);
+    }
+    bytes += rec.drain(file);
+    CHECK(rec.used() == 0);
+    CHECK(rec.dropped == 0);
+    CHECK(rec.writeErrors == 0);
+    CHECK(bytes < sent.size() * IKR_MAX_RECORD);
+
+    // Replay the file as fast as possible
+    IKReplayer replayer(on_report);
+    rewind(f);
+    CHECK(ikr_read_header(file));
+    played.clear();
+    replayer.begin(0, IKR_SPEED_MAX);
+    int loops = 0;
+    while (replayer.loop(file, 0)) loops++;
+    CHECK(played == sent);
+    CHECK(replayer.reports == sent.size());
+    CHECK(replayer.errors == 0);
+    // IKR_REPLAY_BURST reports per loop at most
+    CHECK(loops >= (int)(sent.size() / IKR_REPLAY_BURST));
+
+    // A log cut in the middle of a record plays up to there
+    fseek(f, 0, SEEK_END);
+    fputc(0x85, f);
+    rewind(f);
+    CHECK(ikr_read_header(file));
+    played.clear();
+    replayer.begin(0, IKR_SPEED_MAX);
+    while (replayer.loop(file, 0)) {
+    }
+    CHECK(played == sent);
+    CHECK(replayer.errors == 1);
+
+    // Not a log
+    rewind(f);
+    fputc('X', f);
+    rewind(f);
+    CHECK(!ikr_read_header(file));
+    fclose(f);
+
+    // A full sink cuts the log short and empties the ring
+    report_t r = press(1, 2);
+    for (int i = 0; i < 5; i++) rec.record(i * 1000, r.data(), r.size());
+    ShortSink sink(10);
+    CHECK(rec.drain(sink) == 10);
+    CHECK(rec.writeErrors == 1);
+    CHECK(rec.used() == 0);
+}
+
+// Reports 3 ms apart played at 1x, 10x and maximum speed
+static void test_timing(void)
+{
+    IKRecorder rec;
+    IKReplayer replayer(on_report);
+
+    for (int i = 0; i < 8; i++) {
+        report_t r = press(i, 0);
+        rec.record(1000 + (i * 3000), r.data(), r.size());
+    }
+
+    // 1x. The first report plays right away. Start near the micros() wrap.
+    uint32_t start = 0xFFFFF000;
+    rec.rewind();
+    played.clear();
+    replayer.begin(start, 1);
+    CHECK(replayer.loop(rec, start));
+    CHECK(played.size() == 1);
+    CHECK(replayer.loop(rec, start + 2999));
+    CHECK(played.size() == 1);
+    CHECK(replayer.loop(rec, start + 3000));
+    CHECK(played.size() == 2);
+    CHECK(replayer.loop(rec, start + 9000));
+    CHECK(played.size() == 4);
+    // Ends when the log does
+    CHECK(!replayer.loop(rec, start + 30000));
+    CHECK(played.size() == 8);
+    CHECK(!replayer.isRunning());
+    CHECK(replayer.errors == 0);
+
+    // 10x
+    rec.rewind();
+    played.clear();
+    replayer.begin(0, 10);
+    replayer.loop(rec, 0);
+    replayer.loop(rec, 299);
+    CHECK(played.size() == 1);
+    replayer.loop(rec, 300);
+    CHECK(played.size() == 2);
+    replayer.loop(rec, 2100);
+    CHECK(played.size() == 8);
+
+    // Maximum speed, with a limit per loop
+    rec.rewind();
+    played.clear();
+    replayer.begin(0, IKR_SPEED_MAX);
+    CHECK(replayer.loop(rec, 0, 3));
+    CHECK(played.size() == 3);
+    while (replayer.loop(rec, 0)) {
+    }
+    CHECK(played.size() == 8);
+    CHECK((played[7][0] == IK_EVENT_MEMBRANE_PRESS) && (played[7][1] == 7));
+
+    // stop()
+    rec.rewind();
+    replayer.begin(0, 1);
+    replayer.stop();
+    CHECK(!replayer.loop(rec, 100000));
+}
+
+static uint32_t benchReports;
+
+static void on_bench_report(const uint8_t *report, size_t len)
+{
+    (void)len;
+    benchReports += report[1];
+}
+
+// A long typing session logged to memory, then replayed at maximum speed
+static void bench(void)
+{
+    const int reports = 1000000;
+    std::vector<uint8_t> log;
+    uint8_t out[IKR_MAX_RECORD];
+    uint32_t usec = 0;
+
+    srand(500);
+    double start = ikt_seconds();
+    for (int i = 0; i < reports; i++) {
+        report_t r = press(rand() % 24, rand() % 24);
+        if (i & 1) r[0] = IK_EVENT_MEMBRANE_RELEASE;
+        if ((i % 16) == 15) {
+            r[0] = IK_EVENT_SENSOR_CHANGE;
+            r[2] = rand();
+        }
+        size_t n = ikr_encode(out, usec, r.data(), r.size());
+        log.insert(log.end(), out, out + n);
+        usec = 2000 + (rand() % 60000);
+    }
+    double encodeTime = ikt_seconds() - start;
+
+    Source source(log);
+    IKReplayer replayer(on_bench_report);
+    start = ikt_seconds();
+    replayer.begin(0, IKR_SPEED_MAX);
+    while (replayer.loop(source, 0)) {
+    }
+    double replayTime = ikt_seconds() - start;
+    CHECK(replayer.reports == (uint32_t)reports);
+    CHECK(replayer.errors == 0);
+
+    printf("ikrecord: %.2f bytes/report, record %.0f reports/s, replay %.0f reports/s\n",
+            (double)log.size() / reports, reports / encodeTime, reports / replayTime);
+}
+
+int main(int argc, char **argv)
+{
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikrecord bench");
+    }
+    test_encode();
+    test_decoder_errors();
+    test_ring();
+    test_file();
+    test_timing();
+    return ikt_done("ikrecord");
+}
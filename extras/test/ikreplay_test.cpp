@@ -0,0 +1,202 @@
+// Record and replay of examples/ikevent/iksession.h on the mock USB host.
+// Only the reports of the recorded IK go into ikRecord. A replay feeds them
+// through IntelliKeys::replay(), so the callbacks run with eventDevice()
+// set to the IK the replay goes into, even one that is not connected.
+// Nothing is recorded while a replay runs, also when it goes into the IK
+// that was recorded, and live events of the other IKs keep their own dev.
+//
+// With bench it times a quiet replay of a long session instead.
+
+#include <string>
+#include "IntelliKeys.h"
+#include "examples/ikevent/iksession.h"
+#include "iktest.h"
+
+#define PID_RUNNING     (0x0101)
+#define LOOP_USEC       (100)
+#define PRESS_PASSES    (10)    // loop() passes between recorded presses
+
+USBHost UsbH;
+IntelliKeys ik0(&UsbH), ik1(&UsbH), ik2(&UsbH);
+static IntelliKeys *iks[] = {&ik0, &ik1, &ik2};
+static uint8_t addr0, addr1;
+
+typedef struct {
+    uint8_t dev;
+    uint8_t x;
+    uint8_t y;
+} press_t;
+
+static std::vector<press_t> presses;
+
+static void on_press(int x, int y)
+{
+    IntelliKeys *ikey = IntelliKeys::eventDevice();
+    press_t p = {(uint8_t)((ikey) ? ikey->getIndex() : IK_NO_INDEX), (uint8_t)x, (uint8_t)y};
+    presses.push_back(p);
+}
+
+static size_t count(uint8_t dev)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < presses.size(); i++) {
+        if (presses[i].dev == dev) n++;
+    }
+    return n;
+}
+
+// loop() of the sketch, with the replay like IK_replay_loop()
+static void run(int passes)
+{
+    for (int i = 0; i < passes; i++) {
+        UsbH.Task();
+        IntelliKeys::TaskAll();
+        ikReplay.loop(ikRecord, micros(), (replayQuiet) ? IKR_REPLAY_BURST : 1);
+        mock_advance(LOOP_USEC);
+    }
+}
+
+// n presses on ik0 at x = 0..n-1, y = 0, PRESS_PASSES apart. ik1 presses
+// at the same time with y = 1.
+static void type(int n)
+{
+    for (int i = 0; i < n; i++) {
+        UsbH.report(addr0, IK_EVENT_MEMBRANE_PRESS, i % IK_RESOLUTION_X, 0);
+        UsbH.report(addr1, IK_EVENT_MEMBRANE_PRESS, i % IK_RESOLUTION_X, 1);
+        run(PRESS_PASSES);
+    }
+}
+
+static void replay_all(void)
+{
+    for (int pass = 0; (pass < 1000000) && ikReplay.isRunning(); pass++) run(1);
+}
+
+static void test_setup(void)
+{
+    for (size_t i = 0; i < sizeof(iks) / sizeof(iks[0]); i++) {
+        iks[i]->onMembranePress(on_press);
+        iks[i]->onRawEvent(IK_raw);
+    }
+    addr0 = UsbH.attach(PID_RUNNING, "SN-0");
+    addr1 = UsbH.attach(PID_RUNNING, "SN-1");
+    CHECK(UsbH.driver(addr0) == &ik0);
+    CHECK(UsbH.driver(addr1) == &ik1);
+    run(500);
+    CHECK(ik0.isReady() && ik1.isReady());
+    CHECK(!ik2.isReady());
+}
+
+// Only ik0 is recorded. The replay goes into ik2, which is not connected,
+// while ik0 keeps sending live presses.
+static void test_record(void)
+{
+    const int n = 20;
+
+    setRecord(&ik0, true);
+    uint32_t reports = ikRecord.reports;
+    presses.clear();
+    type(n);
+    CHECK(count(0) == n);
+    CHECK(count(1) == n);
+    CHECK(ikRecord.reports - reports == (uint32_t)n);
+    size_t used = ikRecord.used();
+
+    presses.clear();
+    startReplay(&ik2, 0, false);
+    CHECK(recordDev == NULL);
+    CHECK(replayDev == &ik2);
+    for (int i = 0; (i < 100000) && ikReplay.isRunning(); i++) {
+        if ((i % PRESS_PASSES) == 0) UsbH.report(addr0, IK_EVENT_MEMBRANE_PRESS, 23, 23);
+        run(1);
+    }
+    CHECK(ikReplay.reports == (uint32_t)n);
+    CHECK(ikReplay.errors == 0);
+    CHECK(count(2) == n);
+    CHECK(count(0) > 0);
+    CHECK(ikRecord.used() == used);
+    CHECK(ikRecord.reports - reports == (uint32_t)n);
+
+    int x = 0;
+    bool ok = true;
+    for (size_t i = 0; i < presses.size(); i++) {
+        const press_t &p = presses[i];
+        if (p.dev == 2) {
+            if ((p.x != x++) || (p.y != 0)) ok = false;
+        }
+        else if ((p.dev != 0) || (p.x != 23) || (p.y != 23)) {
+            ok = false;
+        }
+    }
+    CHECK(ok);
+}
+
+// Replaying into the recorded IK does not record the replay again. At
+// speed 1 the presses are as far apart as when they were recorded.
+static void test_replay_self(void)
+{
+    const int n = 10;
+
+    setRecord(&ik1, true);
+    type(n);
+    size_t used = ikRecord.used();
+    uint32_t reports = ikRecord.reports;
+
+    presses.clear();
+    startReplay(&ik1, 1, false);
+    uint32_t start = micros();
+    replay_all();
+    uint32_t usec = micros() - start;
+    CHECK(count(1) == n);
+    CHECK(presses.size() == (size_t)n);
+    for (size_t i = 0; i < presses.size(); i++) CHECK(presses[i].y == 1);
+    CHECK(ikRecord.used() == used);
+    CHECK(ikRecord.reports == reports);
+    CHECK(usec >= (uint32_t)((n - 1) * PRESS_PASSES * LOOP_USEC));
+    CHECK(usec <= (uint32_t)((n + 1) * PRESS_PASSES * LOOP_USEC));
+
+    // Recording again starts over
+    setRecord(&ik1, true);
+    CHECK(ikRecord.used() == 0);
+    CHECK(recordDev == &ik1);
+    setRecord(&ik1, false);
+    CHECK(recordDev == NULL);
+}
+
+// Quiet replays at maximum speed into ik2 of a recording of ik0
+static void bench(void)
+{
+    const int n = 2000;
+
+    setRecord(&ik0, true);
+    for (int i = 0; i < n; i++) {
+        UsbH.report(addr0, IK_EVENT_MEMBRANE_PRESS, i % IK_RESOLUTION_X, i % IK_RESOLUTION_Y);
+        UsbH.report(addr0, IK_EVENT_MEMBRANE_RELEASE, i % IK_RESOLUTION_X, i % IK_RESOLUTION_Y);
+        run(2);
+    }
+    run(1000);
+    int rounds = 0;
+    double start = ikt_seconds();
+    while (ikt_seconds() - start < 0.5) {
+        presses.clear();
+        startReplay(&ik2, 0, true);
+        while (ikReplay.loop(ikRecord, micros())) {
+        }
+        rounds++;
+    }
+    double seconds = ikt_seconds() - start;
+    printf("ikreplay: %u reports per replay, %.0f reports/s through IntelliKeys::replay()\n",
+            (unsigned)ikReplay.reports, rounds * (double)ikReplay.reports / seconds);
+}
+
+int main(int argc, char **argv)
+{
+    test_setup();
+    if (ikt_bench(argc, argv)) {
+        bench();
+        return ikt_done("ikreplay bench");
+    }
+    test_record();
+    test_replay_self();
+    return ikt_done("ikreplay");
+}
@@ -0,0 +1,41 @@
+// Checks and timing for the host tests. CHECK() counts a failure and
+// carries on so one run shows every failure.
+
+#ifndef _IKTEST_H_
+#define _IKTEST_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+static int iktFailures;
+static int iktChecks;
+
+#define CHECK(cond) do { \
+        iktChecks++; \
+        if (!(cond)) { \
+            iktFailures++; \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+// Exit status for main()
+inline int ikt_done(const char *name)
+{
+    printf("%s: %d checks, %d failed\n", name, iktChecks, iktFailures);
+    return (iktFailures) ? 1 : 0;
+}
+
+// True if the program was run as "name bench"
+inline bool ikt_bench(int argc, char **argv)
+{
+    return (argc > 1) && (strcmp(argv[1], "bench") == 0);
+}
+
+inline double ikt_seconds(void)
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif /* _IKTEST_H_ */
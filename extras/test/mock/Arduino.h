@@ -0,0 +1,52 @@
+// The parts of the Arduino core that IntelliKeys.cpp uses, for the host
+// tests. micros() is a simulated clock that only moves when a test calls
+// mock_advance() or delay().
+
+#ifndef _MOCK_ARDUINO_H_
+#define _MOCK_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PSTR(s) (s)
+#define F(s)    (s)
+#define HEX     (16)
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+extern uint32_t mockMicros;
+
+inline uint32_t micros(void)
+{
+    return mockMicros;
+}
+
+inline uint32_t millis(void)
+{
+    return mockMicros / 1000;
+}
+
+inline void mock_advance(uint32_t usec)
+{
+    mockMicros += usec;
+}
+
+inline void delay(uint32_t ms)
+{
+    mock_advance(ms * 1000);
+}
+
+// Output is dropped
+class MockSerial {
+    public:
+        void begin(uint32_t) {}
+        template <class T> size_t print(T, int = 10) { return 0; }
+        template <class T> size_t println(T, int = 10) { return 0; }
+        size_t println(void) { return 0; }
+};
+
+extern MockSerial Serial;
+
+#endif /* _MOCK_ARDUINO_H_ */
@@ -0,0 +1,207 @@
+// A mock of the USB Host Library SAMD for the host tests of IntelliKeys.cpp.
+// It has only what the driver uses. The USBHost emulates the IKs on the bus
+// well enough for the driver to enumerate, download the firmware, start and
+// read the EEPROM. Tests queue input reports, plug and unplug devices and
+// look at the log of transfers.
+
+#ifndef _MOCK_USB_H_
+#define _MOCK_USB_H_
+
+#include <Arduino.h>
+#include <deque>
+#include <vector>
+
+#define USB_NAK_NONAK       (0)
+#define USB_NAK_NOWAIT      (1)
+
+#define USB_ERRORFLOW                               (0xDC)
+#define USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE     (0xD9)
+#define USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL         (0xD6)
+#define USB_ERROR_EPINFO_IS_NULL                    (0xDA)
+#define USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL      (0xD5)
+#define USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED   (0xD1)
+// Returned by every transfer to an unplugged device
+#define MOCK_ERROR_UNPLUGGED                        (0x0E)
+
+#define USB_CLASS_HID               (3)
+#define CP_MASK_COMPARE_ALL         (7)
+#define bmUSB_TRANSFER_TYPE         (0x03)
+#define USB_TRANSFER_TYPE_INTERRUPT (0x03)
+
+#define USBTRACE(s)         ((void)0)
+#define USBTRACE2(s, r)     ((void)0)
+
+#define MOCK_MAX_ADDRESS    (16)
+
+typedef struct
+{
+    uint8_t epAddr;
+    uint8_t maxPktSize;
+    uint8_t bmAttribs;
+    uint8_t bmSndToggle:1;
+    uint8_t bmRcvToggle:1;
+    uint8_t bmNakPower:6;
+} EpInfo;
+
+typedef struct
+{
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t  bDeviceClass;
+    uint8_t  bDeviceSubClass;
+    uint8_t  bDeviceProtocol;
+    uint8_t  bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t  iManufacturer;
+    uint8_t  iProduct;
+    uint8_t  iSerialNumber;
+    uint8_t  bNumConfigurations;
+} __attribute__((packed)) USB_DEVICE_DESCRIPTOR;
+
+typedef struct
+{
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bEndpointAddress;
+    uint8_t  bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t  bInterval;
+} __attribute__((packed)) USB_ENDPOINT_DESCRIPTOR;
+
+typedef struct
+{
+    EpInfo *epinfo;
+    bool lowspeed;
+} UsbDeviceDefinition;
+
+class AddressPool {
+    public:
+        AddressPool();
+        UsbDeviceDefinition *GetUsbDevicePtr(uint32_t addr);
+        uint32_t AllocAddress(uint32_t parent, bool is_hub, uint32_t port);
+        void FreeAddress(uint32_t addr);
+
+    private:
+        EpInfo ep0;
+        UsbDeviceDefinition devices[MOCK_MAX_ADDRESS];
+        bool used[MOCK_MAX_ADDRESS];
+};
+
+class USBDeviceConfig {
+    public:
+        virtual uint32_t Init(uint32_t parent, uint32_t port, uint32_t lowspeed) = 0;
+        virtual uint32_t ConfigureDevice(uint32_t parent, uint32_t port, uint32_t lowspeed) = 0;
+        virtual uint32_t Release() = 0;
+        virtual uint32_t Poll() = 0;
+        virtual uint32_t GetAddress() = 0;
+        virtual bool isReady() = 0;
+        virtual void ResetHubPort(uint32_t port) = 0;
+        virtual uint32_t VIDPIDOK(uint32_t vid, uint32_t pid) = 0;
+        virtual uint32_t DEVCLASSOK(uint32_t klass) = 0;
+        virtual ~USBDeviceConfig() {}
+};
+
+class UsbConfigXtracter {
+    public:
+        virtual void EndpointXtract(uint32_t conf, uint32_t iface, uint32_t alt,
+                uint32_t proto, const USB_ENDPOINT_DESCRIPTOR *ep) = 0;
+        virtual ~UsbConfigXtracter() {}
+};
+
+class USBReadParser {
+    public:
+        UsbConfigXtracter *xtracter;
+};
+
+// getConfDescr() hands the endpoints of the IK to the xtracter
+template <uint32_t CLASS_ID, uint32_t SUBCLASS_ID, uint32_t PROTOCOL_ID, uint32_t MASK>
+class ConfigDescParser : public USBReadParser {
+    public:
+        ConfigDescParser(UsbConfigXtracter *xtractor) {
+            xtracter = xtractor;
+        }
+};
+
+enum {
+    MOCK_CTRL,      // ctrlReq()
+    MOCK_IN,        // inTransfer() that returned a report
+    MOCK_IN_EMPTY,  // inTransfer() with no report waiting
+    MOCK_OUT        // outTransfer()
+};
+
+typedef struct
+{
+    uint32_t usec;      // micros() at the transfer
+    uint8_t  addr;
+    uint8_t  kind;      // MOCK_CTRL, ...
+    uint8_t  code;      // bRequest or the first report byte
+    uint16_t value;     // wValue of a control transfer
+    uint8_t  data[8];   // Report or the start of the control data
+} mock_transfer_t;
+
+class USBHost {
+    public:
+        USBHost();
+
+        // The USB Host Library interface used by IntelliKeys.cpp
+        AddressPool &GetAddressPool() {
+            return pool;
+        }
+        uint32_t RegisterDeviceClass(USBDeviceConfig *pdev);
+        uint32_t getDevDescr(uint32_t addr, uint32_t ep, uint32_t nbytes, uint8_t *dataptr);
+        uint32_t setAddr(uint32_t oldaddr, uint32_t ep, uint32_t newaddr);
+        uint32_t setEpInfoEntry(uint32_t addr, uint32_t epcount, EpInfo *eprecord_ptr);
+        uint32_t getConfDescr(uint32_t addr, uint32_t ep, uint8_t conf, USBReadParser *p);
+        uint32_t setConf(uint32_t addr, uint32_t ep, uint32_t conf_value);
+        uint32_t ctrlReq(uint32_t addr, uint32_t ep, uint8_t bmReqType, uint8_t bRequest,
+                uint8_t wValLo, uint8_t wValHi, uint16_t wInd, uint16_t total,
+                uint16_t nbytes, uint8_t *dataptr, USBReadParser *p);
+        uint32_t inTransfer(uint32_t addr, uint32_t ep, uint16_t *nbytesptr, uint8_t *data);
+        uint32_t outTransfer(uint32_t addr, uint32_t ep, uint16_t nbytes, uint8_t *data);
+        void Init() {}
+        void Task() {}
+
+        // Test side. attach() offers a new IK to the registered drivers in
+        // order, like the enumeration of the real library, and returns its
+        // address, or 0 if no driver took it.
+        uint8_t attach(uint16_t pid, const char *serial);
+        // The host notices the IK is gone and releases its driver
+        void detach(uint8_t addr);
+        // The IK is gone but the host has not noticed. Every transfer fails.
+        void unplug(uint8_t addr);
+        // Queue a report for the driver to read
+        void report(uint8_t addr, uint8_t b0, uint8_t b1 = 0, uint8_t b2 = 0);
+        size_t pending(uint8_t addr);
+        USBDeviceConfig *driver(uint8_t addr);
+
+        std::vector<mock_transfer_t> transfers;
+        uint8_t  numDrivers;
+        // micros() added by each transfer
+        uint32_t transferUsec;
+
+    private:
+        typedef struct
+        {
+            USBDeviceConfig *driver;
+            uint16_t pid;
+            bool     unplugged;
+            uint8_t  eeprom[64];
+            std::deque<std::vector<uint8_t> > reports;
+        } device_t;
+        AddressPool pool;
+        USBDeviceConfig *drivers[8];
+        device_t devices[MOCK_MAX_ADDRESS];
+        uint16_t attachPid;
+        uint8_t  newAddr;
+        void log(uint8_t addr, uint8_t kind, uint8_t code, uint16_t value,
+                const uint8_t *data, size_t len);
+        void respond(uint8_t addr, const uint8_t *command);
+};
+
+inline void Notify(const char *, int) {}
+template <class T> void D_PrintHex(T, int) {}
+
+#endif /* _MOCK_USB_H_ */
@@ -0,0 +1,238 @@
+// The mock USB host and Arduino core of mock/Usb.h and mock/Arduino.h
+
+#include <Usb.h>
+#include "IKProtocol.h"
+
+uint32_t mockMicros;
+MockSerial Serial;
+
+AddressPool::AddressPool()
+{
+    memset(&ep0, 0, sizeof(ep0));
+    ep0.maxPktSize = 8;
+    memset(devices, 0, sizeof(devices));
+    memset(used, 0, sizeof(used));
+    devices[0].epinfo = &ep0;
+    used[0] = true;
+}
+
+UsbDeviceDefinition *AddressPool::GetUsbDevicePtr(uint32_t addr)
+{
+    if ((addr >= MOCK_MAX_ADDRESS) || !used[addr]) return NULL;
+    return &devices[addr];
+}
+
+uint32_t AddressPool::AllocAddress(uint32_t, bool, uint32_t)
+{
+    for (uint32_t addr = 1; addr < MOCK_MAX_ADDRESS; addr++) {
+        if (!used[addr]) {
+            used[addr] = true;
+            devices[addr].epinfo = NULL;
+            return addr;
+        }
+    }
+    return 0;
+}
+
+void AddressPool::FreeAddress(uint32_t addr)
+{
+    if ((addr > 0) && (addr < MOCK_MAX_ADDRESS)) used[addr] = false;
+}
+
+USBHost::USBHost() :
+    numDrivers(0),
+    transferUsec(0),
+    attachPid(0),
+    newAddr(0)
+{
+    for (int i = 0; i < MOCK_MAX_ADDRESS; i++) {
+        devices[i].driver = NULL;
+        devices[i].unplugged = false;
+    }
+}
+
+uint32_t USBHost::RegisterDeviceClass(USBDeviceConfig *pdev)
+{
+    if (numDrivers >= sizeof(drivers) / sizeof(drivers[0])) return 1;
+    drivers[numDrivers++] = pdev;
+    return 0;
+}
+
+uint32_t USBHost::getDevDescr(uint32_t, uint32_t, uint32_t nbytes, uint8_t *dataptr)
+{
+    USB_DEVICE_DESCRIPTOR udd;
+
+    memset(&udd, 0, sizeof(udd));
+    udd.bLength = sizeof(udd);
+    udd.bDescriptorType = 1;
+    udd.bMaxPacketSize0 = 8;
+    udd.idVendor = 0x095e;
+    udd.idProduct = attachPid;
+    udd.bNumConfigurations = 1;
+    memcpy(dataptr, &udd, (nbytes < sizeof(udd)) ? nbytes : sizeof(udd));
+    return 0;
+}
+
+uint32_t USBHost::setAddr(uint32_t, uint32_t, uint32_t newaddr)
+{
+    device_t *dev = &devices[newaddr];
+    newAddr = newaddr;
+    dev->driver = NULL;
+    dev->pid = attachPid;
+    dev->unplugged = false;
+    dev->reports.clear();
+    return 0;
+}
+
+uint32_t USBHost::setEpInfoEntry(uint32_t addr, uint32_t, EpInfo *eprecord_ptr)
+{
+    UsbDeviceDefinition *p = pool.GetUsbDevicePtr(addr);
+    if (p == NULL) return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+    p->epinfo = eprecord_ptr;
+    return 0;
+}
+
+// An IK with the firmware running has an interrupt IN and OUT endpoint
+uint32_t USBHost::getConfDescr(uint32_t, uint32_t, uint8_t, USBReadParser *p)
+{
+    USB_ENDPOINT_DESCRIPTOR ep = {7, 5, 0x81, USB_TRANSFER_TYPE_INTERRUPT, 8, 10};
+
+    p->xtracter->EndpointXtract(1, 0, 0, 0, &ep);
+    ep.bEndpointAddress = 0x02;
+    p->xtracter->EndpointXtract(1, 0, 0, 0, &ep);
+    return 0;
+}
+
+uint32_t USBHost::setConf(uint32_t, uint32_t, uint32_t)
+{
+    return 0;
+}
+
+uint32_t USBHost::ctrlReq(uint32_t addr, uint32_t, uint8_t, uint8_t bRequest,
+        uint8_t wValLo, uint8_t wValHi, uint16_t, uint16_t,
+        uint16_t nbytes, uint8_t *dataptr, USBReadParser *)
+{
+    log(addr, MOCK_CTRL, bRequest, wValLo | (wValHi << 8), dataptr, nbytes);
+    return (devices[addr].unplugged) ? MOCK_ERROR_UNPLUGGED : 0;
+}
+
+uint32_t USBHost::inTransfer(uint32_t addr, uint32_t, uint16_t *nbytesptr, uint8_t *data)
+{
+    device_t *dev = &devices[addr];
+
+    if (dev->unplugged) {
+        log(addr, MOCK_IN_EMPTY, 0, 0, NULL, 0);
+        return MOCK_ERROR_UNPLUGGED;
+    }
+    if (dev->reports.empty()) {
+        log(addr, MOCK_IN_EMPTY, 0, 0, NULL, 0);
+        *nbytesptr = 0;
+        return 0;
+    }
+    std::vector<uint8_t> &report = dev->reports.front();
+    size_t len = (report.size() < *nbytesptr) ? report.size() : *nbytesptr;
+    memcpy(data, &report[0], len);
+    *nbytesptr = len;
+    log(addr, MOCK_IN, data[0], 0, data, len);
+    dev->reports.pop_front();
+    return 0;
+}
+
+uint32_t USBHost::outTransfer(uint32_t addr, uint32_t, uint16_t nbytes, uint8_t *data)
+{
+    log(addr, MOCK_OUT, data[0], 0, data, nbytes);
+    if (devices[addr].unplugged) return MOCK_ERROR_UNPLUGGED;
+    respond(addr, data);
+    return 0;
+}
+
+uint8_t USBHost::attach(uint16_t pid, const char *serial)
+{
+    attachPid = pid;
+    for (uint8_t i = 0; i < numDrivers; i++) {
+        newAddr = 0;
+        if ((drivers[i]->Init(0, 1, 0) != 0) || (newAddr == 0)) continue;
+        device_t *dev = &devices[newAddr];
+        dev->driver = drivers[i];
+        // IntelliKeys::eeprom_t: serial number then the sensor black and
+        // white levels
+        memset(dev->eeprom, 0, sizeof(dev->eeprom));
+        strncpy((char *)dev->eeprom, serial, IK_EEPROM_SN_SIZE);
+        memset(dev->eeprom + IK_EEPROM_SN_SIZE, 20, IK_NUM_SENSORS);
+        memset(dev->eeprom + IK_EEPROM_SN_SIZE + IK_NUM_SENSORS, 200, IK_NUM_SENSORS);
+        return newAddr;
+    }
+    return 0;
+}
+
+void USBHost::detach(uint8_t addr)
+{
+    device_t *dev = &devices[addr];
+
+    if (dev->driver) dev->driver->Release();
+    dev->driver = NULL;
+    dev->unplugged = false;
+    dev->reports.clear();
+}
+
+void USBHost::unplug(uint8_t addr)
+{
+    devices[addr].unplugged = true;
+}
+
+void USBHost::report(uint8_t addr, uint8_t b0, uint8_t b1, uint8_t b2)
+{
+    std::vector<uint8_t> r(8, 0);
+    r[0] = b0;
+    r[1] = b1;
+    r[2] = b2;
+    devices[addr].reports.push_back(r);
+}
+
+size_t USBHost::pending(uint8_t addr)
+{
+    return devices[addr].reports.size();
+}
+
+USBDeviceConfig *USBHost::driver(uint8_t addr)
+{
+    return devices[addr].driver;
+}
+
+void USBHost::log(uint8_t addr, uint8_t kind, uint8_t code, uint16_t value,
+        const uint8_t *data, size_t len)
+{
+    mock_transfer_t t;
+
+    memset(&t, 0, sizeof(t));
+    t.usec = micros();
+    t.addr = addr;
+    t.kind = kind;
+    t.code = code;
+    t.value = value;
+    if (data) memcpy(t.data, data, (len < sizeof(t.data)) ? len : sizeof(t.data));
+    transfers.push_back(t);
+    mock_advance(transferUsec);
+}
+
+// The replies of the IK firmware to the commands the driver sends at start
+void USBHost::respond(uint8_t addr, const uint8_t *command)
+{
+    device_t *dev = &devices[addr];
+
+    switch (command[0]) {
+        case IK_CMD_GET_VERSION:
+            report(addr, IK_EVENT_VERSION, 3, 1);
+            break;
+        case IK_CMD_EEPROM_READBYTE:
+            if ((command[1] >= 0x80) && ((command[1] - 0x80) < (int)sizeof(dev->eeprom))) {
+                report(addr, IK_EVENT_EEPROM_READBYTE, dev->eeprom[command[1] - 0x80], command[1]);
+            }
+            break;
+        case IK_CMD_ALL_SENSORS:
+            for (uint8_t i = 0; i < IK_NUM_SENSORS; i++) {
+                report(addr, IK_EVENT_SENSOR_CHANGE, i, 20);
+            }
+            break;
+    }
+}
@@ -17,8 +17,6 @@ arduino --install-boards "arduino:samd"
 arduino --pref "boardsmanager.additional.urls=https://adafruit.github.io/arduino-board-index/package_adafruit_index.json" --save-prefs
 arduino --install-boards "adafruit:samd"
 cd $LIBDIR
-# Install the latest Arduino JSON library
-arduino --install-library "ArduinoJson"
 arduino --install-library "Adafruit DotStar"
 git clone https://github.com/adafruit/Adafruit_TinyUSB_Arduino
 git clone https://github.com/adafruit/Adafruit_SPIFlash